@@ -10,25 +10,53 @@ CONFIG += c++11
 
 SOURCES += \
     Source/blendingcomputationunit.cpp \
+    Source/blockconjugategradient.cpp \
+    Source/boundaryresponse.cpp \
     Source/computationhandler.cpp \
+    Source/domaindecompositionsolver.cpp \
+    Source/fastpoissonsolver.cpp \
     Source/graphicslassoitem.cpp \
     Source/imagegraphicsview.cpp \
+    Source/imageplanes.cpp \
+    Source/jointblendingcomputationunit.cpp \
+    Source/laplacianoperator.cpp \
     Source/main.cpp \
     Source/mainwindow.cpp \
+    Source/meanvaluecloner.cpp \
+    Source/multigridsolver.cpp \
     Source/pastedsourceitem.cpp \
+    Source/responsecomputationunit.cpp \
+    Source/scanlinerasterizer.cpp \
+    Source/selectionmask.cpp \
     Source/sourcegraphicsscene.cpp \
     Source/targetgraphicsscene.cpp \
+    Source/tiledblendingcomputationunit.cpp \
+    Source/tiledimageplanes.cpp \
     Source/transfercomputationunit.cpp
 
 HEADERS += \
     Source/blendingcomputationunit.h \
+    Source/blockconjugategradient.h \
+    Source/boundaryresponse.h \
     Source/computationhandler.h \
+    Source/domaindecompositionsolver.h \
+    Source/fastpoissonsolver.h \
     Source/graphicslassoitem.h \
     Source/imagegraphicsview.h \
+    Source/imageplanes.h \
+    Source/jointblendingcomputationunit.h \
+    Source/laplacianoperator.h \
     Source/mainwindow.h \
+    Source/meanvaluecloner.h \
+    Source/multigridsolver.h \
     Source/pastedsourceitem.h \
+    Source/responsecomputationunit.h \
+    Source/scanlinerasterizer.h \
+    Source/selectionmask.h \
     Source/sourcegraphicsscene.h \
     Source/targetgraphicsscene.h \
+    Source/tiledblendingcomputationunit.h \
+    Source/tiledimageplanes.h \
     Source/transfercomputationunit.h
 
 FORMS += \
@@ -37,6 +65,10 @@ FORMS += \
 
 INCLUDEPATH += 3rdparty/eigen Source/
 
+# The laplacian stencil and the solvers are vectorized by Eigen (SSE2 by default on x86-64).
+# Uncomment to use AVX2/FMA on machines supporting it.
+#QMAKE_CXXFLAGS += -mavx2 -mfma
+
 RC_ICONS = Resources/Painting.ico
 ICON = Resources/Painting.icns
 
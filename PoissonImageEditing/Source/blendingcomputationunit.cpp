@@ -1,24 +1,86 @@
 #include "blendingcomputationunit.h"
+#include "blockconjugategradient.h"
+#include "domaindecompositionsolver.h"
+#include "fastpoissonsolver.h"
+#include "laplacianoperator.h"
+#include "multigridsolver.h"
+
+#include <QElapsedTimer>
+
+#include <cmath>
+
+#define PROGRESS_INTERVAL 100   // ms between two progressChanged() signals
 
 BlendingComputationUnit::BlendingComputationUnit(
-        int channel_num,
         QImage target_img,
-        MatrixXd src_img_ch,
-        SelectMaskMatrices masks,
-        SparseMatrixXd laplacian,
-        bool mixed_blending)
+        QRect target_rect,
+        ImagePlanes src_img,
+        GuidanceFieldPtr guidance,
+        UnknownIndexMap index_map,
+        UnknownComponentsPtr components,
+        LaplacianFactorizationPtr factorization,
+        QVector<DomainDecompositionSolverPtr> dd_solvers,
+        BoundaryResponsePtr boundary_response,
+        bool mixed_blending,
+        SolverType solver_type,
+        float solver_tolerance,
+        MatrixX3d previous_solution,
+        Eigen::RowVector3f previous_boundary_mean)
     : QObject(), QRunnable()
 {
-    m_channel_num = channel_num;
     m_target_img = target_img;
-    m_src_img_ch = src_img_ch;
-    m_masks = masks;
-    m_laplacian = laplacian;
+    m_target_rect = target_rect;
+    m_src_img = src_img;
+    m_guidance = guidance;
+    m_index_map = index_map;
+    m_components = components;
+    m_factorization = factorization;
+    m_dd_solvers = dd_solvers;
+    m_boundary_response = boundary_response;
     m_mixed_blending = mixed_blending;
+    m_solver_type = solver_type;
+    m_solver_tolerance = solver_tolerance;
+    m_previous_solution = previous_solution;
+    m_previous_boundary_mean = previous_boundary_mean;
+
+    m_stats.solver = solver_type;
+    m_stats.iterations = 0;
+    m_stats.error = 0.0;
+    m_stats.converged = false;
+    m_stats.setup_time = 0;
+    m_stats.solve_time = 0;
+    m_stats.bytes_allocated = 0;
+
+    m_initial_error = 0.0;
+
+    m_generation = 0;
 
     setAutoDelete(false);
 }
 
+/**
+ * @brief BlendingComputationUnit::cancel
+ *
+ * This function asks the job to stop as soon as possible (thread-safe).
+ * The running solver stops at its next iteration and no image is produced,
+ * but computationFinished() is still emitted.
+ */
+void BlendingComputationUnit::cancel() {
+    m_cancelled.storeRelease(1);
+}
+
+bool BlendingComputationUnit::isCancelled() const {
+    return m_cancelled.loadAcquire() != 0;
+}
+
+void BlendingComputationUnit::setGeneration(quint64 generation) {
+    m_generation = generation;
+}
+
+quint64 BlendingComputationUnit::generation() const {
+    return m_generation;
+}
+
 void BlendingComputationUnit::run() {
     // Emit started signal
     emit computationStarted();
@@ -30,51 +92,369 @@ void BlendingComputationUnit::run() {
     emit computationFinished();
 }
 
+/**
+ * @brief BlendingComputationUnit::reportProgress
+ * @param iterations
+ * @param error
+ * @param part
+ * @param parts
+ *
+ * This function is called by the solvers after each iteration (part of parts independent solves).
+ * The progress is the decrease of the residual towards the tolerance, in log scale.
+ * The progressChanged() signal is throttled to one every PROGRESS_INTERVAL ms.
+ */
+void BlendingComputationUnit::reportProgress(int iterations, float error, int part, int parts) {
+    // The first report of a solve is its initial residual
+    if (iterations == 0) {
+        m_initial_error = error;
+    }
+
+    if (m_progress_timer.isValid() && m_progress_timer.elapsed() < PROGRESS_INTERVAL)
+        return;
+
+    m_progress_timer.start();
+
+    float fraction = 1.0;
+
+    if (error > m_solver_tolerance && m_initial_error > m_solver_tolerance) {
+        fraction = std::log(m_initial_error / error) / std::log(m_initial_error / m_solver_tolerance);
+    }
+
+    emit progressChanged(iterations, error, (part + qBound(0.0f, fraction, 1.0f)) / parts);
+}
+
 void BlendingComputationUnit::computeBlendingData() {
-    // Convert the target image into matrices
-    MatrixXd tgt_matrix_ch = ComputationHandler::imageToChannelMatrix(m_target_img, m_channel_num);
+    // Setup, then solve time
+    QElapsedTimer timer;
+    timer.start();
+
+    // Target part under the item: a window of the planes of the whole target (converted once)
+    ImagePlanes tgt_planes = ComputationHandler::targetWindowPlanes(m_target_img, m_target_rect);
+
+    if (isCancelled())
+        return;
+
+    const SolverType solver_type = componentSolverType(m_index_map);
+
+    m_stats.solver = solver_type;
+
+    // The precomputed boundary response gives the plain blending with a dense product.
+    // Its cost is close to the Cholesky substitutions (both are memory bound), so it
+    // only replaces the iterative solvers and the solves that would need a factorization.
+    const bool use_response = !m_mixed_blending && !m_boundary_response.isNull() &&
+                              !(solver_type == SolverCholesky && !m_factorization.isNull());
 
-    // Compute the boundary conditions with the target image
-    VectorXd bound = ComputationHandler::computeBoundaryNeighbors(tgt_matrix_ch, m_masks);
+    if (use_response) {
+        // No linear system to assemble, only the mean target value along the boundary is kept
+        m_boundary_mean = ComputationHandler::computeBoundaryMean(tgt_planes, m_index_map);
 
-    // Gradient vector
-    VectorXd grad;
+        m_stats.setup_time = timer.restart();
 
-    // If mixed blending -> also compute the target gradient then mix them
-    if (m_mixed_blending) {
-        grad = ComputationHandler::computeImagesGradientMixed(tgt_matrix_ch, m_src_img_ch, m_masks);
+        // x = x_src + G t (exact up to the factorization accuracy)
+        m_solution = m_boundary_response->solve(tgt_planes);
+        m_blended_image = ComputationHandler::solutionToImage(m_solution, m_index_map);
+
+        m_stats.solve_time = timer.elapsed();
+        m_stats.converged = true;
+        m_stats.bytes_allocated = m_solution.size() * (qint64) sizeof(float);
+
+        return;
+    }
+
+    // Independent terms (b in linear problem Ax=b), one column per color channel.
+    // The plain guidance field is cached by the item, only the boundary conditions are added.
+    // The mixed one depends on the target: guidance and boundary conditions in a single pass.
+    MatrixX3d b;
+
+    if (!m_mixed_blending && !m_guidance.isNull()) {
+        b = ComputationHandler::computeIndependentTerms(*m_guidance, tgt_planes, m_index_map, &m_boundary_mean);
+    }
+    else {
+        b = ComputationHandler::computeIndependentTerms(m_src_img, tgt_planes, m_mixed_blending, m_index_map, &m_boundary_mean);
+    }
+
+    if (isCancelled())
+        return;
+
+    // Warm start from the previous blending of this item (if any).
+    // The unknowns are in item coordinates, so the previous solution can be reused as is
+    // after a move. It is only shifted by the change of the mean boundary value.
+    const bool warm_start = (m_previous_solution.rows() == b.rows());
+    MatrixX3d x0;
+
+    if (warm_start) {
+        x0 = m_previous_solution.rowwise() + (m_boundary_mean - m_previous_boundary_mean);
     }
     else {
-        grad = ComputationHandler::computeImageGradient(m_src_img_ch, m_masks);
+        x0 = MatrixX3d::Zero(b.rows(), 3);
     }
 
-    // Compute the independent terms vector (b vector in linear problem Ax=b)
-    VectorXd b = grad + bound;
+    // b, x0 and x
+    m_stats.bytes_allocated = 3 * b.size() * (qint64) sizeof(float);
+
+    // Solve the linear algebra equation for the 3 channels
+    MatrixX3d x;
+
+    if (solver_type == SolverCholesky) {
+        // The factorization is normally done by the transfer job (not if another solver was selected, nor for loaded projects)
+        if (m_factorization.isNull()) {
+            m_factorization = ComputationHandler::factorizeLaplacian(ComputationHandler::laplacianMatrix(m_index_map));
+
+            // Sparse factor (values and row indices)
+            m_stats.bytes_allocated += m_factorization->matrixL().nestedExpression().nonZeros() * (qint64) (sizeof(float) + sizeof(int));
+        }
 
-    // Initialise the solver and factorize the laplacian (A matrix)
-    Eigen::ConjugateGradient<Eigen::SparseMatrix<float>> solver;
-    solver.analyzePattern(m_laplacian);
-    solver.factorize(m_laplacian);
+        // The factorization is kept by the item even if this blending is not needed anymore
+        if (isCancelled())
+            return;
 
-    // The the linear algebra equation
-    VectorXd x = solver.solve(b);
+        m_stats.setup_time = timer.restart();
 
-    // Reshape the vector to a image matrix
-    // The image matrix size is given without the 1px margin (-QSize(2,2))
-    MatrixXd x_mat = ComputationHandler::vectorToMatrixImage(x, m_target_img.size() - QSize(2,2));
+        // Only the forward/back substitutions are left
+        x = m_factorization->solve(b);
 
-    // Place the x_mat at the center of a matrix WITH 1px margin (original image dimension)
-    MatrixXd x_mat_outer(m_target_img.height(), m_target_img.width());
-    x_mat_outer.block(1, 1, x_mat.rows(), x_mat.cols()) = x_mat;
+        MatrixX3d ax;
+        LaplacianOperator(m_index_map).apply(x, ax);
+
+        const float b_norm = b.norm();
+
+        m_stats.iterations = 1;
+        m_stats.error = b_norm > 0.0 ? (b - ax).norm() / b_norm : 0.0;
+        m_stats.converged = true;
+        m_stats.bytes_allocated += ax.size() * (qint64) sizeof(float);
+    }
+    else if (!m_components.isNull() && m_components->size() > 1) {
+        // Disconnected parts of the selection: smaller independent systems, solved concurrently
+        m_stats.setup_time = timer.restart();
+
+        m_dd_solvers.resize(m_components->size());
+        x = solveComponents(b, x0);
+    }
+    else {
+        m_stats.setup_time = timer.restart();
+
+        m_dd_solvers.resize(1);
+        x = solveIterative(m_index_map, solver_type, b, x0, &m_stats, true, m_dd_solvers.data());
+    }
+
+    m_stats.solve_time = timer.elapsed();
+
+    // An interrupted solve is not a solution
+    if (isCancelled())
+        return;
+
+    // Keep the solution for the next warm start
+    m_solution = x;
+
+    // Pack the unknowns into the blended image (mask size, transparent outside the mask)
+    m_blended_image = ComputationHandler::solutionToImage(x, m_index_map);
+}
+
+/**
+ * @brief BlendingComputationUnit::componentSolverType
+ * @param index_map
+ * @return
+ *
+ * This function returns the solver actually used for the given unknowns.
+ * Full rectangles have a closed-form solution, whatever the chosen solver.
+ * The fast Poisson solver is only efficient on masks close to their bounding rectangle.
+ */
+SolverType BlendingComputationUnit::componentSolverType(const UnknownIndexMap &index_map) const {
+    if (ComputationHandler::isFullRectangle(index_map))
+        return SolverFastPoisson;
+
+    if (m_solver_type == SolverFastPoisson && ComputationHandler::rectangleFillRatio(index_map) < FAST_POISSON_MIN_FILL_RATIO)
+        return SolverMultigrid;
+
+    return m_solver_type;
+}
+
+/**
+ * @brief BlendingComputationUnit::solveIterative
+ * @param index_map
+ * @param solver_type
+ * @param b
+ * @param x0
+ * @param stats
+ * @param report_progress
+ * @param dd_solver
+ * @return
+ *
+ * This function solves the system of the given unknowns with a matrix-free solver
+ * (fast Poisson, multigrid, domain decomposition or conjugate gradient), starting from x0.
+ * The iterations, the error and the allocated bytes are written in stats.
+ * The domain decomposition solver is only built if dd_solver is null, and kept there.
+ */
+MatrixX3d BlendingComputationUnit::solveIterative(const UnknownIndexMap &index_map, SolverType solver_type, const MatrixX3d &b, const MatrixX3d &x0, SolveStats *stats, bool report_progress, DomainDecompositionSolverPtr *dd_solver) {
+    MatrixX3d x;
+
+    if (solver_type == SolverFastPoisson) {
+        // Discrete sine transform on the bounding rectangle (preconditioner if the mask is not a full rectangle)
+        FastPoissonSolver solver(index_map);
+        solver.setTolerance(m_solver_tolerance);
+        solver.setCancelFlag(&m_cancelled);
+
+        if (report_progress)
+            solver.setProgressCallback([this](int iterations, float error) { reportProgress(iterations, error); });
+
+        x = solver.solveWithGuess(b, x0);
+
+        stats->iterations = solver.iterations();
+        stats->error = solver.error();
+        stats->converged = solver.isExact() || solver.error() < m_solver_tolerance;
+        stats->bytes_allocated += solver.allocatedBytes();
+    }
+    else if (solver_type == SolverMultigrid) {
+        // Matrix-free multigrid (the laplacian is implied by the mask)
+        MultigridSolver solver(index_map);
+        solver.setTolerance(m_solver_tolerance);
+        solver.setCancelFlag(&m_cancelled);
+
+        x.resize(b.rows(), 3);
+
+        for (int ch = 0 ; ch < 3 ; ch++) {
+            if (isCancelled())
+                break;
+
+            // The 3 channels are solved one after the other
+            if (report_progress)
+                solver.setProgressCallback([this, ch](int iterations, float error) { reportProgress(iterations, error, ch, 3); });
+
+            x.col(ch) = solver.solveWithGuess(b.col(ch), x0.col(ch));
+
+            stats->iterations = qMax(stats->iterations, solver.iterations());
+            stats->error = qMax(stats->error, solver.error());
+        }
+
+        stats->converged = stats->error < m_solver_tolerance;
+        stats->bytes_allocated += solver.allocatedBytes();
+    }
+    else if (solver_type == SolverDomainDecomposition) {
+        // Tiles of the mask solved concurrently (the 3 channels at once).
+        // The tiles are factorized by the first blending of the item only.
+        if (dd_solver->isNull())
+            *dd_solver = DomainDecompositionSolverPtr(new DomainDecompositionSolver(index_map));
+
+        DomainDecompositionSolver &solver = **dd_solver;
+        solver.setTolerance(m_solver_tolerance);
+        solver.setCancelFlag(&m_cancelled);
+
+        if (report_progress)
+            solver.setProgressCallback([this](int iterations, float error) { reportProgress(iterations, error); });
+
+        x = solver.solveWithGuess(b, x0);
+
+        // The solver outlives this job
+        solver.setCancelFlag(nullptr);
+        solver.setProgressCallback(SolverProgressCallback());
+
+        stats->iterations = solver.iterations();
+        stats->error = solver.error();
+        stats->converged = solver.error() < m_solver_tolerance;
+        stats->bytes_allocated += solver.allocatedBytes();
+    }
+    else {
+        // Conjugate gradient sharing the stencil products between the channels
+        const LaplacianOperator laplacian(index_map);
+
+        BlockConjugateGradient solver(laplacian);
+        solver.setTolerance(m_solver_tolerance);
+        solver.setCancelFlag(&m_cancelled);
+
+        if (report_progress)
+            solver.setProgressCallback([this](int iterations, float error) { reportProgress(iterations, error); });
+
+        x = solver.solveWithGuess(b, x0);
+
+        stats->iterations = solver.iterations();
+        stats->error = solver.error();
+        stats->converged = solver.error() < m_solver_tolerance;
+        stats->bytes_allocated += solver.allocatedBytes();
+    }
+
+    return x;
+}
+
+/**
+ * @brief BlendingComputationUnit::solveComponents
+ * @param b
+ * @param x0
+ * @return
+ *
+ * This function solves the connected components of the selection concurrently, each one
+ * with the solver fitting its own shape, then scatters their solutions into the whole one.
+ * Only the largest component (the first one) reports its progress.
+ * The reported error and iterations are the largest ones of the components.
+ */
+MatrixX3d BlendingComputationUnit::solveComponents(const MatrixX3d &b, const MatrixX3d &x0) {
+    const QVector<UnknownComponent> &components = *m_components;
+
+    MatrixX3d x(b.rows(), 3);
+
+    QVector<SolveStats> component_stats(components.size());
+
+    // Each component has its own slot (detached before the concurrent solves)
+    DomainDecompositionSolverPtr *dd_solvers = m_dd_solvers.data();
+
+    for (int c = 0 ; c < components.size() ; c++) {
+        component_stats[c] = SolveStats();
+        component_stats[c].solver = componentSolverType(components[c].index_map);
+    }
+
+    ComputationHandler::parallelFor(components.size(), [&](int c) {
+        const UnknownComponent &component = components[c];
+
+        // Gather the rows of the component
+        MatrixX3d b_c(component.rows.size(), 3), x0_c(component.rows.size(), 3);
+
+        for (int k = 0 ; k < component.rows.size() ; k++) {
+            b_c.row(k) = b.row(component.rows[k]);
+            x0_c.row(k) = x0.row(component.rows[k]);
+        }
+
+        const MatrixX3d x_c = solveIterative(component.index_map, component_stats[c].solver, b_c, x0_c, &component_stats[c], c == 0, &dd_solvers[c]);
+
+        if (isCancelled())
+            return;
+
+        // Scatter them back (the components do not share any row)
+        for (int k = 0 ; k < component.rows.size() ; k++) {
+            x.row(component.rows[k]) = x_c.row(k);
+        }
+    });
+
+    m_stats.converged = true;
+
+    for (int c = 0 ; c < components.size() ; c++) {
+        m_stats.iterations = qMax(m_stats.iterations, component_stats[c].iterations);
+        m_stats.error = qMax(m_stats.error, component_stats[c].error);
+        m_stats.converged = m_stats.converged && component_stats[c].converged;
+        m_stats.bytes_allocated += component_stats[c].bytes_allocated + 9 * components[c].rows.size() * (qint64) sizeof(float);
+    }
+
+    return x;
+}
+
+QImage BlendingComputationUnit::getBlendedImage() {
+    return m_blended_image;
+}
+
+LaplacianFactorizationPtr BlendingComputationUnit::getFactorization() {
+    return m_factorization;
+}
+
+QVector<DomainDecompositionSolverPtr> BlendingComputationUnit::getDomainDecompositionSolvers() {
+    return m_dd_solvers;
+}
 
-    // Store the result
-    m_blended_channel = x_mat_outer;
+MatrixX3d BlendingComputationUnit::getSolution() {
+    return m_solution;
 }
 
-int BlendingComputationUnit::getChannelNumber() {
-    return m_channel_num;
+Eigen::RowVector3f BlendingComputationUnit::getBoundaryMean() {
+    return m_boundary_mean;
 }
 
-MatrixXd BlendingComputationUnit::getBlendedChannel() {
-    return m_blended_channel;
+SolveStats BlendingComputationUnit::getSolveStats() {
+    return m_stats;
 }
@@ -1,10 +1,14 @@
 #ifndef BLENDINGCOMPUTATIONUNIT_H
 #define BLENDINGCOMPUTATIONUNIT_H
 
+#include <QAtomicInt>
+#include <QElapsedTimer>
 #include <QObject>
 #include <QRunnable>
 
 #include "computationhandler.h"
+#include "boundaryresponse.h"
+#include "domaindecompositionsolver.h"
 
 class BlendingComputationUnit : public QObject, public QRunnable
 {
@@ -12,36 +16,83 @@ class BlendingComputationUnit : public QObject, public QRunnable
 
 public:
     BlendingComputationUnit(
-            int channel_num,
             QImage target_img,
-            MatrixXd src_img_ch,
-            SelectMaskMatrices masks,
-            SparseMatrixXd laplacian,
-            bool mixed_blending
+            QRect target_rect,
+            ImagePlanes src_img,
+            GuidanceFieldPtr guidance,
+            UnknownIndexMap index_map,
+            UnknownComponentsPtr components,
+            LaplacianFactorizationPtr factorization,
+            QVector<DomainDecompositionSolverPtr> dd_solvers,
+            BoundaryResponsePtr boundary_response,
+            bool mixed_blending,
+            SolverType solver_type,
+            float solver_tolerance,
+            MatrixX3d previous_solution = MatrixX3d(),
+            Eigen::RowVector3f previous_boundary_mean = Eigen::RowVector3f::Zero()
         );
 
     void run() override;
 
-    int getChannelNumber();
-    MatrixXd getBlendedChannel();
+    // Cooperative cancellation (checked between the stages and the solver iterations)
+    void cancel();
+    bool isCancelled() const;
+
+    // Request number of the item (a newer request supersedes this job)
+    void setGeneration(quint64 generation);
+    quint64 generation() const;
+
+    QImage getBlendedImage();
+    LaplacianFactorizationPtr getFactorization();
+    QVector<DomainDecompositionSolverPtr> getDomainDecompositionSolvers();
+
+    MatrixX3d getSolution();
+    Eigen::RowVector3f getBoundaryMean();
+    SolveStats getSolveStats();
 
 signals:
     void computationStarted();
     void computationFinished();
 
+    // Periodic report of the iterative solvers (progress in [0,1])
+    void progressChanged(int iterations, float error, float progress);
+
 private:
     void computeBlendingData();
+    SolverType componentSolverType(const UnknownIndexMap &index_map) const;
+    MatrixX3d solveIterative(const UnknownIndexMap &index_map, SolverType solver_type, const MatrixX3d &b, const MatrixX3d &x0, SolveStats *stats, bool report_progress, DomainDecompositionSolverPtr *dd_solver);
+    MatrixX3d solveComponents(const MatrixX3d &b, const MatrixX3d &x0);
+    void reportProgress(int iterations, float error, int part = 0, int parts = 1);
 
     // Input attributes
-    int m_channel_num;
     QImage m_target_img;
-    MatrixXd m_src_img_ch;
-    SelectMaskMatrices m_masks;
-    SparseMatrixXd m_laplacian;
+    QRect m_target_rect;
+    ImagePlanes m_src_img;
+    GuidanceFieldPtr m_guidance;
+    UnknownIndexMap m_index_map;
+    UnknownComponentsPtr m_components;
+    LaplacianFactorizationPtr m_factorization;
+    QVector<DomainDecompositionSolverPtr> m_dd_solvers;     // One per connected component (built on first use)
+    BoundaryResponsePtr m_boundary_response;
     bool m_mixed_blending;
+    SolverType m_solver_type;
+    float m_solver_tolerance;
+    MatrixX3d m_previous_solution;
+    Eigen::RowVector3f m_previous_boundary_mean;
 
     // Output attributes
-    MatrixXd m_blended_channel;
+    QImage m_blended_image;
+    MatrixX3d m_solution;
+    Eigen::RowVector3f m_boundary_mean;
+    SolveStats m_stats;
+
+    // Progress attributes
+    QElapsedTimer m_progress_timer;
+    float m_initial_error;
+
+    // Scheduling attributes
+    QAtomicInt m_cancelled;
+    quint64 m_generation;
 };
 
 #endif // BLENDINGCOMPUTATIONUNIT_H
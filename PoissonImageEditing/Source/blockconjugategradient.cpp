@@ -0,0 +1,133 @@
+#include "blockconjugategradient.h"
+
+#include <cmath>
+
+
+BlockConjugateGradient::BlockConjugateGradient(const LaplacianOperator &laplacian)
+    : m_laplacian(laplacian)
+{
+    m_tolerance = 1e-5;
+    m_max_iterations = 2 * laplacian.size();
+    m_cancel_flag = nullptr;
+
+    m_iterations = 0;
+    m_error = 0.0;
+    m_allocated_bytes = 0;
+}
+
+void BlockConjugateGradient::setTolerance(float tolerance) {
+    m_tolerance = tolerance;
+}
+
+void BlockConjugateGradient::setMaxIterations(int max_iterations) {
+    m_max_iterations = max_iterations;
+}
+
+void BlockConjugateGradient::setCancelFlag(const QAtomicInt *cancel_flag) {
+    m_cancel_flag = cancel_flag;
+}
+
+void BlockConjugateGradient::setProgressCallback(SolverProgressCallback callback) {
+    m_progress_callback = callback;
+}
+
+int BlockConjugateGradient::iterations() const {
+    return m_iterations;
+}
+
+float BlockConjugateGradient::error() const {
+    return m_error;
+}
+
+qint64 BlockConjugateGradient::allocatedBytes() const {
+    return m_allocated_bytes;
+}
+
+/**
+ * @brief BlockConjugateGradient::solve
+ * @param b
+ * @return
+ *
+ * This function solves A*X = B (one column per color channel), starting from X = 0.
+ */
+MatrixX3d BlockConjugateGradient::solve(const MatrixX3d &b) {
+    return solveWithGuess(b, MatrixX3d::Zero(b.rows(), 3));
+}
+
+/**
+ * @brief BlockConjugateGradient::solveWithGuess
+ * @param b
+ * @param x0
+ * @return
+ *
+ * This function solves A*X = B (one column per color channel), starting from X = x0.
+ * The iterations stop when the relative residual of every column is below the tolerance.
+ */
+MatrixX3d BlockConjugateGradient::solveWithGuess(const MatrixX3d &b, const MatrixX3d &x0) {
+    const Eigen::Index N = b.rows();
+
+    MatrixX3d x = x0;
+    MatrixX3d q(N, 3);
+
+    // Initial residual
+    m_laplacian.apply(x, q);
+    MatrixX3d r = b - q;
+    MatrixX3d p = r;
+
+    // Per channel values
+    Eigen::Array3d b_norm = b.colwise().norm().cast<double>().transpose();
+    Eigen::Array3d rr = r.colwise().squaredNorm().cast<double>().transpose();
+    Eigen::Array3d alpha, beta;
+
+    // Null right-hand sides are already solved
+    for (int c = 0 ; c < 3 ; c++) {
+        if (b_norm(c) == 0.0)
+            b_norm(c) = 1.0;
+    }
+
+    m_iterations = 0;
+    m_error = (rr.sqrt() / b_norm).maxCoeff();
+
+    // x, q, r and p
+    m_allocated_bytes = 4 * N * 3 * (qint64) sizeof(float);
+
+    if (m_progress_callback)
+        m_progress_callback(m_iterations, m_error);
+
+    while (m_error >= m_tolerance && m_iterations < m_max_iterations) {
+        // The caller does not need the solution anymore
+        if (m_cancel_flag && m_cancel_flag->loadAcquire())
+            break;
+
+        // The only laplacian product of the iteration
+        m_laplacian.apply(p, q);
+
+        const Eigen::Array3d pq = p.cwiseProduct(q).colwise().sum().cast<double>().transpose();
+
+        for (int c = 0 ; c < 3 ; c++) {
+            // Converged channels are not updated anymore
+            alpha(c) = (pq(c) > 0.0 && std::sqrt(rr(c)) / b_norm(c) >= m_tolerance) ? rr(c) / pq(c) : 0.0;
+        }
+
+        const Eigen::RowVector3f alpha_f = alpha.cast<float>().matrix().transpose();
+        x += p * alpha_f.asDiagonal();
+        r -= q * alpha_f.asDiagonal();
+
+        const Eigen::Array3d rr_new = r.colwise().squaredNorm().cast<double>().transpose();
+
+        for (int c = 0 ; c < 3 ; c++) {
+            beta(c) = (rr(c) > 0.0) ? rr_new(c) / rr(c) : 0.0;
+        }
+
+        rr = rr_new;
+        p = r + p * beta.cast<float>().matrix().asDiagonal();
+
+        m_iterations++;
+        m_error = (rr.sqrt() / b_norm).maxCoeff();
+
+        if (m_progress_callback)
+            m_progress_callback(m_iterations, m_error);
+    }
+
+    return x;
+}
@@ -0,0 +1,50 @@
+#ifndef BLOCKCONJUGATEGRADIENT_H
+#define BLOCKCONJUGATEGRADIENT_H
+
+#include <QAtomicInt>
+
+#include "computationhandler.h"
+#include "laplacianoperator.h"
+
+/*
+ * Conjugate gradient solving the 3 color channels at once.
+ * Each channel keeps its own CG coefficients, but the laplacian stencil is
+ * applied only once per iteration for the 3 columns.
+ */
+class BlockConjugateGradient
+{
+public:
+    BlockConjugateGradient(const LaplacianOperator &laplacian);
+
+    void setTolerance(float tolerance);
+    void setMaxIterations(int max_iterations);
+    void setCancelFlag(const QAtomicInt *cancel_flag);
+    void setProgressCallback(SolverProgressCallback callback);
+
+    MatrixX3d solve(const MatrixX3d &b);
+    MatrixX3d solveWithGuess(const MatrixX3d &b, const MatrixX3d &x0);
+
+    int iterations() const;
+    float error() const;
+    qint64 allocatedBytes() const;
+
+private:
+    const LaplacianOperator &m_laplacian;
+
+    float m_tolerance;
+    int m_max_iterations;
+
+    // Checked between the iterations (the solve stops early when it is set)
+    const QAtomicInt *m_cancel_flag;
+
+    // Called with the residual of each iteration
+    SolverProgressCallback m_progress_callback;
+
+    int m_iterations;
+    float m_error;
+
+    // Size of the work buffers (setup and last solve)
+    qint64 m_allocated_bytes;
+};
+
+#endif // BLOCKCONJUGATEGRADIENT_H
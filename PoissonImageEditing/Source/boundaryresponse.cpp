@@ -0,0 +1,144 @@
+#include "boundaryresponse.h"
+
+
+#define BOUNDARY_RESPONSE_MAX_SIZE      (8 * 1024 * 1024)   // Entries of G (32 MB)
+#define BOUNDARY_RESPONSE_BLOCK_SIZE    32                  // Columns of G solved together
+
+
+BoundaryResponse::BoundaryResponse(const MatrixX3d &guidance, const UnknownIndexMap &index_map, LaplacianFactorizationPtr factorization, const QAtomicInt *cancel_flag)
+{
+    const int N = index_map.pixels.size();
+
+    m_boundary_pixels = boundaryPixels(index_map);
+    const int nb = m_boundary_pixels.size();
+
+    // The factorization is only done by the transfer job for the direct solver (not for full rectangles and loaded projects)
+    if (factorization.isNull()) {
+        factorization = ComputationHandler::factorizeLaplacian(ComputationHandler::laplacianMatrix(index_map));
+    }
+
+    // Number of each boundary pixel (-1 elsewhere)
+    IndexMatrix boundary_index = IndexMatrix::Constant(index_map.index.rows(), index_map.index.cols(), -1);
+
+    for (int k = 0 ; k < nb ; k++) {
+        boundary_index(m_boundary_pixels[k].y(), m_boundary_pixels[k].x()) = k;
+    }
+
+    // Unknowns linked to each boundary pixel (the non-zeros of B, all equal to 1)
+    QVector<QVector<int>> linked_unknowns(nb);
+
+    for (int i = 0 ; i < N ; i++) {
+        const int x = index_map.pixels[i].x();
+        const int y = index_map.pixels[i].y();
+
+        if (index_map.index(y,x-1) < 0) linked_unknowns[boundary_index(y,x-1)].append(i);
+        if (index_map.index(y,x+1) < 0) linked_unknowns[boundary_index(y,x+1)].append(i);
+        if (index_map.index(y-1,x) < 0) linked_unknowns[boundary_index(y-1,x)].append(i);
+        if (index_map.index(y+1,x) < 0) linked_unknowns[boundary_index(y+1,x)].append(i);
+    }
+
+    // G = A^-1 B, solved by blocks of columns (in parallel, the substitutions are read-only)
+    m_response.resize(N, nb);
+
+    const int block_count = (nb + BOUNDARY_RESPONSE_BLOCK_SIZE - 1) / BOUNDARY_RESPONSE_BLOCK_SIZE;
+
+    ComputationHandler::parallelFor(block_count, [&](int block) {
+        const int first = block * BOUNDARY_RESPONSE_BLOCK_SIZE;
+
+        // The caller does not need the response anymore (it is left incomplete)
+        if (cancel_flag && cancel_flag->loadAcquire())
+            return;
+
+        const int count = qMin(BOUNDARY_RESPONSE_BLOCK_SIZE, nb - first);
+
+        MatrixXd e = MatrixXd::Zero(N, count);
+
+        for (int k = 0 ; k < count ; k++) {
+            for (int i : linked_unknowns[first + k]) {
+                e(i,k) = 1.0;
+            }
+        }
+
+        m_response.middleCols(first, count) = factorization->solve(e);
+    });
+
+    // x_src = A^-1 g (source guidance with a null boundary)
+    m_source_solution = factorization->solve(guidance);
+}
+
+/**
+ * @brief BoundaryResponse::boundaryPixels
+ * @param index_map
+ * @return
+ *
+ * This function returns the pixels outside the mask that are neighbors of an unknown
+ * (∂Ω in reference paper), in order of first appearance.
+ */
+QVector<QPoint> BoundaryResponse::boundaryPixels(const UnknownIndexMap &index_map) {
+    QVector<QPoint> pixels;
+
+    // Visited boundary pixels
+    Eigen::Matrix<bool, Eigen::Dynamic, Eigen::Dynamic> visited =
+            Eigen::Matrix<bool, Eigen::Dynamic, Eigen::Dynamic>::Constant(index_map.index.rows(), index_map.index.cols(), false);
+
+    for (int i = 0 ; i < index_map.pixels.size() ; i++) {
+        const QPoint &p = index_map.pixels[i];
+        const QPoint neighbors[4] = {p + QPoint(-1,0), p + QPoint(1,0), p + QPoint(0,-1), p + QPoint(0,1)};
+
+        for (const QPoint &n : neighbors) {
+            if (index_map.index(n.y(), n.x()) < 0 && !visited(n.y(), n.x())) {
+                visited(n.y(), n.x()) = true;
+                pixels.append(n);
+            }
+        }
+    }
+
+    return pixels;
+}
+
+/**
+ * @brief BoundaryResponse::isWithinBudget
+ * @param index_map
+ * @return
+ *
+ * This function returns true if the dense response of the selection fits in the memory budget.
+ */
+bool BoundaryResponse::isWithinBudget(const UnknownIndexMap &index_map) {
+    const qint64 N = index_map.pixels.size();
+    const qint64 nb = boundaryPixels(index_map).size();
+
+    return N > 0 && N * nb <= BOUNDARY_RESPONSE_MAX_SIZE;
+}
+
+int BoundaryResponse::boundarySize() const {
+    return m_boundary_pixels.size();
+}
+
+/**
+ * @brief BoundaryResponse::solve
+ * @param tgt_img
+ * @return
+ *
+ * This function returns the plain blending (one column per color channel) for the target
+ * image part 'tgt_img' under the item (same size as the mask).
+ */
+MatrixX3d BoundaryResponse::solve(const ImagePlanes &tgt_img) const {
+    const int nb = m_boundary_pixels.size();
+
+    // Target values on the boundary
+    MatrixX3d t(nb, 3);
+
+    for (int k = 0 ; k < nb ; k++) {
+        const QPoint &p = m_boundary_pixels[k];
+
+        for (int ch = 0 ; ch < 3 ; ch++) {
+            t(k,ch) = tgt_img.at(ch, p.y(), p.x());
+        }
+    }
+
+    // x = x_src + G t
+    MatrixX3d x = m_source_solution;
+    x.noalias() += m_response * t;
+
+    return x;
+}
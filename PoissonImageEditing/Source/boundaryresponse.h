@@ -0,0 +1,54 @@
+#ifndef BOUNDARYRESPONSE_H
+#define BOUNDARYRESPONSE_H
+
+#include <QAtomicInt>
+#include <QPoint>
+#include <QSharedPointer>
+#include <QVector>
+
+#include "computationhandler.h"
+
+/*
+ * Precomputed boundary response of a selection (plain blending only).
+ *
+ * Without mixed gradients, the guidance field only depends on the source image, so the
+ * blending is linear in the target values around the selection:
+ *
+ *      x = A^-1 (g + B t) = x_src + G t
+ *
+ * with x_src = A^-1 g the solution for a null boundary and G = A^-1 B the response of
+ * the unknowns to each boundary pixel (one dense column per boundary pixel).
+ * Both only depend on the item, so a new position of the item only costs the dense
+ * product G t instead of a sparse solve.
+ *
+ * G has (unknowns x boundary pixels) entries, so it is only built for small and medium
+ * selections (see BOUNDARY_RESPONSE_MAX_SIZE).
+ * The product is memory bound, about as fast as the substitutions of the sparse
+ * Cholesky factorization and much faster than the iterative solvers.
+ */
+class BoundaryResponse
+{
+public:
+    BoundaryResponse(const MatrixX3d &guidance, const UnknownIndexMap &index_map, LaplacianFactorizationPtr factorization, const QAtomicInt *cancel_flag = nullptr);
+
+    static QVector<QPoint> boundaryPixels(const UnknownIndexMap &index_map);
+    static bool isWithinBudget(const UnknownIndexMap &index_map);
+
+    int boundarySize() const;
+
+    MatrixX3d solve(const ImagePlanes &tgt_img) const;
+
+private:
+    // Pixels just outside the mask (Dirichlet boundary), in mask coordinates
+    QVector<QPoint> m_boundary_pixels;
+
+    // Response of the unknowns to each boundary pixel (one column per boundary pixel)
+    MatrixXd m_response;
+
+    // Solution for a null boundary (one column per color channel)
+    MatrixX3d m_source_solution;
+};
+
+typedef QSharedPointer<const BoundaryResponse> BoundaryResponsePtr;
+
+#endif // BOUNDARYRESPONSE_H
@@ -1,165 +1,680 @@
 #include "computationhandler.h"
 #include "transfercomputationunit.h"
 #include "pastedsourceitem.h"
+#include "scanlinerasterizer.h"
 
+#include <QElapsedTimer>
+#include <QHash>
 #include <QImage>
+#include <QMutex>
+#include <QMutexLocker>
+#include <QSemaphore>
+#include <QSet>
+#include <QThread>
 #include <QThreadPool>
+#include <QtAlgorithms>
 
+#include <algorithm>
 
-// Static thread pool used by the computation handler
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+
+// Static thread pools used by the computation handler (background/batch jobs, interactive jobs)
 static QThreadPool *g_thread_pool = nullptr;
+static QThreadPool *g_interactive_pool = nullptr;
+
+// Requested size of the background pool (0: one thread per core)
+static int g_thread_count = 0;
+
+// Scheduled jobs waiting for a thread or running, jobs which delete their computation unit
+// (released by its owner), and statistics of each priority class
+class ScheduledJob;
+static QMutex g_scheduler_mutex;
+static QHash<QRunnable*, ScheduledJob*> g_queued_jobs;
+static QHash<QRunnable*, ScheduledJob*> g_running_jobs;
+static QSet<ScheduledJob*> g_released_jobs;
+static JobStatistics g_job_stats[JOB_PRIORITY_COUNT] = {};
+
+// Priority of the job running on the current thread (nested tasks, see parallelFor)
+static thread_local JobPriority t_job_priority = PriorityBackground;
+
+// Planes of the last target image, shared by all the blendings (see targetPlanes)
+static QMutex g_target_planes_mutex;
+static qint64 g_target_planes_key = 0;
+static ImagePlanes g_target_planes;
+
+// 8-bit channel value -> [0,1] (same values as QColor::redF() and co.)
+static const struct ChannelLut {
+    float values[256];
+
+    ChannelLut() {
+        for (int i = 0 ; i < 256 ; i++) {
+            values[i] = i / 255.0f;
+        }
+    }
+} g_channel_lut;
+
+
+/*
+ * Returns the image with 32-bit pixels (0xAARRGGBB, not premultiplied like QImage::pixel())
+ */
+static QImage toRgb32Image(QImage img) {
+    if (img.format() != QImage::Format_RGB32 && img.format() != QImage::Format_ARGB32) {
+        img = img.convertToFormat(QImage::Format_ARGB32);
+    }
+
+    return img;
+}
+
+/*
+ * Deinterleaves a row of 32-bit pixels into 3 planar channels (in [0,1])
+ */
+static void unpackRgbRow(const QRgb *src, float *r, float *g, float *b, int width) {
+    int x = 0;
+
+#ifdef __SSE2__
+    // 4 pixels at once (the division by 255 gives the same values as the LUT)
+    const __m128i byte_mask = _mm_set1_epi32(0xff);
+    const __m128 max_value = _mm_set1_ps(255.0f);
+
+    for ( ; x + 4 <= width ; x += 4) {
+        const __m128i px = _mm_loadu_si128((const __m128i*) (src + x));
+
+        _mm_storeu_ps(r + x, _mm_div_ps(_mm_cvtepi32_ps(_mm_and_si128(_mm_srli_epi32(px, 16), byte_mask)), max_value));
+        _mm_storeu_ps(g + x, _mm_div_ps(_mm_cvtepi32_ps(_mm_and_si128(_mm_srli_epi32(px, 8), byte_mask)), max_value));
+        _mm_storeu_ps(b + x, _mm_div_ps(_mm_cvtepi32_ps(_mm_and_si128(px, byte_mask)), max_value));
+    }
+#endif
+
+    // Remaining pixels (all of them without SSE2)
+    for ( ; x < width ; x++) {
+        r[x] = g_channel_lut.values[qRed(src[x])];
+        g[x] = g_channel_lut.values[qGreen(src[x])];
+        b[x] = g_channel_lut.values[qBlue(src[x])];
+    }
+}
+
+/*
+ * Packs [0,1] channel values into a 32-bit pixel (clamped then truncated, like qBound(0, v*255, 255))
+ */
+static inline QRgb packPixel(float r, float g, float b, float a) {
+    return qRgba(qBound(0.0f, r * 255.0f, 255.0f),
+                 qBound(0.0f, g * 255.0f, 255.0f),
+                 qBound(0.0f, b * 255.0f, 255.0f),
+                 qBound(0.0f, a * 255.0f, 255.0f));
+}
+
+#ifdef __SSE2__
+/*
+ * Packs 4 pixels at once (same rounding as packPixel)
+ */
+static inline __m128i packPixels(__m128 r, __m128 g, __m128 b, __m128 a) {
+    const __m128 max_value = _mm_set1_ps(255.0f);
+    const __m128 zero = _mm_setzero_ps();
+
+    const __m128i r8 = _mm_cvttps_epi32(_mm_min_ps(_mm_max_ps(_mm_mul_ps(r, max_value), zero), max_value));
+    const __m128i g8 = _mm_cvttps_epi32(_mm_min_ps(_mm_max_ps(_mm_mul_ps(g, max_value), zero), max_value));
+    const __m128i b8 = _mm_cvttps_epi32(_mm_min_ps(_mm_max_ps(_mm_mul_ps(b, max_value), zero), max_value));
+    const __m128i a8 = _mm_cvttps_epi32(_mm_min_ps(_mm_max_ps(_mm_mul_ps(a, max_value), zero), max_value));
+
+    return _mm_or_si128(_mm_or_si128(_mm_slli_epi32(a8, 24), _mm_slli_epi32(r8, 16)),
+                        _mm_or_si128(_mm_slli_epi32(g8, 8), b8));
+}
+#endif
+
+/*
+ * Interleaves 3 planar channels and an alpha plane (opaque if null) into a row of 32-bit pixels
+ */
+static void packPlanarRow(const float *r, const float *g, const float *b, const float *a, QRgb *dst, int width) {
+    int x = 0;
+
+#ifdef __SSE2__
+    const __m128 opaque = _mm_set1_ps(1.0f);
+
+    for ( ; x + 4 <= width ; x += 4) {
+        const __m128 alpha = a ? _mm_loadu_ps(a + x) : opaque;
+        _mm_storeu_si128((__m128i*) (dst + x), packPixels(_mm_loadu_ps(r + x), _mm_loadu_ps(g + x), _mm_loadu_ps(b + x), alpha));
+    }
+#endif
+
+    for ( ; x < width ; x++) {
+        dst[x] = packPixel(r[x], g[x], b[x], a ? a[x] : 1.0f);
+    }
+}
+
+/*
+ * Packs interleaved RGB values (one row of a MatrixX3d per pixel) into opaque 32-bit pixels
+ */
+static void packInterleavedRow(const float *rgb, QRgb *dst, int count) {
+    int x = 0;
+
+#ifdef __SSE2__
+    const __m128 opaque = _mm_set1_ps(1.0f);
+
+    for ( ; x + 4 <= count ; x += 4) {
+        const float *v = rgb + 3 * x;
+
+        const __m128 r = _mm_setr_ps(v[0], v[3], v[6], v[9]);
+        const __m128 g = _mm_setr_ps(v[1], v[4], v[7], v[10]);
+        const __m128 b = _mm_setr_ps(v[2], v[5], v[8], v[11]);
+
+        _mm_storeu_si128((__m128i*) (dst + x), packPixels(r, g, b, opaque));
+    }
+#endif
+
+    for ( ; x < count ; x++) {
+        dst[x] = packPixel(rgb[3*x], rgb[3*x+1], rgb[3*x+2], 1.0f);
+    }
+}
+
+
+/*
+ * Job of the thread pools: runs a computation unit and keeps the statistics of its priority class.
+ * The computation unit is not owned (it is deleted by its item once finished), unless its item
+ * released it while it was running (see ComputationHandler::releaseComputationJob) or it is
+ * auto-deleted like the runnables of QThreadPool.
+ */
+class ScheduledJob : public QRunnable
+{
+public:
+    ScheduledJob(QRunnable *cu, JobPriority priority)
+        : QRunnable(), m_cu(cu), m_priority(priority)
+    {
+        m_wait_timer.start();
+        setAutoDelete(true);
+    }
+
+    QThreadPool *pool() const {
+        return (m_priority == PriorityInteractive) ? g_interactive_pool : g_thread_pool;
+    }
+
+    JobPriority priority() const {
+        return m_priority;
+    }
+
+    void run() override {
+        // Read before running: a unit which is not auto-deleted may be deleted by its item once finished
+        const bool auto_delete = m_cu->autoDelete();
+
+        // Leave the queue
+        {
+            QMutexLocker locker(&g_scheduler_mutex);
+            JobStatistics &stats = g_job_stats[m_priority];
+            const qint64 wait = m_wait_timer.elapsed();
+
+            g_queued_jobs.remove(m_cu);
+            g_running_jobs.insert(m_cu, this);
+            stats.queued--;
+            stats.running++;
+            stats.total_wait += wait;
+            stats.max_wait = qMax(stats.max_wait, wait);
+        }
+
+        // The nested tasks of the job have the same priority
+        t_job_priority = m_priority;
+
+        // The computation unit may be deleted as soon as it has finished: it is not used afterwards
+        m_cu->run();
+
+        t_job_priority = PriorityBackground;
+
+        bool released;
+
+        {
+            QMutexLocker locker(&g_scheduler_mutex);
+
+            // The unit may already be deleted by its item, and its address reused by a newer job
+            if (g_running_jobs.value(m_cu) == this)
+                g_running_jobs.remove(m_cu);
+
+            released = g_released_jobs.remove(this);
+            g_job_stats[m_priority].running--;
+            g_job_stats[m_priority].finished++;
+        }
+
+        // Its item does not exist anymore (or it never had one)
+        if (released || auto_delete)
+            delete m_cu;
+    }
+
+private:
+    QRunnable *m_cu;
+    JobPriority m_priority;
+    QElapsedTimer m_wait_timer;
+};
+
+/*
+ * Helper of ComputationHandler::parallelFor: takes the next indices of the loop until none is left.
+ * It is owned by the caller of parallelFor, which either takes it back from the queue or waits for it.
+ */
+class ParallelForTask : public QRunnable
+{
+public:
+    ParallelForTask(const std::function<void(int)> &function, int count, QAtomicInt *next, QSemaphore *done, JobPriority priority)
+        : QRunnable(), m_function(function), m_count(count), m_next(next), m_done(done), m_priority(priority)
+    {
+        setAutoDelete(false);
+    }
+
+    static void runIndices(const std::function<void(int)> &function, int count, QAtomicInt *next) {
+        for (int i = next->fetchAndAddRelaxed(1) ; i < count ; i = next->fetchAndAddRelaxed(1)) {
+            function(i);
+        }
+    }
+
+    void run() override {
+        // Loops nested in this one keep the priority of the job
+        t_job_priority = m_priority;
+
+        runIndices(m_function, m_count, m_next);
+
+        t_job_priority = PriorityBackground;
+
+        m_done->release();
+    }
+
+private:
+    const std::function<void(int)> &m_function;
+    int m_count;
+    QAtomicInt *m_next;
+    QSemaphore *m_done;
+    JobPriority m_priority;
+};
+
+/*
+ * Background conversion of a target image (see ComputationHandler::prepareTargetPlanes).
+ * It has no owner: the scheduler deletes it once finished.
+ */
+class TargetPlanesTask : public QRunnable
+{
+public:
+    TargetPlanesTask(const QImage &target)
+        : QRunnable(), m_target(target)
+    {
+        setAutoDelete(true);
+    }
+
+    void run() override {
+        ComputationHandler::targetPlanes(m_target);
+    }
+
+private:
+    QImage m_target;
+};
 
 
 /**
  * @brief ComputationHandler::initializeComputationHandler
  * @param parent
  *
- * This function initializes the computation handler's thread pool.
- * If a parent argument is defined, it is used as parent for the QThreadPool.
+ * This function initializes the computation handler's thread pools.
+ * If a parent argument is defined, it is used as parent for the QThreadPools.
  */
 void ComputationHandler::initializeComputationHandler(QObject *parent) {
     g_thread_pool = new QThreadPool(parent);
+    g_interactive_pool = new QThreadPool(parent);
+
+    g_interactive_pool->setMaxThreadCount(INTERACTIVE_THREAD_COUNT);
+
+    setThreadCount(g_thread_count);
+}
+
+/**
+ * @brief ComputationHandler::setThreadCount
+ * @param count
+ *
+ * This function sets the number of threads of the background/batch jobs (0: one per core).
+ * The interactive jobs have their own threads in addition.
+ */
+void ComputationHandler::setThreadCount(int count) {
+    g_thread_count = qMax(0, count);
+
+    if (g_thread_pool) {
+        g_thread_pool->setMaxThreadCount(g_thread_count > 0 ? g_thread_count : QThread::idealThreadCount());
+    }
+}
+
+/**
+ * @brief ComputationHandler::threadCount
+ * @return
+ *
+ * This function returns the number of threads of the background/batch jobs
+ */
+int ComputationHandler::threadCount() {
+    if (g_thread_pool)
+        return g_thread_pool->maxThreadCount();
+
+    return g_thread_count > 0 ? g_thread_count : QThread::idealThreadCount();
 }
 
 /**
  * @brief ComputationHandler::startComputationJob
  * @param cu
+ * @param priority
  * @return
  *
- * This function adds the runnable object to the shared thread pool queue.
+ * This function adds the runnable object to the queue of its priority class.
+ * The interactive jobs run on their reserved threads. The background jobs are started
+ * before the batch ones, which share the same threads.
  * It returns false if the operation fails (thread pool not initialized).
  */
-bool ComputationHandler::startComputationJob(QRunnable *cu) {
+bool ComputationHandler::startComputationJob(QRunnable *cu, JobPriority priority) {
     // If the thread pool is not initialized
     if (!g_thread_pool)
         return false;
 
-    // Add this computation unit to the thread pool queue
-    g_thread_pool->start(cu);
+    ScheduledJob *job = new ScheduledJob(cu, priority);
+
+    {
+        QMutexLocker locker(&g_scheduler_mutex);
+        g_queued_jobs.insert(cu, job);
+        g_job_stats[priority].queued++;
+    }
+
+    // Add this computation unit to the thread pool queue (the background priority is 0)
+    job->pool()->start(job, priority - PriorityBackground);
 
     return true;
 }
 
-
 /**
- * @brief ComputationHandler::imageToMatrices
- * @param img
+ * @brief ComputationHandler::cancelComputationJob
+ * @param cu
  * @return
  *
- * This function converts an image into 3 matrices (for the 3 channels: red, green, blue).
- * The image format in the matrices is float (pixel values from 0 to 1).
+ * This function removes the runnable object from the thread pool queue, if it has not started yet.
+ * It returns true if the job has been removed: it will never run and belongs to the caller again.
  */
-ImageMatricesRGB ComputationHandler::imageToMatrices(QImage img) {
-    QColor color;
+bool ComputationHandler::cancelComputationJob(QRunnable *cu) {
+    QMutexLocker locker(&g_scheduler_mutex);
 
-    // Initialize the 3 channels matrices
-    MatrixXd img_rgb_r(img.height(), img.width());
-    MatrixXd img_rgb_g(img.height(), img.width());
-    MatrixXd img_rgb_b(img.height(), img.width());
+    ScheduledJob *job = g_queued_jobs.value(cu, nullptr);
 
-    // Loop across the image rows
-    for (int y = 0 ; y < img.height() ; y++) {
-        // Loop across the pixels in the row
-        for (int x = 0 ; x < img.width() ; x++) {
-            color = img.pixel(x,y);
-
-            // Split channels into matrices
-            img_rgb_r(y,x) = color.redF();
-            img_rgb_g(y,x) = color.greenF();
-            img_rgb_b(y,x) = color.blueF();
+    // Not queued anymore (or never)
+    if (!job || !job->pool()->tryTake(job))
+        return false;
+
+    g_queued_jobs.remove(cu);
+    g_job_stats[job->priority()].queued--;
+
+    delete job;
+
+    return true;
+}
+
+/**
+ * @brief ComputationHandler::releaseComputationJob
+ * @param cu
+ *
+ * This function gives up the ownership of a computation unit (its owner is deleted).
+ * A queued or finished unit is deleted now, a running one is deleted by its thread when it exits.
+ * The caller must disconnect from it first, and interrupt it if it can.
+ */
+void ComputationHandler::releaseComputationJob(QRunnable *cu) {
+    {
+        QMutexLocker locker(&g_scheduler_mutex);
+
+        ScheduledJob *job = g_queued_jobs.value(cu, nullptr);
+
+        // Still queued: it will never run
+        if (job && job->pool()->tryTake(job)) {
+            g_queued_jobs.remove(cu);
+            g_job_stats[job->priority()].queued--;
+
+            delete job;
+        }
+        // Running, or started and about to leave the queue
+        else {
+            if (!job)
+                job = g_running_jobs.value(cu, nullptr);
+
+            if (job) {
+                g_released_jobs.insert(job);
+                return;
+            }
         }
     }
 
-    return {img_rgb_r, img_rgb_g, img_rgb_b};
+    delete cu;
 }
 
 /**
- * @brief ComputationHandler::imageToChannelMatrix
+ * @brief ComputationHandler::jobStatistics
+ * @param priority
+ * @return
+ *
+ * This function returns the queue statistics of a priority class
+ */
+JobStatistics ComputationHandler::jobStatistics(JobPriority priority) {
+    QMutexLocker locker(&g_scheduler_mutex);
+    return g_job_stats[priority];
+}
+
+/**
+ * @brief ComputationHandler::parallelFor
+ * @param count
+ * @param function
+ *
+ * This function calls function(i) for i in [0, count), concurrently, and returns when all the calls
+ * are done. The helper tasks are queued on the background/batch threads with the priority of the
+ * calling job: the nested work needs no other threads, and it never gets ahead of a more urgent job
+ * (the helpers of an interactive job are started first). The calling thread takes part in the loop,
+ * then takes back the helpers that have not started yet: it never waits for a queued task
+ * (no deadlock when all the threads are busy).
+ */
+void ComputationHandler::parallelFor(int count, const std::function<void(int)> &function) {
+    QThreadPool *pool = g_thread_pool;
+    const JobPriority priority = t_job_priority;
+
+    const int helper_count = pool ? qMin(count, pool->maxThreadCount()) - 1 : 0;
+
+    QAtomicInt next(0);
+    QSemaphore done;
+    QVector<ParallelForTask*> helpers;
+
+    for (int h = 0 ; h < helper_count ; h++) {
+        helpers.append(new ParallelForTask(function, count, &next, &done, priority));
+        pool->start(helpers.last(), priority - PriorityBackground);
+    }
+
+    ParallelForTask::runIndices(function, count, &next);
+
+    // The helpers still in the queue have nothing left to do
+    int started = 0;
+
+    for (ParallelForTask *helper : helpers) {
+        if (!pool->tryTake(helper))
+            started++;
+    }
+
+    done.acquire(started);
+
+    qDeleteAll(helpers);
+}
+
+/**
+ * @brief ComputationHandler::solveStatsText
+ * @param stats
+ * @return
+ *
+ * This function returns a one line report of a blending solve (shown to the user)
+ */
+QString ComputationHandler::solveStatsText(const SolveStats &stats) {
+    QString solver;
+
+    switch (stats.solver) {
+    case SolverCholesky:            solver = "Cholesky";                break;
+    case SolverConjugateGradient:   solver = "conjugate gradient";      break;
+    case SolverMultigrid:           solver = "multigrid";               break;
+    case SolverFastPoisson:         solver = "fast Poisson";            break;
+    case SolverDomainDecomposition: solver = "domain decomposition";    break;
+    }
+
+    return QString("%1: %2 iterations, relative residual %3%4, setup %5 ms, solve %6 ms, %7 KiB")
+            .arg(solver)
+            .arg(stats.iterations)
+            .arg(stats.error, 0, 'g', 2)
+            .arg(stats.converged ? "" : " (not converged)")
+            .arg(stats.setup_time)
+            .arg(stats.solve_time)
+            .arg(stats.bytes_allocated / 1024);
+}
+
+
+/**
+ * @brief ComputationHandler::imageToPlanes
  * @param img
- * @param channel
  * @return
  *
- * This function converts an image's color channel to a matrix
+ * This function converts an image into 3 planes (for the 3 channels: red, green, blue).
+ * The image format in the planes is float (pixel values from 0 to 1).
  */
-MatrixXd ComputationHandler::imageToChannelMatrix(QImage img, int channel) {
-    QColor color;
+ImagePlanes ComputationHandler::imageToPlanes(QImage img) {
+    img = toRgb32Image(img);
 
-    // Initialize the 3 channels matrices
-    MatrixXd img_rgb_ch(img.height(), img.width());
+    ImagePlanes planes(img.width(), img.height());
 
-    // Loop across the image rows
+    // Split the channels of each scanline (straight into the row-major planes)
     for (int y = 0 ; y < img.height() ; y++) {
-        // Loop across the pixels in the row
-        for (int x = 0 ; x < img.width() ; x++) {
-            color = img.pixel(x,y);
+        unpackRgbRow((const QRgb*) img.constScanLine(y), planes.row(0, y), planes.row(1, y), planes.row(2, y), img.width());
+    }
 
-            // Put the needed color channel
-            if (channel == 0) {
-                img_rgb_ch(y,x) = color.redF();
-            }
-            else if (channel == 1) {
-                img_rgb_ch(y,x) = color.greenF();
-            }
-            else {
-                img_rgb_ch(y,x) = color.blueF();
-            }
-        }
+    return planes;
+}
+
+/**
+ * @brief ComputationHandler::targetPlanes
+ * @param target
+ * @return
+ *
+ * This function returns the planes of the whole target image.
+ * They are converted once per target (identified by its QImage::cacheKey()) and shared by
+ * all the pasted items, so a blending only takes a window of them (see targetWindowPlanes).
+ * Thread-safe: the first caller converts the image, the others wait for it.
+ */
+ImagePlanes ComputationHandler::targetPlanes(QImage target) {
+    QMutexLocker locker(&g_target_planes_mutex);
+
+    if (g_target_planes.isNull() || g_target_planes_key != target.cacheKey()) {
+        // Release the former target first (only the last one is kept)
+        g_target_planes = ImagePlanes();
+
+        g_target_planes = imageToPlanes(target);
+        g_target_planes_key = target.cacheKey();
     }
 
-    return img_rgb_ch;
+    return g_target_planes;
 }
 
 /**
- * @brief ComputationHandler::matricesToImage
- * @param im_rgb
+ * @brief ComputationHandler::targetWindowPlanes
+ * @param target
+ * @param rect
  * @return
  *
- * This function performs a conversion from 3-matrix format to QImage
+ * This function returns the planes of the target part under a pasted item, without copy.
+ * If the part is not entirely inside the target, it is converted on its own (the pixels out
+ * of the target are null, like with QImage::copy()).
+ * A window covering the whole image (composite of the layers beneath an item, see
+ * TargetGraphicsScene::compositeBelow) is converted on its own too, it is not cached.
  */
-QImage ComputationHandler::matricesToImage(ImageMatricesRGB im_rgb) {
-    // Allocate the QImage
-    QImage img(im_rgb[0].cols(), im_rgb[0].rows(), QImage::Format_RGB32);
+ImagePlanes ComputationHandler::targetWindowPlanes(QImage target, QRect rect) {
+    if (!target.rect().contains(rect))
+        return imageToPlanes(target.copy(rect));
+
+    if (rect == target.rect())
+        return imageToPlanes(target);
+
+    return targetPlanes(target).window(rect);
+}
+
+/**
+ * @brief ComputationHandler::prepareTargetPlanes
+ * @param target
+ *
+ * This function converts a new target image in the background, before the first blending needs it.
+ * It is a background job like the others (queue order and statistics).
+ */
+void ComputationHandler::prepareTargetPlanes(QImage target) {
+    if (!g_thread_pool || target.isNull())
+        return;
+
+    startComputationJob(new TargetPlanesTask(target), PriorityBackground);
+}
+
+/**
+ * @brief ComputationHandler::planesToImage
+ * @param planes
+ * @return
+ *
+ * This function performs a conversion from 3-plane format to QImage
+ */
+QImage ComputationHandler::planesToImage(const ImagePlanes &planes) {
+    QImage img(planes.width(), planes.height(), QImage::Format_RGB32);
 
     for (int y = 0 ; y < img.height() ; y++) {
-        // Get a RGB pointer to the destination image row
-        QRgb *row = (QRgb*) img.scanLine(y);
-
-        // Set each pixel in the row
-        for (int x = 0 ; x < img.width() ; x++) {
-            row[x] = qRgb(
-                    qBound(0.0, im_rgb[0](y,x) * 255.0, 255.0),
-                    qBound(0.0, im_rgb[1](y,x) * 255.0, 255.0),
-                    qBound(0.0, im_rgb[2](y,x) * 255.0, 255.0)
-                );
-        }
+        packPlanarRow(planes.constRow(0, y), planes.constRow(1, y), planes.constRow(2, y), nullptr, (QRgb*) img.scanLine(y), img.width());
     }
 
     return img;
 }
 
 /**
- * @brief ComputationHandler::matricesToImage
- * @param im_rgb
+ * @brief ComputationHandler::planesToImage
+ * @param planes
+ * @param mask
  * @return
  *
- * This function performs a conversion from 3-matrix format to QImage
+ * This function performs a conversion from 3-plane format to QImage, masked by the selection
+ * (the pixels outside the mask are transparent)
  */
-QImage ComputationHandler::matricesToImage(ImageMatricesRGB im_rgb, MatrixXd alpha_mask) {
-    // Allocate the QImage
-    QImage img(im_rgb[0].cols(), im_rgb[0].rows(), QImage::Format_ARGB32);
+QImage ComputationHandler::planesToImage(const ImagePlanes &planes, const SelectionMask &mask) {
+    QImage img(planes.width(), planes.height(), QImage::Format_ARGB32);
+    img.fill(Qt::transparent);
 
+    // Only the spans inside the mask are converted
     for (int y = 0 ; y < img.height() ; y++) {
-        // Get a RGB pointer to the destination image row
-        QRgb *row = (QRgb*) img.scanLine(y);
-
-        // Set each pixel in the row
-        for (int x = 0 ; x < img.width() ; x++) {
-            row[x] = qRgba(
-                    qBound(0.0, im_rgb[0](y,x) * 255.0, 255.0),
-                    qBound(0.0, im_rgb[1](y,x) * 255.0, 255.0),
-                    qBound(0.0, im_rgb[2](y,x) * 255.0, 255.0),
-                    alpha_mask(y,x) * 255
-                );
+        const SelectionMask::Span *spans = mask.rowSpans(y);
+
+        for (int s = 0 ; s < mask.spanCount(y) ; s++) {
+            const int x = spans[s].x_begin;
+
+            packPlanarRow(planes.constRow(0, y) + x, planes.constRow(1, y) + x, planes.constRow(2, y) + x, nullptr,
+                          (QRgb*) img.scanLine(y) + x, spans[s].x_end - x);
+        }
+    }
+
+    return img;
+}
+
+/**
+ * @brief ComputationHandler::solutionToImage
+ * @param solution
+ * @param index_map
+ * @return
+ *
+ * This function converts the solution of the linear system (one column per color channel)
+ * into an image of the mask size, in a single pass. The pixels outside the mask are transparent.
+ */
+QImage ComputationHandler::solutionToImage(const MatrixX3d &solution, const UnknownIndexMap &index_map) {
+    QImage img(index_map.index.cols(), index_map.index.rows(), QImage::Format_ARGB32);
+    img.fill(Qt::transparent);
+
+    const SelectionMask &unknowns = index_map.unknowns;
+    int i = 0;
+
+    // Each span of unknowns is a block of contiguous rows of the solution
+    for (int y = 0 ; y < unknowns.height() ; y++) {
+        const SelectionMask::Span *spans = unknowns.rowSpans(y);
+
+        for (int s = 0 ; s < unknowns.spanCount(y) ; s++) {
+            const int length = spans[s].x_end - spans[s].x_begin;
+
+            packInterleavedRow(solution.data() + 3 * i, (QRgb*) img.scanLine(y) + spans[s].x_begin, length);
+
+            i += length;
         }
     }
 
@@ -171,264 +686,598 @@ QImage ComputationHandler::matricesToImage(ImageMatricesRGB im_rgb, MatrixXd alp
  * @param selection_path
  * @return
  *
- * This function computes a mask and its invert inside the selection bounding rect
+ * This function computes the mask of the selection inside its bounding rect
+ * (scanline rasterization of the path, same inside/outside rule as QPainterPath::contains)
  */
-SelectMaskMatrices ComputationHandler::selectionToMask(QPainterPath selection_path) {
-    SelectMaskMatrices smm;
-
+SelectionMask ComputationHandler::selectionToMask(QPainterPath selection_path) {
     // Dimension of the selection bounding rect (with 1px margin)
     QRect b_rect = selection_path.boundingRect().toAlignedRect().adjusted(-1, -1, 1, 1);
 
-    // Allocating matrices
-    smm.positive_mask = MatrixXd(b_rect.height(), b_rect.width());
-    smm.negative_mask = MatrixXd(b_rect.height(), b_rect.width());
+    ScanlineRasterizer rasterizer(selection_path);
 
-    // Mask = 1 inside the selection path, 0 outside (and vice-versa)
-    for (int x = 0 ; x < b_rect.width() ; x++) {
-        for (int y = 0 ; y < b_rect.height() ; y++) {
-            if (selection_path.contains(QPoint(x,y) + b_rect.topLeft())) {
-                smm.positive_mask(y,x) = 1.0;
-                smm.negative_mask(y,x) = 0.0;
+    return rasterizer.rasterize(b_rect);
+}
+
+/**
+ * @brief ComputationHandler::maskToIndexMap
+ * @param mask
+ * @return
+ *
+ * This function assigns a row of the linear system to each pixel inside the mask.
+ * The 1px margin of the mask is never part of the unknowns.
+ */
+UnknownIndexMap ComputationHandler::maskToIndexMap(const SelectionMask &mask) {
+    UnknownIndexMap index_map;
+
+    const int32_t height = mask.height();
+    const int32_t width = mask.width();
+
+    index_map.unknowns = mask.clipped(QRect(1, 1, width-2, height-2));
+
+    // All pixels are outside the mask by default
+    index_map.index = IndexMatrix::Constant(height, width, -1);
+    index_map.pixels.reserve(index_map.unknowns.pixelCount());
+
+    // Number the pixels inside the mask in row-major order (span by span)
+    for (int32_t y = 0 ; y < height ; y++) {
+        const SelectionMask::Span *spans = index_map.unknowns.rowSpans(y);
+
+        for (int32_t s = 0 ; s < index_map.unknowns.spanCount(y) ; s++) {
+            for (int32_t x = spans[s].x_begin ; x < spans[s].x_end ; x++) {
+                index_map.index(y,x) = index_map.pixels.size();
+                index_map.pixels.append(QPoint(x,y));
+            }
+        }
+    }
+
+    return index_map;
+}
+
+/**
+ * @brief ComputationHandler::unknownsBoundingRect
+ * @param index_map
+ * @return
+ *
+ * This function returns the bounding rectangle of the unknowns (in mask coordinates)
+ */
+QRect ComputationHandler::unknownsBoundingRect(const UnknownIndexMap &index_map) {
+    if (index_map.pixels.isEmpty())
+        return QRect();
+
+    int32_t x_min = index_map.pixels[0].x(), x_max = x_min;
+    int32_t y_min = index_map.pixels[0].y(), y_max = y_min;
+
+    for (int32_t i = 1 ; i < index_map.pixels.size() ; i++) {
+        x_min = qMin(x_min, index_map.pixels[i].x());
+        x_max = qMax(x_max, index_map.pixels[i].x());
+        y_min = qMin(y_min, index_map.pixels[i].y());
+        y_max = qMax(y_max, index_map.pixels[i].y());
+    }
+
+    return QRect(x_min, y_min, x_max - x_min + 1, y_max - y_min + 1);
+}
+
+/**
+ * @brief ComputationHandler::rectangleFillRatio
+ * @param index_map
+ * @return
+ *
+ * This function returns the ratio of the bounding rectangle covered by the unknowns
+ */
+float ComputationHandler::rectangleFillRatio(const UnknownIndexMap &index_map) {
+    const QRect rect = unknownsBoundingRect(index_map);
+
+    if (rect.isEmpty())
+        return 0.0;
+
+    return (float) index_map.pixels.size() / ((float) rect.width() * rect.height());
+}
+
+/**
+ * @brief ComputationHandler::isFullRectangle
+ * @param index_map
+ * @return
+ *
+ * This function returns true if the unknowns fill their bounding rectangle
+ * (the Poisson equation then has a closed-form solution, see FastPoissonSolver)
+ */
+bool ComputationHandler::isFullRectangle(const UnknownIndexMap &index_map) {
+    const QRect rect = unknownsBoundingRect(index_map);
+
+    return !rect.isEmpty() && index_map.pixels.size() == rect.width() * rect.height();
+}
+
+/**
+ * @brief ComputationHandler::connectedComponents
+ * @param index_map
+ * @return
+ *
+ * This function labels the connected components of the unknowns (4-connectivity), span by span:
+ * two spans of consecutive rows are linked if they overlap. The components are sorted by size,
+ * largest first. If the unknowns are all connected, the list is empty (there is nothing to split).
+ */
+QVector<UnknownComponent> ComputationHandler::connectedComponents(const UnknownIndexMap &index_map) {
+    const SelectionMask &unknowns = index_map.unknowns;
+
+    // Index of the first span of each row, and union-find forest of the spans
+    QVector<int> row_first(unknowns.height() + 1, 0);
+
+    for (int y = 0 ; y < unknowns.height() ; y++) {
+        row_first[y+1] = row_first[y] + unknowns.spanCount(y);
+    }
+
+    QVector<int> parent(row_first.last());
+
+    for (int s = 0 ; s < parent.size() ; s++) {
+        parent[s] = s;
+    }
+
+    auto findRoot = [&parent](int s) {
+        while (parent[s] != s) {
+            parent[s] = parent[parent[s]];
+            s = parent[s];
+        }
+        return s;
+    };
+
+    // Link the overlapping spans of each pair of rows (both lists are sorted by x)
+    for (int y = 1 ; y < unknowns.height() ; y++) {
+        const SelectionMask::Span *above = unknowns.rowSpans(y-1);
+        const SelectionMask::Span *spans = unknowns.rowSpans(y);
+
+        int a = 0, s = 0;
+
+        while (a < unknowns.spanCount(y-1) && s < unknowns.spanCount(y)) {
+            if (above[a].x_begin < spans[s].x_end && spans[s].x_begin < above[a].x_end) {
+                const int root_a = findRoot(row_first[y-1] + a);
+                const int root_s = findRoot(row_first[y] + s);
+
+                parent[qMax(root_a, root_s)] = qMin(root_a, root_s);
+            }
+
+            // Move forward the span that ends first
+            if (above[a].x_end < spans[s].x_end) {
+                a++;
             }
             else {
-                smm.positive_mask(y,x) = 0.0;
-                smm.negative_mask(y,x) = 1.0;
+                s++;
             }
         }
     }
 
-    return smm;
+    // Label of each root, bounding rectangle and size of each component
+    QVector<int> label(parent.size(), -1);
+    QVector<QRect> rects;
+    QVector<int> sizes;
+
+    for (int y = 0 ; y < unknowns.height() ; y++) {
+        const SelectionMask::Span *spans = unknowns.rowSpans(y);
+
+        for (int s = 0 ; s < unknowns.spanCount(y) ; s++) {
+            const int root = findRoot(row_first[y] + s);
+
+            if (label[root] < 0) {
+                label[root] = rects.size();
+                rects.append(QRect());
+                sizes.append(0);
+            }
+
+            const int l = label[root];
+            rects[l] = rects[l].united(QRect(spans[s].x_begin, y, spans[s].x_end - spans[s].x_begin, 1));
+            sizes[l] += spans[s].x_end - spans[s].x_begin;
+        }
+    }
+
+    if (rects.size() <= 1)
+        return QVector<UnknownComponent>();
+
+    // Spans of each component, on its bounding rectangle with a 1px margin
+    QVector<QVector<QVector<SelectionMask::Span>>> component_spans(rects.size());
+
+    for (int l = 0 ; l < rects.size() ; l++) {
+        component_spans[l].resize(rects[l].height() + 2);
+    }
+
+    for (int y = 0 ; y < unknowns.height() ; y++) {
+        const SelectionMask::Span *spans = unknowns.rowSpans(y);
+
+        for (int s = 0 ; s < unknowns.spanCount(y) ; s++) {
+            const int l = label[findRoot(row_first[y] + s)];
+            const QPoint offset = rects[l].topLeft() - QPoint(1, 1);
+
+            component_spans[l][y - offset.y()].append({spans[s].x_begin - offset.x(), spans[s].x_end - offset.x()});
+        }
+    }
+
+    // Largest first
+    QVector<int> order(rects.size());
+
+    for (int l = 0 ; l < order.size() ; l++) {
+        order[l] = l;
+    }
+
+    std::sort(order.begin(), order.end(), [&sizes](int l1, int l2) { return sizes[l1] > sizes[l2]; });
+
+    QVector<UnknownComponent> components(rects.size());
+
+    for (int i = 0 ; i < order.size() ; i++) {
+        const int l = order[i];
+        UnknownComponent &component = components[i];
+
+        component.offset = rects[l].topLeft() - QPoint(1, 1);
+        component.index_map = maskToIndexMap(SelectionMask(rects[l].width() + 2, rects[l].height() + 2, component_spans[l]));
+
+        // Rows of the component unknowns in the whole system
+        component.rows.resize(component.index_map.pixels.size());
+
+        for (int k = 0 ; k < component.rows.size() ; k++) {
+            const QPoint p = component.index_map.pixels[k] + component.offset;
+            component.rows[k] = index_map.index(p.y(), p.x());
+        }
+    }
+
+    return components;
 }
 
 /**
  * @brief ComputationHandler::laplacianMatrix
- * @param img_size
+ * @param index_map
  * @return
  *
- * Compute the laplacian for an image of size 'img_size'
+ * Compute the laplacian for the pixels inside the mask (one row per unknown)
  */
-SparseMatrixXd ComputationHandler::laplacianMatrix(const QSize img_size, SelectMaskMatrices masks) {
-    // Compute the fixed dimensions
-    const uint32_t width = img_size.width();
-    const uint32_t height = img_size.height();
-    const uint32_t total_size = width*height;
+SparseMatrixXd ComputationHandler::laplacianMatrix(const UnknownIndexMap &index_map) {
+    // Number of unknowns
+    const int32_t total_size = index_map.pixels.size();
 
     // Allocate the sparse matrix
     SparseMatrixXd lapl_mat(total_size, total_size);
 
-    // Laplacian index
-    uint32_t idx;
-
     // Allocate the non-zero elements in each row
     lapl_mat.reserve(Eigen::VectorXi::Constant(total_size, 5));
-    for (uint32_t y = 0 ; y < height ; y++) {
-        for (uint32_t x = 0 ; x < width ; x++) {
-            // NOTE: the masks have a 1px margin
-            // Don't care if outside the mask
-            if (masks.positive_mask(y+1,x+1) == 0.0)
-                continue;
 
-            // Compute laplacian index
-            idx = y*width + x;
+    const SelectionMask &unknowns = index_map.unknowns;
+    int32_t idx = 0;
 
-            // Diagonal
-            lapl_mat.insert(idx,idx) = 4.0;
+    for (int32_t y = 0 ; y < unknowns.height() ; y++) {
+        const SelectionMask::Span *spans = unknowns.rowSpans(y);
 
-            // Neighbour left
-            if (masks.positive_mask(y+1,x) == 1.0) {
-                lapl_mat.insert(idx,idx-1) = -1.0;
-            }
-            // Neighbour right
-            if (masks.positive_mask(y+1,x+2) == 1.0) {
-                lapl_mat.insert(idx,idx+1) = -1.0;
-            }
-            // Neighbour top
-            if (masks.positive_mask(y,x+1) == 1.0) {
-                lapl_mat.insert(idx,idx-width) = -1.0;
-            }
-            // Neighbour bottom
-            if (masks.positive_mask(y+2,x+1) == 1.0) {
-                lapl_mat.insert(idx,idx+width) = -1.0;
+        for (int32_t s = 0 ; s < unknowns.spanCount(y) ; s++) {
+            for (int32_t x = spans[s].x_begin ; x < spans[s].x_end ; x++, idx++) {
+                // Diagonal
+                lapl_mat.insert(idx,idx) = 4.0;
+
+                // Horizontal neighbors: the previous and next unknowns, inside the span
+                if (x > spans[s].x_begin)   lapl_mat.insert(idx,idx-1) = -1.0;
+                if (x < spans[s].x_end-1)   lapl_mat.insert(idx,idx+1) = -1.0;
+
+                // Vertical neighbors (only those inside the mask are unknowns)
+                const int32_t top = index_map.index(y-1,x);
+                const int32_t bottom = index_map.index(y+1,x);
+
+                if (top >= 0)       lapl_mat.insert(idx,top) = -1.0;
+                if (bottom >= 0)    lapl_mat.insert(idx,bottom) = -1.0;
             }
         }
     }
 
+    lapl_mat.makeCompressed();
+
     return lapl_mat;
 }
 
 /**
- * @brief ComputationHandler::computeImageGradient
- * @param img_ch
- * @param masks
+ * @brief ComputationHandler::factorizeLaplacian
+ * @param laplacian
  * @return
  *
- * This function computes the gradient vector from the image (sum v_{pq} in reference paper).
+ * This function computes the sparse Cholesky (LDLT) factorization of the laplacian.
+ * The laplacian only depends on the mask, so the factorization can be shared by all
+ * the blendings of a pasted item (only the substitutions are left for each solve).
  */
-VectorXd ComputationHandler::computeImageGradient(MatrixXd img_ch, SelectMaskMatrices masks) {
-    // Size of the image (remove the 1px margin)
-    const uint32_t inner_width = img_ch.cols() - 2;
-    const uint32_t inner_height = img_ch.rows() - 2;
-
-    // Column vector length
-    const uint32_t N = inner_width*inner_height;
-    VectorXd grad_vect(N);
+LaplacianFactorizationPtr ComputationHandler::factorizeLaplacian(const SparseMatrixXd &laplacian) {
+    LaplacianFactorization *factorization = new LaplacianFactorization;
 
-    // Initialize the vector to 0
-    grad_vect.setZero();
+    factorization->analyzePattern(laplacian);
+    factorization->factorize(laplacian);
 
-    // For each pixel p∈Ω -> compute the numerical gradient
-    for (uint32_t y = 1 ; y < inner_height+1 ; y++) {
-        for (uint32_t x = 1 ; x < inner_width+1 ; x++) {
-            // Check if this pixel is in the mask
-            if (masks.positive_mask(y,x) == 0)
-                continue;
+    return LaplacianFactorizationPtr(factorization);
+}
 
-            // Compute gradient: v_{pq} = 4*p - sum(N_p)
-            grad_vect((y-1)*inner_width + (x-1)) =
-                    4.0 * img_ch(y,x)
-                    - img_ch(y,x+1) - img_ch(y,x-1)     // Vertical neighbors
-                    - img_ch(y+1,x) - img_ch(y-1,x);    // Horizontal neighbors
+/**
+ * @brief ComputationHandler::computeGuidanceField
+ * @param src_img
+ * @param index_map
+ * @return
+ *
+ * This function computes the guidance field of the plain blending from the source image
+ * (sum v_{pq} in reference paper), one column per color channel.
+ * It only depends on the item, not on its position over the target.
+ */
+MatrixX3d ComputationHandler::computeGuidanceField(const ImagePlanes &src_img, const UnknownIndexMap &index_map) {
+    // One row per unknown
+    MatrixX3d guidance(index_map.pixels.size(), 3);
+
+    const SelectionMask &unknowns = index_map.unknowns;
+
+    for (int ch = 0 ; ch < 3 ; ch++) {
+        float *grad = guidance.data() + ch;
+
+        // For each pixel p∈Ω -> compute the numerical gradient (span by span, contiguous in the rows)
+        for (int32_t y = 0 ; y < unknowns.height() ; y++) {
+            const SelectionMask::Span *spans = unknowns.rowSpans(y);
+
+            const float *row = src_img.constRow(ch, y);
+            const float *row_above = src_img.constRow(ch, y-1);
+            const float *row_below = src_img.constRow(ch, y+1);
+
+            for (int32_t s = 0 ; s < unknowns.spanCount(y) ; s++) {
+                for (int32_t x = spans[s].x_begin ; x < spans[s].x_end ; x++, grad += 3) {
+                    // Compute gradient: v_{pq} = 4*p - sum(N_p)
+                    *grad =
+                            4.0f * row[x]
+                            - row[x+1] - row[x-1]               // Horizontal neighbors
+                            - row_below[x] - row_above[x];      // Vertical neighbors
+                }
+            }
         }
     }
 
-    return grad_vect;
+    return guidance;
 }
 
 /**
- * @brief ComputationHandler::computeImagesGradientMixed
- * @param img1_ch
- * @param img2_ch
- * @param masks
+ * @brief ComputationHandler::computeIndependentTerms
+ * @param src_img
+ * @param tgt_img
+ * @param mixed
+ * @param index_map
+ * @param boundary_mean
  * @return
  *
- * This function computes the mixed gradient of img1_ch and img2_ch (as described by equation (13) in
- * the reference paper [Perez]).
+ * This function assembles the independent terms of the 3 channels (b in Ax = b) in a single pass
+ * over the unknowns: the guidance field (source gradient, or mixed gradient as described by
+ * equation (13) in the reference paper [Perez]) plus the target values of the neighbors outside
+ * the mask (∂Ω).
+ * If boundary_mean is not null, it receives the mean target value along the boundary.
  * The two images must have the same dimensions.
  */
-VectorXd ComputationHandler::computeImagesGradientMixed(MatrixXd img1_ch, MatrixXd img2_ch, SelectMaskMatrices masks) {
-    // Size of the image (remove the 1px margin)
-    const uint32_t inner_width = img1_ch.cols() - 2;
-    const uint32_t inner_height = img1_ch.rows() - 2;
+MatrixX3d ComputationHandler::computeIndependentTerms(const ImagePlanes &src_img, const ImagePlanes &tgt_img, bool mixed, const UnknownIndexMap &index_map, Eigen::RowVector3f *boundary_mean) {
+    MatrixX3d b(index_map.pixels.size(), 3);
 
-    // Column vector length
-    const uint32_t N = inner_width*inner_height;
-    VectorXd grad_vect(N);
+    const SelectionMask &unknowns = index_map.unknowns;
 
-    // Initialize the vector to 0
-    grad_vect.setZero();
+    // Offsets of the 4 neighbors (right, left, bottom, top) in the index map and in the planes
+    // (the target planes are usually a window of the whole target, with its own stride)
+    const int index_stride = index_map.index.cols();
+    const int index_offsets[4] = {1, -1, index_stride, -index_stride};
+    const int src_offsets[4] = {1, -1, src_img.stride(), -src_img.stride()};
+    const int tgt_offsets[4] = {1, -1, tgt_img.stride(), -tgt_img.stride()};
 
-    // Temporary variables
-    uint32_t idx = 0;
-    float img1_diff, img2_diff;
-    float img1_neighbors[4], img2_neighbors[4];
+    // Sum of the boundary values and number of (pixel, boundary neighbor) pairs
+    float boundary_sum[3] = {0.0f, 0.0f, 0.0f};
+    int boundary_links = 0;
 
-    // For each pixel p∈Ω -> compute the numerical gradient
-    for (uint32_t y = 1 ; y < inner_height+1 ; y++) {
-        for (uint32_t x = 1 ; x < inner_width+1 ; x++) {
-            // Check if this pixel is in the mask
-            if (masks.positive_mask(y,x) == 0)
-                continue;
+    // Output rows (one per unknown, the 3 channels interleaved)
+    float *out = b.data();
+
+#ifdef __SSE2__
+    const __m128 abs_mask = _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff));
+    __m128 boundary_sum_4[3] = {_mm_setzero_ps(), _mm_setzero_ps(), _mm_setzero_ps()};
+#endif
 
-            // Compute the vector index
-            idx = (y-1)*inner_width + (x-1);
+    for (int y = 0 ; y < unknowns.height() ; y++) {
+        const SelectionMask::Span *spans = unknowns.rowSpans(y);
 
-            // Initialize the sum of gradients (sum of v_pq in reference paper)
-            grad_vect(idx) = 0;
+        const int *index_row = index_map.index.data() + y * index_stride;
+        const float *src_rows[3] = {src_img.constRow(0, y), src_img.constRow(1, y), src_img.constRow(2, y)};
+        const float *tgt_rows[3] = {tgt_img.constRow(0, y), tgt_img.constRow(1, y), tgt_img.constRow(2, y)};
 
-            // Save the 4 neigbors of each image
-            img1_neighbors[0] = img1_ch(y,x+1); // Right
-            img1_neighbors[1] = img1_ch(y,x-1); // Left
-            img1_neighbors[2] = img1_ch(y+1,x); // Bottom
-            img1_neighbors[3] = img1_ch(y-1,x); // Top
+        for (int s = 0 ; s < unknowns.spanCount(y) ; s++) {
+            int x = spans[s].x_begin;
 
-            img2_neighbors[0] = img2_ch(y,x+1); // Right
-            img2_neighbors[1] = img2_ch(y,x-1); // Left
-            img2_neighbors[2] = img2_ch(y+1,x); // Bottom
-            img2_neighbors[3] = img2_ch(y-1,x); // Top
+#ifdef __SSE2__
+            // 4 unknowns at once, the neighbor tests and the gradient choice are masks
+            for ( ; x + 4 <= spans[s].x_end ; x += 4, out += 12) {
+                __m128 outside[4];
 
-            // For each neighbor
-            for (uint32_t n = 0 ; n < 4 ; n++) {
-                // Right neighbors
-                img1_diff = img1_ch(y,x) - img1_neighbors[n];
-                img2_diff = img2_ch(y,x) - img2_neighbors[n];
+                for (int n = 0 ; n < 4 ; n++) {
+                    const __m128i neighbor_index = _mm_loadu_si128((const __m128i*) (index_row + x + index_offsets[n]));
+                    outside[n] = _mm_castsi128_ps(_mm_cmplt_epi32(neighbor_index, _mm_setzero_si128()));
 
-                // Keep the most important difference in absolute value
-                if (qAbs(img1_diff) > qAbs(img2_diff)) {
-                    grad_vect(idx) += img1_diff;
+                    boundary_links += qPopulationCount((quint32) _mm_movemask_ps(outside[n]));
                 }
-                else {
-                    grad_vect(idx) += img2_diff;
+
+                float terms[3][4];
+
+                for (int ch = 0 ; ch < 3 ; ch++) {
+                    const float *src = src_rows[ch] + x;
+                    const float *tgt = tgt_rows[ch] + x;
+
+                    const __m128 src_p = _mm_loadu_ps(src);
+                    const __m128 tgt_p = _mm_loadu_ps(tgt);
+
+                    __m128 sum = _mm_setzero_ps();
+
+                    for (int n = 0 ; n < 4 ; n++) {
+                        const __m128 tgt_n = _mm_loadu_ps(tgt + tgt_offsets[n]);
+
+                        __m128 guidance = _mm_sub_ps(src_p, _mm_loadu_ps(src + src_offsets[n]));
+
+                        // Keep the most important difference in absolute value
+                        if (mixed) {
+                            const __m128 tgt_diff = _mm_sub_ps(tgt_p, tgt_n);
+                            const __m128 use_tgt = _mm_cmpgt_ps(_mm_and_ps(tgt_diff, abs_mask), _mm_and_ps(guidance, abs_mask));
+
+                            guidance = _mm_or_ps(_mm_and_ps(use_tgt, tgt_diff), _mm_andnot_ps(use_tgt, guidance));
+                        }
+
+                        const __m128 boundary = _mm_and_ps(outside[n], tgt_n);
+
+                        sum = _mm_add_ps(sum, _mm_add_ps(guidance, boundary));
+                        boundary_sum_4[ch] = _mm_add_ps(boundary_sum_4[ch], boundary);
+                    }
+
+                    _mm_storeu_ps(terms[ch], sum);
+                }
+
+                for (int k = 0 ; k < 4 ; k++) {
+                    out[3*k]   = terms[0][k];
+                    out[3*k+1] = terms[1][k];
+                    out[3*k+2] = terms[2][k];
                 }
             }
+#endif
+
+            // Remaining unknowns of the span (all of them without SSE2)
+            for ( ; x < spans[s].x_end ; x++, out += 3) {
+                bool outside[4];
+
+                for (int n = 0 ; n < 4 ; n++) {
+                    outside[n] = index_row[x + index_offsets[n]] < 0;
+                    boundary_links += outside[n];
+                }
+
+                for (int ch = 0 ; ch < 3 ; ch++) {
+                    const float *src = src_rows[ch] + x;
+                    const float *tgt = tgt_rows[ch] + x;
+
+                    float sum = 0.0f;
+
+                    for (int n = 0 ; n < 4 ; n++) {
+                        float guidance = src[0] - src[src_offsets[n]];
+
+                        if (mixed) {
+                            const float tgt_diff = tgt[0] - tgt[tgt_offsets[n]];
+                            guidance = (qAbs(tgt_diff) > qAbs(guidance)) ? tgt_diff : guidance;
+                        }
+
+                        const float boundary = outside[n] ? tgt[tgt_offsets[n]] : 0.0f;
+
+                        sum += guidance + boundary;
+                        boundary_sum[ch] += boundary;
+                    }
+
+                    out[ch] = sum;
+                }
+            }
+        }
+    }
+
+    if (boundary_mean) {
+        for (int ch = 0 ; ch < 3 ; ch++) {
+#ifdef __SSE2__
+            float lanes[4];
+            _mm_storeu_ps(lanes, boundary_sum_4[ch]);
+
+            boundary_sum[ch] += lanes[0] + lanes[1] + lanes[2] + lanes[3];
+#endif
+            (*boundary_mean)(ch) = boundary_links > 0 ? boundary_sum[ch] / boundary_links : 0.0f;
         }
     }
 
-    return grad_vect;
+    return b;
 }
 
 /**
- * @brief ComputationHandler::computeBoundaryNeighbors
- * @param tgt_img_ch
- * @param masks
+ * @brief ComputationHandler::computeIndependentTerms
+ * @param guidance
+ * @param tgt_img
+ * @param index_map
+ * @param boundary_mean
  * @return
  *
- * This function computes the sum of the neighbors of each pixel in the mask boundary.
+ * This function assembles the independent terms of the plain blending from the cached guidance
+ * field of the item (see computeGuidanceField): only the target values of the neighbors outside
+ * the mask (∂Ω) are added.
+ * If boundary_mean is not null, it receives the mean target value along the boundary.
  */
-VectorXd ComputationHandler::computeBoundaryNeighbors(MatrixXd tgt_img_ch, SelectMaskMatrices masks) {
-    // Size of the image (remove the 1px margin)
-    const uint32_t inner_width = tgt_img_ch.cols() - 2;
-    const uint32_t inner_height = tgt_img_ch.rows() - 2;
+MatrixX3d ComputationHandler::computeIndependentTerms(const MatrixX3d &guidance, const ImagePlanes &tgt_img, const UnknownIndexMap &index_map, Eigen::RowVector3f *boundary_mean) {
+    MatrixX3d b = guidance;
 
-    // Column vector length
-    const uint32_t N = inner_width*inner_height;
-    VectorXd bound_vect(N);
+    const SelectionMask &unknowns = index_map.unknowns;
 
-    // Initialize the vector to 0
-    bound_vect.setZero();
+    // Sum of the boundary values and number of (pixel, boundary neighbor) pairs
+    float boundary_sum[3] = {0.0f, 0.0f, 0.0f};
+    int boundary_links = 0;
 
-    // Compute the image masked using the negative mask
-    MatrixXd neg_img_ch = tgt_img_ch.cwiseProduct(masks.negative_mask);
+    // Adds the target value at (x,y) to the terms of an unknown
+    auto addBoundary = [&](float *terms, int x, int y) {
+        for (int ch = 0 ; ch < 3 ; ch++) {
+            const float value = tgt_img.at(ch, y, x);
 
-    // For each pixel p∈Ω -> compute the numerical gradient
-    for (uint32_t y = 1 ; y < inner_height+1 ; y++) {
-        for (uint32_t x = 1 ; x < inner_width+1 ; x++) {
-            // Check if this pixel is in the mask
-            if (masks.positive_mask(y,x) == 0)
-                continue;
+            terms[ch] += value;
+            boundary_sum[ch] += value;
+        }
+
+        boundary_links++;
+    };
+
+    float *out = b.data();
+
+    for (int y = 0 ; y < unknowns.height() ; y++) {
+        const SelectionMask::Span *spans = unknowns.rowSpans(y);
 
-            // Compute the sum of the neighbors
-            bound_vect((y-1)*inner_width + (x-1)) =
-                    neg_img_ch(y,x+1) + neg_img_ch(y,x-1) +
-                    neg_img_ch(y+1,x) + neg_img_ch(y-1,x);
+        const int *index_above = index_map.index.data() + (y-1) * index_map.index.cols();
+        const int *index_below = index_map.index.data() + (y+1) * index_map.index.cols();
+
+        for (int s = 0 ; s < unknowns.spanCount(y) ; s++) {
+            // Horizontal neighbors are outside at the ends of the span only
+            addBoundary(out, spans[s].x_begin - 1, y);
+            addBoundary(out + 3 * (spans[s].x_end - spans[s].x_begin - 1), spans[s].x_end, y);
+
+            for (int x = spans[s].x_begin ; x < spans[s].x_end ; x++, out += 3) {
+                if (index_above[x] < 0) addBoundary(out, x, y-1);
+                if (index_below[x] < 0) addBoundary(out, x, y+1);
+            }
+        }
+    }
+
+    if (boundary_mean) {
+        for (int ch = 0 ; ch < 3 ; ch++) {
+            (*boundary_mean)(ch) = boundary_links > 0 ? boundary_sum[ch] / boundary_links : 0.0f;
         }
     }
 
-    return bound_vect;
+    return b;
 }
 
 /**
- * @brief ComputationHandler::vectorToMatrixImage
- * @param img_vect
- * @param img_size
+ * @brief ComputationHandler::computeBoundaryMean
+ * @param tgt_img
+ * @param index_map
  * @return
  *
- * This function reshapes the image vector into an image matrix
+ * This function computes the mean target value along the mask boundary, for each channel
+ * (each pair of an unknown and a neighbor outside the mask counts once).
  */
-MatrixXd ComputationHandler::vectorToMatrixImage(VectorXd img_vect, QSize img_size) {
-    // Allocate the image matrix
-    MatrixXd img_mat(img_size.height(), img_size.width());
+Eigen::RowVector3f ComputationHandler::computeBoundaryMean(const ImagePlanes &tgt_img, const UnknownIndexMap &index_map) {
+    Eigen::RowVector3f sum = Eigen::RowVector3f::Zero();
+    int boundary_links = 0;
+
+    for (int32_t idx = 0 ; idx < index_map.pixels.size() ; idx++) {
+        const int32_t x = index_map.pixels[idx].x();
+        const int32_t y = index_map.pixels[idx].y();
+
+        const QPoint neighbors[4] = {QPoint(x+1,y), QPoint(x-1,y), QPoint(x,y+1), QPoint(x,y-1)};
+
+        for (int n = 0 ; n < 4 ; n++) {
+            if (index_map.index(neighbors[n].y(), neighbors[n].x()) >= 0)
+                continue;
+
+            for (int ch = 0 ; ch < 3 ; ch++) {
+                sum(ch) += tgt_img.at(ch, neighbors[n].y(), neighbors[n].x());
+            }
 
-    // Loop over each pixel and copy it into the matrix
-    for (int32_t y = 0 ; y < img_size.height() ; y++) {
-        for (int32_t x = 0 ; x < img_size.width() ; x++) {
-            img_mat(y,x) = img_vect(y*img_size.width() + x);
+            boundary_links++;
         }
     }
 
-    return img_mat;
-}
-
+    if (boundary_links == 0)
+        return Eigen::RowVector3f::Zero();
 
+    return sum / boundary_links;
+}
 
 /*
  * Types serialization functions declaration
@@ -535,18 +1384,3 @@ QDataStream &operator<<(QDataStream &out, SparseMatrixXd &p) {
     return out;
 }
 
-// SelectMaskMatrices serialization
-QDataStream &operator>>(QDataStream &in, SelectMaskMatrices &p) {
-    in >> p.positive_mask;
-    in >> p.negative_mask;
-
-    return in;
-}
-
-QDataStream &operator<<(QDataStream &out, SelectMaskMatrices &p) {
-    out << p.positive_mask;
-    out << p.negative_mask;
-
-    return out;
-}
-
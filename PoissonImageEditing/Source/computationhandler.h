@@ -4,12 +4,20 @@
 #include <QImage>
 #include <QObject>
 #include <QPainterPath>
+#include <QSharedPointer>
+#include <QVector>
+#include <QPoint>
+#include <QRect>
 
 #include <Eigen/Core>
 #include <Eigen/Sparse>
 #include <Eigen/SparseCholesky>
 
 #include "array"
+#include <functional>
+
+#include "imageplanes.h"
+#include "selectionmask.h"
 
 
 /*
@@ -18,40 +26,142 @@
 typedef Eigen::Matrix<float, Eigen::Dynamic, Eigen::Dynamic> MatrixXd;
 typedef Eigen::SparseMatrix<float> SparseMatrixXd;
 typedef Eigen::Matrix<float, Eigen::Dynamic, 1> VectorXd;
+typedef Eigen::Matrix<float, Eigen::Dynamic, 3, Eigen::RowMajor> MatrixX3d;     // One column per color channel
+typedef Eigen::Matrix<int, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor> IndexMatrix;    // Same layout as the image planes
+
+typedef Eigen::SimplicialLDLT<SparseMatrixXd> LaplacianFactorization;
+typedef QSharedPointer<const LaplacianFactorization> LaplacianFactorizationPtr;
+
+// Guidance field of the plain blending (one row per unknown), shared by the jobs of an item
+typedef QSharedPointer<const MatrixX3d> GuidanceFieldPtr;
+
+/*
+ * Linear solvers available for the blending
+ */
+enum SolverType {
+    SolverCholesky,
+    SolverConjugateGradient,
+    SolverMultigrid,
+    SolverFastPoisson,
+    SolverDomainDecomposition
+};
+
+/*
+ * Priority classes of the computation jobs (see ComputationHandler::startComputationJob)
+ */
+enum JobPriority {
+    PriorityBatch,          // Bulk work: recompute all the layers, precomputations
+    PriorityBackground,     // Visible work the user is not interacting with
+    PriorityInteractive     // Work of the item the user is manipulating
+};
+
+#define JOB_PRIORITY_COUNT 3
 
-typedef std::array<MatrixXd,3> ImageMatricesRGB;
+// Threads reserved to the interactive jobs (they never wait behind bulk work)
+#define INTERACTIVE_THREAD_COUNT 2
 
-struct SelectMaskMatrices {
-    MatrixXd positive_mask;
-    MatrixXd negative_mask;
+/*
+ * Queue statistics of one priority class (waiting times in ms)
+ */
+struct JobStatistics {
+    int queued;             // Jobs waiting for a thread
+    int running;            // Jobs being computed
+    qint64 finished;        // Jobs computed since the start
+    qint64 total_wait;      // Sum of the waiting times of the started jobs
+    qint64 max_wait;        // Longest waiting time of a started job
 };
 
+// Called by the iterative solvers after each iteration (iterations done, relative residual)
+typedef std::function<void(int, float)> SolverProgressCallback;
+
+/*
+ * Report of one blending solve (times in ms)
+ */
+struct SolveStats {
+    SolverType solver;          // Solver actually used (see BlendingComputationUnit)
+    int iterations;
+    float error;                // Relative residual of the solution
+    bool converged;             // Error below the tolerance (always true for the direct solves)
+    qint64 setup_time;          // Target planes, right-hand side, factorization and solver setup
+    qint64 solve_time;
+    qint64 bytes_allocated;     // Estimated size of the work buffers
+};
+
+// Default relative residual tolerance of the iterative solvers
+#define DEFAULT_SOLVER_TOLERANCE 1e-5
+
+// Below this ratio of its bounding rectangle, a mask is solved by multigrid instead of the fast Poisson solver
+#define FAST_POISSON_MIN_FILL_RATIO 0.8
+
+/*
+ * Compact unknowns of the linear system: only the pixels inside the mask are
+ * solved for. Rows are assigned in row-major order (y then x), so the pixels of
+ * a span of 'unknowns' are consecutive rows.
+ */
+struct UnknownIndexMap {
+    IndexMatrix index;          // Mask pixel (y,x) -> row in the system (-1 outside the mask)
+    QVector<QPoint> pixels;     // Row in the system -> mask pixel (x,y)
+    SelectionMask unknowns;     // Pixels of the unknowns (the mask without its margin)
+};
+
+/*
+ * Connected part of the unknowns (4-connectivity, like the Laplacian stencil).
+ * The Laplacian of a mask is block-diagonal with one block per component, so each
+ * component is a smaller system that can be solved on its own.
+ */
+struct UnknownComponent {
+    UnknownIndexMap index_map;  // Unknowns of the component, on its bounding rectangle (with 1px margin)
+    QPoint offset;              // Position of that rectangle in the mask
+    QVector<int> rows;          // Row in the component system -> row in the whole system
+};
+
+// Components of the unknowns of an item, shared by its blending jobs
+typedef QSharedPointer<const QVector<UnknownComponent>> UnknownComponentsPtr;
+
 
 class QRunnable;
 class QThreadPool;
 class PastedSourceItem;
 class TransferComputationUnit;
 class BlendingComputationUnit;
+class ResponseComputationUnit;
 
 class ComputationHandler
 {
 public:
     static void initializeComputationHandler(QObject *parent = nullptr);
-    static bool startComputationJob(QRunnable *cu);
-
-    static ImageMatricesRGB imageToMatrices(QImage img);
-    static MatrixXd imageToChannelMatrix(QImage img, int channel);
-    static QImage matricesToImage(ImageMatricesRGB im_rgb);
-    static QImage matricesToImage(ImageMatricesRGB im_rgb, MatrixXd alpha_mask);
-    static MatrixXd vectorToMatrixImage(VectorXd img_vect, QSize img_size);
-
-    static SelectMaskMatrices selectionToMask(QPainterPath selection_path);
-
-    static SparseMatrixXd laplacianMatrix(const QSize img_size, SelectMaskMatrices masks);
-
-    static VectorXd computeImageGradient(MatrixXd img_ch, SelectMaskMatrices masks);
-    static VectorXd computeImagesGradientMixed(MatrixXd img1_ch, MatrixXd img2_ch, SelectMaskMatrices masks);
-    static VectorXd computeBoundaryNeighbors(MatrixXd tgt_img_ch, SelectMaskMatrices masks);
+    static void setThreadCount(int count);
+    static int threadCount();
+    static bool startComputationJob(QRunnable *cu, JobPriority priority = PriorityBackground);
+    static bool cancelComputationJob(QRunnable *cu);
+    static void releaseComputationJob(QRunnable *cu);
+    static JobStatistics jobStatistics(JobPriority priority);
+    static void parallelFor(int count, const std::function<void(int)> &function);
+    static QString solveStatsText(const SolveStats &stats);
+
+    static ImagePlanes imageToPlanes(QImage img);
+    static ImagePlanes targetPlanes(QImage target);
+    static ImagePlanes targetWindowPlanes(QImage target, QRect rect);
+    static void prepareTargetPlanes(QImage target);
+    static QImage planesToImage(const ImagePlanes &planes);
+    static QImage planesToImage(const ImagePlanes &planes, const SelectionMask &mask);
+    static QImage solutionToImage(const MatrixX3d &solution, const UnknownIndexMap &index_map);
+
+    static SelectionMask selectionToMask(QPainterPath selection_path);
+    static UnknownIndexMap maskToIndexMap(const SelectionMask &mask);
+
+    static QRect unknownsBoundingRect(const UnknownIndexMap &index_map);
+    static float rectangleFillRatio(const UnknownIndexMap &index_map);
+    static bool isFullRectangle(const UnknownIndexMap &index_map);
+    static QVector<UnknownComponent> connectedComponents(const UnknownIndexMap &index_map);
+
+    static SparseMatrixXd laplacianMatrix(const UnknownIndexMap &index_map);
+    static LaplacianFactorizationPtr factorizeLaplacian(const SparseMatrixXd &laplacian);
+
+    static MatrixX3d computeGuidanceField(const ImagePlanes &src_img, const UnknownIndexMap &index_map);
+    static MatrixX3d computeIndependentTerms(const ImagePlanes &src_img, const ImagePlanes &tgt_img, bool mixed, const UnknownIndexMap &index_map, Eigen::RowVector3f *boundary_mean = nullptr);
+    static MatrixX3d computeIndependentTerms(const MatrixX3d &guidance, const ImagePlanes &tgt_img, const UnknownIndexMap &index_map, Eigen::RowVector3f *boundary_mean = nullptr);
+    static Eigen::RowVector3f computeBoundaryMean(const ImagePlanes &tgt_img, const UnknownIndexMap &index_map);
 };
 
 
@@ -88,9 +198,5 @@ QDataStream &operator<<(QDataStream &out, VectorXd &p);
 QDataStream &operator>>(QDataStream &in, SparseMatrixXd &p);
 QDataStream &operator<<(QDataStream &out, SparseMatrixXd &p);
 
-// SelectMaskMatrices serialization
-QDataStream &operator>>(QDataStream &in, SelectMaskMatrices &p);
-QDataStream &operator<<(QDataStream &out, SelectMaskMatrices &p);
-
 
 #endif // COMPUTATIONHANDLER_H
@@ -0,0 +1,530 @@
+#include "domaindecompositionsolver.h"
+
+
+#define DD_TILE_SIZE                32      // px (side of the owned part of a tile)
+#define DD_OVERLAP                  4       // px (extension of a tile into its neighbors)
+#define DD_COARSE_REGULARIZATION    1e-3f   // Relative increase of the diagonal of the coarse system
+#define DD_MAX_ITERATIONS           200
+
+
+DomainDecompositionSolver::DomainDecompositionSolver(const UnknownIndexMap &index_map)
+{
+    m_index_map = index_map;
+
+    m_tolerance = 1e-5;
+    m_max_iterations = DD_MAX_ITERATIONS;
+    m_cancel_flag = nullptr;
+
+    m_iterations = 0;
+    m_error = 0.0;
+    m_allocated_bytes = 0;
+    m_setup_bytes = 0;
+    m_coarse_size = 0;
+
+    const QRect rect = ComputationHandler::unknownsBoundingRect(index_map);
+
+    if (rect.isEmpty())
+        return;
+
+    // Split the bounding rectangle into tiles, only the ones with unknowns are kept.
+    // The coarse nodes are the corners of the kept tiles.
+    const int tiles_x = (rect.width() + DD_TILE_SIZE - 1) / DD_TILE_SIZE;
+    const int tiles_y = (rect.height() + DD_TILE_SIZE - 1) / DD_TILE_SIZE;
+
+    QVector<int> cell_tile(tiles_x * tiles_y, -1);
+    QVector<int> corner_node((tiles_x + 1) * (tiles_y + 1), -1);
+
+    for (int i = 0 ; i < index_map.pixels.size() ; i++) {
+        const int cx = (index_map.pixels[i].x() - rect.x()) / DD_TILE_SIZE;
+        const int cy = (index_map.pixels[i].y() - rect.y()) / DD_TILE_SIZE;
+        const int cell = cy * tiles_x + cx;
+
+        if (cell_tile[cell] >= 0)
+            continue;
+
+        Tile tile;
+        tile.core = QRect(rect.x() + cx * DD_TILE_SIZE, rect.y() + cy * DD_TILE_SIZE, DD_TILE_SIZE, DD_TILE_SIZE).intersected(rect);
+        tile.extended = tile.core.adjusted(-DD_OVERLAP, -DD_OVERLAP, DD_OVERLAP, DD_OVERLAP).intersected(rect);
+
+        for (int k = 0 ; k < 4 ; k++) {
+            int &node = corner_node[(cy + k / 2) * (tiles_x + 1) + cx + k % 2];
+
+            if (node < 0)
+                node = m_coarse_size++;
+
+            tile.corners[k] = node;
+        }
+
+        cell_tile[cell] = m_tiles.size();
+        m_tiles.append(tile);
+    }
+
+    // Local problems (factorized concurrently), then the coarse one
+    forEachTile([this](int t) { setupTile(m_tiles[t]); });
+
+    setupCoarseSystem();
+
+    // Factors and row maps of the tiles
+    m_setup_bytes = 0;
+
+    for (int t = 0 ; t < m_tiles.size() ; t++) {
+        m_setup_bytes += m_tiles[t].factorization->matrixL().nestedExpression().nonZeros() * (qint64) (sizeof(float) + sizeof(int));
+        m_setup_bytes += m_tiles[t].local_rows.size() * (qint64) sizeof(int);
+    }
+}
+
+void DomainDecompositionSolver::setTolerance(float tolerance) {
+    m_tolerance = tolerance;
+}
+
+void DomainDecompositionSolver::setMaxIterations(int max_iterations) {
+    m_max_iterations = max_iterations;
+}
+
+void DomainDecompositionSolver::setCancelFlag(const QAtomicInt *cancel_flag) {
+    m_cancel_flag = cancel_flag;
+}
+
+void DomainDecompositionSolver::setProgressCallback(SolverProgressCallback callback) {
+    m_progress_callback = callback;
+}
+
+int DomainDecompositionSolver::tileCount() const {
+    return m_tiles.size();
+}
+
+int DomainDecompositionSolver::iterations() const {
+    return m_iterations;
+}
+
+float DomainDecompositionSolver::error() const {
+    return m_error;
+}
+
+qint64 DomainDecompositionSolver::allocatedBytes() const {
+    return m_allocated_bytes;
+}
+
+/**
+ * @brief DomainDecompositionSolver::forEachTile
+ * @param function
+ *
+ * This function calls function(tile index) for all the tiles, concurrently (see ComputationHandler::parallelFor)
+ */
+template <typename Function>
+void DomainDecompositionSolver::forEachTile(Function function) {
+    ComputationHandler::parallelFor(m_tiles.size(), function);
+}
+
+/**
+ * @brief DomainDecompositionSolver::setupTile
+ * @param tile
+ *
+ * This function builds the local problem of a tile: the unknowns of its extended rectangle,
+ * with the unknowns out of it as a null Dirichlet boundary, and factorizes its laplacian.
+ */
+void DomainDecompositionSolver::setupTile(Tile &tile) {
+    const SelectionMask &unknowns = m_index_map.unknowns;
+    const QRect &ext = tile.extended;
+
+    // Local mask on the extended rectangle (with a 1px margin)
+    const QPoint offset = ext.topLeft() - QPoint(1, 1);
+    QVector<QVector<SelectionMask::Span>> row_spans(ext.height() + 2);
+
+    for (int y = ext.top() ; y <= ext.bottom() ; y++) {
+        const SelectionMask::Span *spans = unknowns.rowSpans(y);
+
+        for (int s = 0 ; s < unknowns.spanCount(y) ; s++) {
+            const int x_begin = qMax(spans[s].x_begin, ext.left());
+            const int x_end = qMin(spans[s].x_end, ext.right() + 1);
+
+            if (x_begin < x_end) {
+                row_spans[y - offset.y()].append({x_begin - offset.x(), x_end - offset.x()});
+            }
+        }
+    }
+
+    const UnknownIndexMap local_map = ComputationHandler::maskToIndexMap(SelectionMask(ext.width() + 2, ext.height() + 2, row_spans));
+
+    tile.local_rows.resize(local_map.pixels.size());
+
+    for (int k = 0 ; k < tile.local_rows.size() ; k++) {
+        const QPoint p = local_map.pixels[k] + offset;
+        tile.local_rows[k] = m_index_map.index(p.y(), p.x());
+    }
+
+    // Owned unknowns, span by span
+    for (int y = tile.core.top() ; y <= tile.core.bottom() ; y++) {
+        const SelectionMask::Span *spans = unknowns.rowSpans(y);
+
+        for (int s = 0 ; s < unknowns.spanCount(y) ; s++) {
+            const int x_begin = qMax(spans[s].x_begin, tile.core.left());
+            const int x_end = qMin(spans[s].x_end, tile.core.right() + 1);
+
+            if (x_begin >= x_end)
+                continue;
+
+            Range range;
+            range.y = y;
+            range.x = x_begin;
+            range.start = m_index_map.index(y, x_begin);
+            range.local_start = local_map.index(y - offset.y(), x_begin - offset.x());
+            range.length = x_end - x_begin;
+
+            tile.owned.append(range);
+        }
+    }
+
+    tile.factorization = ComputationHandler::factorizeLaplacian(ComputationHandler::laplacianMatrix(local_map));
+}
+
+/**
+ * @brief DomainDecompositionSolver::setupCoarseSystem
+ *
+ * This function factorizes the coarse system A0 = Z^T A Z, where the column n of Z is the
+ * bilinear function of the coarse node n (1 at the node, 0 at the other corners of the tiles).
+ * A small multiple of its diagonal is added to A0: thin parts of the mask (a single row in a
+ * tile...) can make some coarse functions linearly dependent on the unknowns.
+ */
+void DomainDecompositionSolver::setupCoarseSystem() {
+    std::vector<Eigen::Triplet<float>> triplets;
+    triplets.reserve(4 * m_index_map.pixels.size());
+
+    foreach (const Tile &tile, m_tiles) {
+        foreach (const Range &range, tile.owned) {
+            const float wy = (range.y - tile.core.top() + 0.5f) / DD_TILE_SIZE;
+
+            for (int k = 0 ; k < range.length ; k++) {
+                const float wx = (range.x + k - tile.core.left() + 0.5f) / DD_TILE_SIZE;
+                const int i = range.start + k;
+
+                triplets.push_back(Eigen::Triplet<float>(i, tile.corners[0], (1.0f - wx) * (1.0f - wy)));
+                triplets.push_back(Eigen::Triplet<float>(i, tile.corners[1], wx * (1.0f - wy)));
+                triplets.push_back(Eigen::Triplet<float>(i, tile.corners[2], (1.0f - wx) * wy));
+                triplets.push_back(Eigen::Triplet<float>(i, tile.corners[3], wx * wy));
+            }
+        }
+    }
+
+    SparseMatrixXd prolongation(m_index_map.pixels.size(), m_coarse_size);
+    prolongation.setFromTriplets(triplets.begin(), triplets.end());
+
+    const SparseMatrixXd laplacian = ComputationHandler::laplacianMatrix(m_index_map);
+    SparseMatrixXd coarse = SparseMatrixXd(prolongation.transpose()) * (laplacian * prolongation);
+
+    for (int n = 0 ; n < m_coarse_size ; n++) {
+        coarse.coeffRef(n, n) *= 1.0f + DD_COARSE_REGULARIZATION;
+    }
+
+    m_coarse_factorization = ComputationHandler::factorizeLaplacian(coarse);
+}
+
+/**
+ * @brief DomainDecompositionSolver::applyOperator
+ * @param tile
+ * @param in
+ * @param out
+ *
+ * out = A*in on the unknowns owned by the tile (the other rows of out are not written,
+ * so the tiles can be processed concurrently)
+ */
+void DomainDecompositionSolver::applyOperator(const Tile &tile, const MatrixX3d &in, MatrixX3d &out) const {
+    const int w = m_index_map.index.cols();
+    const int *index = m_index_map.index.data();
+
+    foreach (const Range &range, tile.owned) {
+        const int *row = index + range.y * w;
+
+        for (int k = 0 ; k < range.length ; k++) {
+            const int i = range.start + k;
+            const int x = range.x + k;
+            const int neighbors[4] = {row[x-1], row[x+1], row[x-w], row[x+w]};
+
+            Eigen::RowVector3f value = 4.0f * in.row(i);
+
+            for (int n = 0 ; n < 4 ; n++) {
+                if (neighbors[n] >= 0) {
+                    value -= in.row(neighbors[n]);
+                }
+            }
+
+            out.row(i) = value;
+        }
+    }
+}
+
+/**
+ * @brief DomainDecompositionSolver::restrictToCoarse
+ * @param tile
+ * @param in
+ * @return
+ *
+ * This function returns the contribution of the unknowns owned by the tile to Z^T*in,
+ * one row per corner of the tile
+ */
+Eigen::Matrix<float, 4, 3> DomainDecompositionSolver::restrictToCoarse(const Tile &tile, const MatrixX3d &in) const {
+    Eigen::Matrix<float, 4, 3> out = Eigen::Matrix<float, 4, 3>::Zero();
+
+    foreach (const Range &range, tile.owned) {
+        const float wy = (range.y - tile.core.top() + 0.5f) / DD_TILE_SIZE;
+
+        // Sums along the row, weighted for the left and the right corners
+        Eigen::RowVector3f left = Eigen::RowVector3f::Zero();
+        Eigen::RowVector3f right = Eigen::RowVector3f::Zero();
+
+        for (int k = 0 ; k < range.length ; k++) {
+            const float wx = (range.x + k - tile.core.left() + 0.5f) / DD_TILE_SIZE;
+
+            left += (1.0f - wx) * in.row(range.start + k);
+            right += wx * in.row(range.start + k);
+        }
+
+        out.row(0) += (1.0f - wy) * left;
+        out.row(1) += (1.0f - wy) * right;
+        out.row(2) += wy * left;
+        out.row(3) += wy * right;
+    }
+
+    return out;
+}
+
+/**
+ * @brief DomainDecompositionSolver::prolongate
+ * @param tile
+ * @param coarse
+ * @param out
+ *
+ * out = Z*coarse on the unknowns owned by the tile (bilinear interpolation of its corners)
+ */
+void DomainDecompositionSolver::prolongate(const Tile &tile, const MatrixXd &coarse, MatrixX3d &out) const {
+    const Eigen::RowVector3f top_left = coarse.row(tile.corners[0]);
+    const Eigen::RowVector3f top_right = coarse.row(tile.corners[1]);
+    const Eigen::RowVector3f bottom_left = coarse.row(tile.corners[2]);
+    const Eigen::RowVector3f bottom_right = coarse.row(tile.corners[3]);
+
+    foreach (const Range &range, tile.owned) {
+        const float wy = (range.y - tile.core.top() + 0.5f) / DD_TILE_SIZE;
+
+        const Eigen::RowVector3f left = (1.0f - wy) * top_left + wy * bottom_left;
+        const Eigen::RowVector3f right = (1.0f - wy) * top_right + wy * bottom_right;
+
+        for (int k = 0 ; k < range.length ; k++) {
+            const float wx = (range.x + k - tile.core.left() + 0.5f) / DD_TILE_SIZE;
+
+            out.row(range.start + k) = (1.0f - wx) * left + wx * right;
+        }
+    }
+}
+
+/**
+ * @brief DomainDecompositionSolver::solve
+ * @param b
+ * @return
+ *
+ * This function solves A*X = B (one column per color channel), starting from X = 0.
+ */
+MatrixX3d DomainDecompositionSolver::solve(const MatrixX3d &b) {
+    return solveWithGuess(b, MatrixX3d::Zero(b.rows(), 3));
+}
+
+/**
+ * @brief DomainDecompositionSolver::solveWithGuess
+ * @param b
+ * @param x0
+ * @return
+ *
+ * This function solves A*X = B (one column per color channel), starting from X = x0.
+ * Flexible preconditioned CG iterations are done until the relative residual of every
+ * column is below the tolerance. The preconditioner is z = v + RAS(r - A*v), where v is the
+ * coarse correction Z*A0^-1*Z^T*r.
+ */
+MatrixX3d DomainDecompositionSolver::solveWithGuess(const MatrixX3d &b, const MatrixX3d &x0) {
+    const Eigen::Index N = b.rows();
+    const int tile_count = m_tiles.size();
+
+    MatrixX3d x = x0;
+    MatrixX3d r(N, 3), z(N, 3), z_old(N, 3), p(N, 3), q(N, 3), v(N, 3), r_fine(N, 3);
+
+    // Partial sums of each tile (reduced on the calling thread)
+    QVector<Eigen::Array3d> partial_1(tile_count), partial_2(tile_count);
+    MatrixXd tile_sums(4 * tile_count, 3);
+
+    auto reduce = [tile_count](const QVector<Eigen::Array3d> &partial) {
+        Eigen::Array3d sum = Eigen::Array3d::Zero();
+
+        for (int t = 0 ; t < tile_count ; t++) {
+            sum += partial[t];
+        }
+
+        return sum;
+    };
+
+    // Sum of v*w over the unknowns owned by a tile, per channel
+    auto tileDot = [](const Tile &tile, const MatrixX3d &v, const MatrixX3d &w) {
+        Eigen::Array3d sum = Eigen::Array3d::Zero();
+
+        foreach (const Range &range, tile.owned) {
+            sum += v.middleRows(range.start, range.length).cwiseProduct(w.middleRows(range.start, range.length)).colwise().sum().cast<double>().transpose().array();
+        }
+
+        return sum;
+    };
+
+    // Initial residual r = b - A*x
+    forEachTile([&](int t) {
+        const Tile &tile = m_tiles[t];
+
+        applyOperator(tile, x, q);
+
+        foreach (const Range &range, tile.owned) {
+            r.middleRows(range.start, range.length) = b.middleRows(range.start, range.length) - q.middleRows(range.start, range.length);
+        }
+
+        partial_1[t] = tileDot(tile, r, r);
+        partial_2[t] = tileDot(tile, b, b);
+    });
+
+    Eigen::Array3d rr = reduce(partial_1);
+    Eigen::Array3d b_norm = reduce(partial_2).sqrt();
+
+    // Null right-hand sides are already solved
+    for (int c = 0 ; c < 3 ; c++) {
+        if (b_norm(c) == 0.0)
+            b_norm(c) = 1.0;
+    }
+
+    m_iterations = 0;
+    m_error = (rr.sqrt() / b_norm).maxCoeff();
+
+    // x, r, z, z_old, p, q, v and r_fine (+ the local problems)
+    m_allocated_bytes = m_setup_bytes + 8 * N * 3 * (qint64) sizeof(float);
+
+    if (m_progress_callback)
+        m_progress_callback(m_iterations, m_error);
+
+    if (m_tiles.isEmpty() || m_error < m_tolerance)
+        return x;
+
+    // Preconditioner z = M^-1 r (and the dot products of the Polak-Ribiere formula)
+    auto precondition = [&]() {
+        // Coarse correction v = Z*A0^-1*Z^T*r
+        forEachTile([&](int t) {
+            tile_sums.middleRows(4 * t, 4) = restrictToCoarse(m_tiles[t], r);
+        });
+
+        MatrixXd coarse_rhs = MatrixXd::Zero(m_coarse_size, 3);
+
+        for (int t = 0 ; t < tile_count ; t++) {
+            for (int k = 0 ; k < 4 ; k++) {
+                coarse_rhs.row(m_tiles[t].corners[k]) += tile_sums.row(4 * t + k);
+            }
+        }
+
+        const MatrixXd coarse = m_coarse_factorization->solve(coarse_rhs);
+
+        forEachTile([&](int t) {
+            prolongate(m_tiles[t], coarse, v);
+        });
+
+        // Residual left by the coarse correction
+        forEachTile([&](int t) {
+            const Tile &tile = m_tiles[t];
+
+            applyOperator(tile, v, r_fine);
+
+            foreach (const Range &range, tile.owned) {
+                r_fine.middleRows(range.start, range.length) = r.middleRows(range.start, range.length) - r_fine.middleRows(range.start, range.length);
+            }
+        });
+
+        // Local problems, each tile keeps the values of its own unknowns
+        z_old.swap(z);
+
+        forEachTile([&](int t) {
+            const Tile &tile = m_tiles[t];
+
+            MatrixXd local_r(tile.local_rows.size(), 3);
+
+            for (int k = 0 ; k < tile.local_rows.size() ; k++) {
+                local_r.row(k) = r_fine.row(tile.local_rows[k]);
+            }
+
+            const MatrixXd local_z = tile.factorization->solve(local_r);
+
+            foreach (const Range &range, tile.owned) {
+                z.middleRows(range.start, range.length) = v.middleRows(range.start, range.length) + local_z.middleRows(range.local_start, range.length);
+            }
+
+            partial_1[t] = tileDot(tile, r, z);
+            partial_2[t] = tileDot(tile, r, z_old);
+        });
+    };
+
+    precondition();
+    p = z;
+
+    Eigen::Array3d rz = reduce(partial_1);
+    Eigen::Array3d alpha, beta;
+
+    while (m_iterations < m_max_iterations) {
+        // The caller does not need the solution anymore
+        if (m_cancel_flag && m_cancel_flag->loadAcquire())
+            break;
+
+        forEachTile([&](int t) {
+            applyOperator(m_tiles[t], p, q);
+
+            partial_1[t] = tileDot(m_tiles[t], p, q);
+        });
+
+        const Eigen::Array3d pq = reduce(partial_1);
+
+        for (int c = 0 ; c < 3 ; c++) {
+            alpha(c) = (pq(c) > 0.0) ? rz(c) / pq(c) : 0.0;
+        }
+
+        const Eigen::RowVector3f alpha_f = alpha.cast<float>().matrix().transpose();
+
+        forEachTile([&](int t) {
+            foreach (const Range &range, m_tiles[t].owned) {
+                x.middleRows(range.start, range.length) += p.middleRows(range.start, range.length) * alpha_f.asDiagonal();
+                r.middleRows(range.start, range.length) -= q.middleRows(range.start, range.length) * alpha_f.asDiagonal();
+            }
+
+            partial_1[t] = tileDot(m_tiles[t], r, r);
+        });
+
+        rr = reduce(partial_1);
+
+        m_iterations++;
+        m_error = (rr.sqrt() / b_norm).maxCoeff();
+
+        if (m_progress_callback)
+            m_progress_callback(m_iterations, m_error);
+
+        if (m_error < m_tolerance)
+            break;
+
+        precondition();
+
+        // Polak-Ribiere formula (the restricted Schwarz step is not symmetric)
+        const Eigen::Array3d rz_new = reduce(partial_1);
+        const Eigen::Array3d rz_old = reduce(partial_2);
+
+        for (int c = 0 ; c < 3 ; c++) {
+            beta(c) = (rz(c) != 0.0) ? (rz_new(c) - rz_old(c)) / rz(c) : 0.0;
+        }
+
+        rz = rz_new;
+
+        const Eigen::RowVector3f beta_f = beta.cast<float>().matrix().transpose();
+
+        forEachTile([&](int t) {
+            foreach (const Range &range, m_tiles[t].owned) {
+                p.middleRows(range.start, range.length) = z.middleRows(range.start, range.length) + p.middleRows(range.start, range.length) * beta_f.asDiagonal();
+            }
+        });
+    }
+
+    return x;
+}
@@ -0,0 +1,107 @@
+#ifndef DOMAINDECOMPOSITIONSOLVER_H
+#define DOMAINDECOMPOSITIONSOLVER_H
+
+#include <QAtomicInt>
+#include <QRect>
+#include <QSharedPointer>
+#include <QVector>
+
+#include "computationhandler.h"
+
+/*
+ * Parallel two-level Schwarz solver for the masked Poisson equation (3 channels at once).
+ *
+ * The bounding rectangle of the unknowns is split into square tiles. Each tile owns the
+ * unknowns inside it, and is extended by a few pixels of overlap into its neighbors.
+ * The preconditioner of the conjugate gradient is made of:
+ *  - a coarse correction on a grid with one node at each tile corner (bilinear field),
+ *    which carries the low frequencies across the whole domain
+ *  - a restricted additive Schwarz step: the Dirichlet problem of each extended tile is
+ *    solved exactly (sparse Cholesky factorization made once), and each tile keeps the
+ *    values of the unknowns it owns
+ *
+ * Every step of an iteration (stencil product, local solves, vector updates and partial
+ * dot products) works tile by tile, on the thread pool. Only the small coarse system is
+ * solved on one thread. The restricted step is not symmetric, so the conjugate gradient
+ * is the flexible one (Polak-Ribiere formula, like MultigridSolver).
+ *
+ * The setup (tiles, local factorizations and coarse system) only depends on the mask, so
+ * an item keeps its solver between blendings. A solver is used by one solve at a time.
+ */
+class DomainDecompositionSolver
+{
+public:
+    DomainDecompositionSolver(const UnknownIndexMap &index_map);
+
+    void setTolerance(float tolerance);
+    void setMaxIterations(int max_iterations);
+    void setCancelFlag(const QAtomicInt *cancel_flag);
+    void setProgressCallback(SolverProgressCallback callback);
+
+    MatrixX3d solve(const MatrixX3d &b);
+    MatrixX3d solveWithGuess(const MatrixX3d &b, const MatrixX3d &x0);
+
+    int tileCount() const;
+    int iterations() const;
+    float error() const;
+    qint64 allocatedBytes() const;
+
+private:
+    // Unknowns [start, start+length) of row y from column x, owned by a tile.
+    // They are contiguous in the local system of the tile too, from local_start.
+    struct Range {
+        int y;
+        int x;
+        int start;
+        int local_start;
+        int length;
+    };
+
+    struct Tile {
+        QRect core;                 // Owned pixels (mask coordinates)
+        QRect extended;             // Core with the overlap, the domain of the local problem
+        int corners[4];             // Coarse nodes (top-left, top-right, bottom-left, bottom-right)
+        QVector<Range> owned;
+        QVector<int> local_rows;    // Row in the local system -> row in the whole system
+        LaplacianFactorizationPtr factorization;
+    };
+
+    void setupTile(Tile &tile);
+    void setupCoarseSystem();
+
+    template <typename Function>
+    void forEachTile(Function function);
+
+    void applyOperator(const Tile &tile, const MatrixX3d &in, MatrixX3d &out) const;
+    Eigen::Matrix<float, 4, 3> restrictToCoarse(const Tile &tile, const MatrixX3d &in) const;
+    void prolongate(const Tile &tile, const MatrixXd &coarse, MatrixX3d &out) const;
+
+    UnknownIndexMap m_index_map;
+
+    QVector<Tile> m_tiles;
+
+    // Galerkin projection of the laplacian on the bilinear coarse functions
+    int m_coarse_size;
+    LaplacianFactorizationPtr m_coarse_factorization;
+
+    float m_tolerance;
+    int m_max_iterations;
+
+    // Checked between the iterations (the solve stops early when it is set)
+    const QAtomicInt *m_cancel_flag;
+
+    // Called with the residual of each iteration
+    SolverProgressCallback m_progress_callback;
+
+    int m_iterations;
+    float m_error;
+
+    // Size of the work buffers (setup and last solve)
+    qint64 m_allocated_bytes;
+    qint64 m_setup_bytes;
+};
+
+// Domain decomposition solver of an item, kept between its blendings
+typedef QSharedPointer<DomainDecompositionSolver> DomainDecompositionSolverPtr;
+
+#endif // DOMAINDECOMPOSITIONSOLVER_H
@@ -0,0 +1,402 @@
+#include "fastpoissonsolver.h"
+
+#include <cmath>
+#include <complex>
+#include <limits>
+#include <vector>
+
+
+#define DENSE_SINE_MAX_SIZE     2048    // px (largest transform done with the dense sine matrices)
+#define GENERIC_RADIX_PENALTY   7       // Cost of the generic FFT butterflies compared to the radix 2-5 ones
+#define DENSE_SINE_COST_RATIO   13      // FFT butterfly operations per multiply-add of the dense product
+
+
+/**
+ * @brief fftTransformCost
+ * @param n
+ * @return
+ *
+ * Estimated cost of a DST-I of size n done with a real FFT of size 2(n+1),
+ * which is a complex FFT of size n+1 (a radix-p stage costs about p operations per value)
+ */
+static double fftTransformCost(int n) {
+    int m = n + 1;
+    double cost = 0.0;
+
+    for (int p = 2 ; p * p <= m ; p++) {
+        while (m % p == 0) {
+            cost += (p <= 5) ? p : GENERIC_RADIX_PENALTY * p;
+            m /= p;
+        }
+    }
+
+    if (m > 1) {
+        cost += (m <= 5) ? m : GENERIC_RADIX_PENALTY * m;
+    }
+
+    return cost * (n + 1);
+}
+
+/**
+ * @brief denseTransformCost
+ * @param n
+ * @return
+ *
+ * Estimated cost of a DST-I of size n done with the dense sine matrices
+ * (n*n/2 multiply-adds thanks to the symmetry of the sine matrix)
+ */
+static double denseTransformCost(int n) {
+    if (n > DENSE_SINE_MAX_SIZE)
+        return std::numeric_limits<double>::infinity();
+
+    return (double) n * n / 2.0 / DENSE_SINE_COST_RATIO;
+}
+
+/**
+ * @brief transformCost
+ * @param n
+ * @return
+ *
+ * Estimated cost of the cheapest DST-I of size n
+ */
+static double transformCost(int n) {
+    return qMin(fftTransformCost(n), denseTransformCost(n));
+}
+
+
+FastPoissonSolver::FastPoissonSolver(const UnknownIndexMap &index_map)
+    : m_laplacian(index_map)
+{
+    m_tolerance = 1e-5;
+    m_max_iterations = 200;
+    m_cancel_flag = nullptr;
+
+    m_iterations = 0;
+    m_error = 0.0;
+    m_allocated_bytes = 0;
+
+    m_rect = ComputationHandler::unknownsBoundingRect(index_map);
+    m_exact = ComputationHandler::isFullRectangle(index_map);
+
+    if (index_map.pixels.isEmpty()) {
+        m_transform_along_x = true;
+        m_transform_size = 0;
+        m_sweep_size = 0;
+        return;
+    }
+
+    // Transform along the axis with the cheapest DSTs (the tridiagonal sweeps are cheap on both axes)
+    const double cost_x = transformCost(m_rect.width()) * m_rect.height();
+    const double cost_y = transformCost(m_rect.height()) * m_rect.width();
+
+    m_transform_along_x = (cost_x <= cost_y);
+    m_transform_size = m_transform_along_x ? m_rect.width() : m_rect.height();
+    m_sweep_size = m_transform_along_x ? m_rect.height() : m_rect.width();
+
+    // Position of each unknown in the rectangle grid (transform axis along the columns)
+    m_grid_offsets.resize(index_map.pixels.size());
+
+    for (int i = 0 ; i < index_map.pixels.size() ; i++) {
+        const int x_rect = index_map.pixels[i].x() - m_rect.left();
+        const int y_rect = index_map.pixels[i].y() - m_rect.top();
+
+        m_grid_offsets[i] = m_transform_along_x ? y_rect * m_transform_size + x_rect : x_rect * m_transform_size + y_rect;
+    }
+
+    // Eigenvalues of the 1D laplacian along the transform axis, plus the diagonal of the sweep axis
+    VectorXd diag(m_transform_size);
+
+    for (int k = 0 ; k < m_transform_size ; k++) {
+        diag(k) = 4.0 - 2.0 * std::cos(M_PI * (k + 1) / (m_transform_size + 1));
+    }
+
+    // Tridiagonal elimination (Thomas algorithm), the same for every right-hand side
+    m_inv_pivots.resize(m_transform_size, m_sweep_size);
+    m_inv_pivots.col(0) = diag.cwiseInverse();
+
+    for (int s = 1 ; s < m_sweep_size ; s++) {
+        m_inv_pivots.col(s) = (diag - m_inv_pivots.col(s-1)).cwiseInverse();
+    }
+
+    // Sizes with large prime factors are faster as a dense product.
+    // Row k of the sine matrix is symmetric (k odd) or antisymmetric (k even) around its
+    // middle, so it is split by frequency parity and applied to the folded columns.
+    if (denseTransformCost(m_transform_size) < fftTransformCost(m_transform_size)) {
+        const int n = m_transform_size;
+
+        m_sine_odd.resize((n + 1) / 2, (n + 1) / 2);
+        m_sine_even.resize(n / 2, n / 2);
+
+        for (int j = 0 ; j < (n + 1) / 2 ; j++) {
+            for (int k = 0 ; k < (n + 1) / 2 ; k++) {
+                m_sine_odd(k,j) = std::sin(M_PI * (double)(2 * k + 1) * (j + 1) / (n + 1));
+            }
+
+            for (int k = 0 ; k < n / 2 && j < n / 2 ; k++) {
+                m_sine_even(k,j) = std::sin(M_PI * (double)(2 * k + 2) * (j + 1) / (n + 1));
+            }
+        }
+    }
+}
+
+bool FastPoissonSolver::isExact() const {
+    return m_exact;
+}
+
+void FastPoissonSolver::setTolerance(float tolerance) {
+    m_tolerance = tolerance;
+}
+
+void FastPoissonSolver::setMaxIterations(int max_iterations) {
+    m_max_iterations = max_iterations;
+}
+
+void FastPoissonSolver::setCancelFlag(const QAtomicInt *cancel_flag) {
+    m_cancel_flag = cancel_flag;
+}
+
+void FastPoissonSolver::setProgressCallback(SolverProgressCallback callback) {
+    m_progress_callback = callback;
+}
+
+int FastPoissonSolver::iterations() const {
+    return m_iterations;
+}
+
+float FastPoissonSolver::error() const {
+    return m_error;
+}
+
+qint64 FastPoissonSolver::allocatedBytes() const {
+    return m_allocated_bytes;
+}
+
+/**
+ * @brief FastPoissonSolver::transformColumns
+ * @param grid
+ * @param fft
+ *
+ * This function applies the (unnormalized) DST-I to each column of the grid.
+ * The DST-I is its own inverse up to a factor 2/(n+1).
+ */
+void FastPoissonSolver::transformColumns(MatrixXd &grid, Eigen::FFT<float> &fft) const {
+    const int n = grid.rows();
+
+    if (m_sine_odd.size() > 0) {
+        const int half = n / 2;
+        const int middle = n % 2;
+
+        // Fold each column around its middle
+        MatrixXd sums(half + middle, grid.cols());
+        sums.topRows(half) = grid.topRows(half) + grid.bottomRows(half).colwise().reverse();
+
+        if (middle)
+            sums.row(half) = grid.row(half);
+
+        const MatrixXd differences = grid.topRows(half) - grid.bottomRows(half).colwise().reverse();
+
+        // Odd frequencies in the even rows, even frequencies in the odd rows
+        typedef Eigen::Map<MatrixXd, 0, Eigen::Stride<Eigen::Dynamic, 2> > InterleavedRows;
+
+        InterleavedRows(grid.data(), half + middle, grid.cols(), Eigen::Stride<Eigen::Dynamic, 2>(n, 2)).noalias() = m_sine_odd * sums;
+        InterleavedRows(grid.data() + 1, half, grid.cols(), Eigen::Stride<Eigen::Dynamic, 2>(n, 2)).noalias() = m_sine_even * differences;
+
+        return;
+    }
+
+    // Odd extension of each column: [0, v, 0, -reverse(v)]
+    std::vector<float> extended(2 * (n + 1), 0.0f);
+    std::vector<std::complex<float> > spectrum;
+
+    for (int s = 0 ; s < grid.cols() ; s++) {
+        float *col = grid.col(s).data();
+
+        for (int j = 0 ; j < n ; j++) {
+            extended[j + 1] = col[j];
+            extended[2 * n + 1 - j] = -col[j];
+        }
+
+        fft.fwd(spectrum, extended);
+
+        // The spectrum of an odd sequence is purely imaginary
+        for (int k = 0 ; k < n ; k++) {
+            col[k] = -0.5f * spectrum[k + 1].imag();
+        }
+    }
+}
+
+/**
+ * @brief FastPoissonSolver::solveRectangleChannel
+ * @param b
+ * @param x
+ * @param channel
+ *
+ * This function solves the Poisson equation on the whole bounding rectangle, for the
+ * right-hand side b extended by zero outside the mask, and restricts the solution to the mask.
+ */
+void FastPoissonSolver::solveRectangleChannel(const MatrixX3d &b, MatrixX3d &x, int channel) const {
+    Eigen::FFT<float> fft;
+    fft.SetFlag(Eigen::FFT<float>::HalfSpectrum);
+
+    MatrixXd grid = MatrixXd::Zero(m_transform_size, m_sweep_size);
+
+    // Scatter the unknowns in the rectangle
+    for (int i = 0 ; i < m_grid_offsets.size() ; i++) {
+        grid.data()[m_grid_offsets[i]] = b(i,channel);
+    }
+
+    // Diagonalize the laplacian along the transform axis
+    transformColumns(grid, fft);
+
+    // Tridiagonal systems along the sweep axis (all the frequencies at once)
+    grid.col(0) = grid.col(0).cwiseProduct(m_inv_pivots.col(0));
+
+    for (int s = 1 ; s < m_sweep_size ; s++) {
+        grid.col(s) = (grid.col(s) + grid.col(s-1)).cwiseProduct(m_inv_pivots.col(s));
+    }
+
+    for (int s = m_sweep_size - 2 ; s >= 0 ; s--) {
+        grid.col(s) += m_inv_pivots.col(s).cwiseProduct(grid.col(s+1));
+    }
+
+    // Back to the pixel domain
+    transformColumns(grid, fft);
+    grid *= 2.0f / (m_transform_size + 1);
+
+    // Gather the unknowns
+    for (int i = 0 ; i < m_grid_offsets.size() ; i++) {
+        x(i,channel) = grid.data()[m_grid_offsets[i]];
+    }
+}
+
+/**
+ * @brief FastPoissonSolver::solveRectangle
+ * @param b
+ * @param x
+ *
+ * This function solves the rectangle problem for the 3 channels in parallel
+ */
+void FastPoissonSolver::solveRectangle(const MatrixX3d &b, MatrixX3d &x) const {
+    x.resize(b.rows(), 3);
+
+    ComputationHandler::parallelFor(3, [&](int channel) {
+        solveRectangleChannel(b, x, channel);
+    });
+}
+
+/**
+ * @brief FastPoissonSolver::solve
+ * @param b
+ * @return
+ *
+ * This function solves A*X = B (one column per color channel), starting from X = 0.
+ */
+MatrixX3d FastPoissonSolver::solve(const MatrixX3d &b) {
+    return solveWithGuess(b, MatrixX3d::Zero(b.rows(), 3));
+}
+
+/**
+ * @brief FastPoissonSolver::solveWithGuess
+ * @param b
+ * @param x0
+ * @return
+ *
+ * This function solves A*X = B (one column per color channel).
+ * Full rectangles are solved directly (the guess is not used), other masks with
+ * a conjugate gradient preconditioned by the rectangle solve, starting from X = x0.
+ */
+MatrixX3d FastPoissonSolver::solveWithGuess(const MatrixX3d &b, const MatrixX3d &x0) {
+    MatrixX3d x, q;
+
+    m_iterations = 0;
+    m_error = 0.0;
+
+    if (b.rows() == 0)
+        return b;
+
+    // Per channel norms of the right-hand side
+    Eigen::Array3d b_norm = b.colwise().norm().cast<double>().transpose();
+
+    for (int c = 0 ; c < 3 ; c++) {
+        if (b_norm(c) == 0.0)
+            b_norm(c) = 1.0;
+    }
+
+    // Setup data, one rectangle grid per channel and the conjugate gradient vectors
+    m_allocated_bytes = m_grid_offsets.size() * (qint64) sizeof(int) + (m_inv_pivots.size() + m_sine_odd.size() + m_sine_even.size()) * (qint64) sizeof(float);
+    m_allocated_bytes += 3 * m_inv_pivots.size() * (qint64) sizeof(float);
+    m_allocated_bytes += (m_exact ? 2 : 5) * b.rows() * 3 * (qint64) sizeof(float);
+
+    // Closed-form solution
+    if (m_exact) {
+        solveRectangle(b, x);
+
+        m_laplacian.apply(x, q);
+
+        m_iterations = 1;
+        m_error = ((b - q).colwise().norm().cast<double>().transpose().array() / b_norm).maxCoeff();
+
+        if (m_progress_callback)
+            m_progress_callback(m_iterations, m_error);
+
+        return x;
+    }
+
+    // Preconditioned conjugate gradient (same per channel scheme as BlockConjugateGradient)
+    x = x0;
+
+    m_laplacian.apply(x, q);
+    MatrixX3d r = b - q;
+    MatrixX3d z;
+    solveRectangle(r, z);
+    MatrixX3d p = z;
+
+    Eigen::Array3d rz = r.cwiseProduct(z).colwise().sum().cast<double>().transpose();
+    Eigen::Array3d r_norm = r.colwise().norm().cast<double>().transpose();
+    Eigen::Array3d alpha, beta;
+
+    m_error = (r_norm / b_norm).maxCoeff();
+
+    if (m_progress_callback)
+        m_progress_callback(m_iterations, m_error);
+
+    while (m_error >= m_tolerance && m_iterations < m_max_iterations) {
+        // The caller does not need the solution anymore
+        if (m_cancel_flag && m_cancel_flag->loadAcquire())
+            break;
+
+        m_laplacian.apply(p, q);
+
+        const Eigen::Array3d pq = p.cwiseProduct(q).colwise().sum().cast<double>().transpose();
+
+        for (int c = 0 ; c < 3 ; c++) {
+            // Converged channels are not updated anymore
+            alpha(c) = (pq(c) > 0.0 && r_norm(c) / b_norm(c) >= m_tolerance) ? rz(c) / pq(c) : 0.0;
+        }
+
+        const Eigen::RowVector3f alpha_f = alpha.cast<float>().matrix().transpose();
+        x += p * alpha_f.asDiagonal();
+        r -= q * alpha_f.asDiagonal();
+
+        solveRectangle(r, z);
+
+        const Eigen::Array3d rz_new = r.cwiseProduct(z).colwise().sum().cast<double>().transpose();
+
+        for (int c = 0 ; c < 3 ; c++) {
+            beta(c) = (rz(c) != 0.0) ? rz_new(c) / rz(c) : 0.0;
+        }
+
+        rz = rz_new;
+        p = z + p * beta.cast<float>().matrix().asDiagonal();
+
+        r_norm = r.colwise().norm().cast<double>().transpose();
+
+        m_iterations++;
+        m_error = (r_norm / b_norm).maxCoeff();
+
+        if (m_progress_callback)
+            m_progress_callback(m_iterations, m_error);
+    }
+
+    return x;
+}
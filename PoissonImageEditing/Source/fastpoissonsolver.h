@@ -0,0 +1,87 @@
+#ifndef FASTPOISSONSOLVER_H
+#define FASTPOISSONSOLVER_H
+
+#include <QRect>
+#include <QAtomicInt>
+#include <QVector>
+
+#include <unsupported/Eigen/FFT>
+
+#include "computationhandler.h"
+#include "laplacianoperator.h"
+
+/*
+ * Fast Poisson solver on the bounding rectangle of the unknowns.
+ *
+ * On a full rectangle, the discrete sine transform (DST-I) diagonalizes the laplacian
+ * along one axis, which leaves one tridiagonal system per frequency along the other
+ * axis. The solution is then exact in O(N log N), without any iteration.
+ *
+ * When the mask does not fill its bounding rectangle, the rectangle solve is used as
+ * the preconditioner of a conjugate gradient on the masked laplacian (a few iterations
+ * for near-rectangular masks).
+ */
+class FastPoissonSolver
+{
+public:
+    FastPoissonSolver(const UnknownIndexMap &index_map);
+
+    bool isExact() const;
+
+    void setTolerance(float tolerance);
+    void setMaxIterations(int max_iterations);
+    void setCancelFlag(const QAtomicInt *cancel_flag);
+    void setProgressCallback(SolverProgressCallback callback);
+
+    MatrixX3d solve(const MatrixX3d &b);
+    MatrixX3d solveWithGuess(const MatrixX3d &b, const MatrixX3d &x0);
+
+    int iterations() const;
+    float error() const;
+    qint64 allocatedBytes() const;
+
+private:
+    void solveRectangle(const MatrixX3d &b, MatrixX3d &x) const;
+    void solveRectangleChannel(const MatrixX3d &b, MatrixX3d &x, int channel) const;
+    void transformColumns(MatrixXd &grid, Eigen::FFT<float> &fft) const;
+
+    LaplacianOperator m_laplacian;
+
+    // Bounding rectangle of the unknowns (in mask coordinates)
+    QRect m_rect;
+    bool m_exact;
+
+    // The DST is done along the rows of the grids (transform axis), the
+    // tridiagonal systems along the columns (sweep axis)
+    bool m_transform_along_x;
+    int m_transform_size;
+    int m_sweep_size;
+
+    // Unknown -> offset in the (column-major) rectangle grid
+    QVector<int> m_grid_offsets;
+
+    // Inverse pivots of the tridiagonal eliminations (one per frequency and sweep position)
+    MatrixXd m_inv_pivots;
+
+    // Dense sine matrices (odd and even frequencies), used instead of the FFT
+    // for sizes with large prime factors
+    MatrixXd m_sine_odd;
+    MatrixXd m_sine_even;
+
+    float m_tolerance;
+    int m_max_iterations;
+
+    // Checked between the iterations (the solve stops early when it is set)
+    const QAtomicInt *m_cancel_flag;
+
+    // Called with the residual of each iteration
+    SolverProgressCallback m_progress_callback;
+
+    int m_iterations;
+    float m_error;
+
+    // Size of the work buffers (setup and last solve)
+    qint64 m_allocated_bytes;
+};
+
+#endif // FASTPOISSONSOLVER_H
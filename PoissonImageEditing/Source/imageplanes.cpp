@@ -0,0 +1,166 @@
+#include "imageplanes.h"
+#include "computationhandler.h"
+
+#include <cstdint>
+#include <cstring>
+
+
+#define PLANE_ALIGNMENT     16      // Floats (64 bytes)
+#define PLANE_LEFT_PADDING  16      // Floats before x = 0 (holds the left halo, keeps x = 0 aligned)
+
+
+ImagePlanes::Data::Data(int width, int height)
+{
+    this->width = width;
+    this->height = height;
+
+    // Right halo included, rounded to whole aligned blocks
+    stride = PLANE_LEFT_PADDING + ((width + 1 + PLANE_ALIGNMENT - 1) / PLANE_ALIGNMENT) * PLANE_ALIGNMENT;
+
+    // Top and bottom halo rows
+    plane_size = stride * (height + 2);
+
+    buffer.assign(3 * plane_size + PLANE_ALIGNMENT, 0.0f);
+    offset = (PLANE_ALIGNMENT - (reinterpret_cast<std::uintptr_t>(buffer.data()) / sizeof(float)) % PLANE_ALIGNMENT) % PLANE_ALIGNMENT;
+}
+
+ImagePlanes::Data::Data(const Data &other)
+    : QSharedData(other)
+{
+    width = other.width;
+    height = other.height;
+    stride = other.stride;
+    plane_size = other.plane_size;
+
+    // The copy has its own alignment offset
+    buffer.resize(other.buffer.size());
+    offset = (PLANE_ALIGNMENT - (reinterpret_cast<std::uintptr_t>(buffer.data()) / sizeof(float)) % PLANE_ALIGNMENT) % PLANE_ALIGNMENT;
+
+    std::memcpy(buffer.data() + offset, other.buffer.data() + other.offset, 3 * plane_size * sizeof(float));
+}
+
+float *ImagePlanes::Data::plane(int channel) {
+    return buffer.data() + offset + channel * plane_size;
+}
+
+const float *ImagePlanes::Data::plane(int channel) const {
+    return buffer.data() + offset + channel * plane_size;
+}
+
+
+ImagePlanes::ImagePlanes()
+{
+    m_x_offset = 0;
+    m_y_offset = 0;
+    m_width = 0;
+    m_height = 0;
+}
+
+ImagePlanes::ImagePlanes(int width, int height)
+    : d(new Data(width, height))
+{
+    m_x_offset = 0;
+    m_y_offset = 0;
+    m_width = width;
+    m_height = height;
+}
+
+bool ImagePlanes::isNull() const {
+    return !d;
+}
+
+int ImagePlanes::width() const {
+    return m_width;
+}
+
+int ImagePlanes::height() const {
+    return m_height;
+}
+
+int ImagePlanes::stride() const {
+    return d ? d->stride : 0;
+}
+
+/**
+ * @brief ImagePlanes::row
+ * @param channel
+ * @param y
+ * @return
+ *
+ * This function returns the pixel x = 0 of the row y (y = -1 and y = height are the halo rows).
+ * The planes are detached if they are shared.
+ */
+float *ImagePlanes::row(int channel, int y) {
+    return d->plane(channel) + (m_y_offset + y + 1) * d->stride + PLANE_LEFT_PADDING + m_x_offset;
+}
+
+const float *ImagePlanes::constRow(int channel, int y) const {
+    return d.constData()->plane(channel) + (m_y_offset + y + 1) * d->stride + PLANE_LEFT_PADDING + m_x_offset;
+}
+
+float ImagePlanes::at(int channel, int y, int x) const {
+    return constRow(channel, y)[x];
+}
+
+/**
+ * @brief ImagePlanes::plane
+ * @param channel
+ * @return
+ *
+ * This function returns an Eigen view of a plane (height x width, without the halo).
+ */
+ImagePlanes::PlaneMap ImagePlanes::plane(int channel) {
+    return PlaneMap(row(channel, 0), height(), width(), Eigen::OuterStride<>(stride()));
+}
+
+ImagePlanes::ConstPlaneMap ImagePlanes::constPlane(int channel) const {
+    return ConstPlaneMap(constRow(channel, 0), height(), width(), Eigen::OuterStride<>(stride()));
+}
+
+/**
+ * @brief ImagePlanes::window
+ * @param rect
+ * @return
+ *
+ * This function returns the pixels of rect (inside the planes) without copying them.
+ * The pixel (0,0) of the window is the pixel rect.topLeft() of the planes.
+ */
+ImagePlanes ImagePlanes::window(QRect rect) const {
+    ImagePlanes w = *this;
+
+    w.m_x_offset += rect.x();
+    w.m_y_offset += rect.y();
+    w.m_width = rect.width();
+    w.m_height = rect.height();
+
+    return w;
+}
+
+
+/*
+ * Serialization: each plane is written as a column-major MatrixXd, like the former ImageMatricesRGB
+ */
+
+QDataStream &operator>>(QDataStream &in, ImagePlanes &p) {
+    for (int ch = 0 ; ch < 3 ; ch++) {
+        MatrixXd mat;
+        in >> mat;
+
+        if (ch == 0) {
+            p = ImagePlanes(mat.cols(), mat.rows());
+        }
+
+        p.plane(ch) = mat;
+    }
+
+    return in;
+}
+
+QDataStream &operator<<(QDataStream &out, const ImagePlanes &p) {
+    for (int ch = 0 ; ch < 3 ; ch++) {
+        MatrixXd mat = p.constPlane(ch);
+        out << mat;
+    }
+
+    return out;
+}
@@ -0,0 +1,82 @@
+#ifndef IMAGEPLANES_H
+#define IMAGEPLANES_H
+
+#include <QDataStream>
+#include <QRect>
+#include <QSharedData>
+#include <QSharedDataPointer>
+
+#include <Eigen/Core>
+
+#include <vector>
+
+/*
+ * Planar float image (red, green and blue planes) for the computation core.
+ *
+ * The planes are stored row-major, like the unknowns of the linear system, so the
+ * stencils walk the memory contiguously along x. Each row starts on a 64-byte boundary,
+ * and a zero halo surrounds every plane (the pixels at x = -1 / width and y = -1 / height
+ * are readable).
+ *
+ * The data is implicitly shared (copy-on-write), like QImage: copying the planes of an
+ * item into a computation job is cheap. A window of the planes (see window()) shares the
+ * data too: its rows are the ones of the whole planes, offset to the window (they are
+ * not aligned anymore, and the halo of a window is made of the neighbor pixels).
+ */
+class ImagePlanes
+{
+public:
+    typedef Eigen::Matrix<float, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor> PlaneMatrix;
+    typedef Eigen::Map<PlaneMatrix, Eigen::Unaligned, Eigen::OuterStride<>> PlaneMap;
+    typedef Eigen::Map<const PlaneMatrix, Eigen::Unaligned, Eigen::OuterStride<>> ConstPlaneMap;
+
+    ImagePlanes();
+    ImagePlanes(int width, int height);
+
+    bool isNull() const;
+
+    int width() const;
+    int height() const;
+    int stride() const;
+
+    float *row(int channel, int y);
+    const float *constRow(int channel, int y) const;
+
+    float at(int channel, int y, int x) const;
+
+    PlaneMap plane(int channel);
+    ConstPlaneMap constPlane(int channel) const;
+
+    ImagePlanes window(QRect rect) const;
+
+private:
+    struct Data : public QSharedData {
+        Data(int width, int height);
+        Data(const Data &other);
+
+        float *plane(int channel);
+        const float *plane(int channel) const;
+
+        int width;
+        int height;
+        int stride;         // Floats between two rows
+        int plane_size;     // Floats between two planes
+
+        std::vector<float> buffer;
+        int offset;         // First aligned float of the buffer
+    };
+
+    QSharedDataPointer<Data> d;
+
+    // Window of the data (the whole planes by default)
+    int m_x_offset;
+    int m_y_offset;
+    int m_width;
+    int m_height;
+};
+
+// Same format as 3 column-major MatrixXd (project file compatibility)
+QDataStream &operator>>(QDataStream &in, ImagePlanes &p);
+QDataStream &operator<<(QDataStream &out, const ImagePlanes &p);
+
+#endif // IMAGEPLANES_H
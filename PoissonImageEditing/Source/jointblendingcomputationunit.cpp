@@ -0,0 +1,280 @@
+#include "jointblendingcomputationunit.h"
+#include "fastpoissonsolver.h"
+#include "multigridsolver.h"
+
+#include <QElapsedTimer>
+
+JointBlendingComputationUnit::JointBlendingComputationUnit(
+        QImage target_img,
+        QVector<Layer> layers,
+        float solver_tolerance)
+    : QObject(), QRunnable()
+{
+    m_target_img = target_img;
+    m_layers = layers;
+    m_solver_tolerance = solver_tolerance;
+
+    // The layer rectangles include the 1px margin around the masks, so the union
+    // of the masks is inside their union
+    for (int i = 0 ; i < m_layers.size() ; i++) {
+        const QRect layer_rect(m_layers[i].position, QSize(m_layers[i].index_map.index.cols(), m_layers[i].index_map.index.rows()));
+        m_rect = m_rect.united(layer_rect);
+    }
+
+    m_stats = SolveStats();
+
+    setAutoDelete(false);
+}
+
+void JointBlendingComputationUnit::run() {
+    // Emit started signal
+    emit computationStarted();
+
+    // Compute...
+    computeBlendingData();
+
+    // Emit finished signal
+    emit computationFinished();
+}
+
+/**
+ * @brief JointBlendingComputationUnit::cancel
+ *
+ * This function asks the job to stop as soon as possible (thread-safe).
+ * No image is produced, but computationFinished() is still emitted.
+ */
+void JointBlendingComputationUnit::cancel() {
+    m_cancelled.storeRelease(1);
+}
+
+bool JointBlendingComputationUnit::isCancelled() const {
+    return m_cancelled.loadAcquire() != 0;
+}
+
+void JointBlendingComputationUnit::computeBlendingData() {
+    if (m_layers.isEmpty() || m_rect.isEmpty())
+        return;
+
+    // Setup, then solve time
+    QElapsedTimer timer;
+    timer.start();
+
+    // Layer of each pixel of the union (the topmost one, -1 out of the union)
+    IndexMatrix owners = IndexMatrix::Constant(m_rect.height(), m_rect.width(), -1);
+    QVector<QVector<SelectionMask::Span>> row_spans(m_rect.height());
+
+    for (int i = 0 ; i < m_layers.size() ; i++) {
+        const SelectionMask &unknowns = m_layers[i].index_map.unknowns;
+        const QPoint offset = m_layers[i].position - m_rect.topLeft();
+
+        for (int y = 0 ; y < unknowns.height() ; y++) {
+            const SelectionMask::Span *spans = unknowns.rowSpans(y);
+
+            for (int s = 0 ; s < unknowns.spanCount(y) ; s++) {
+                owners.row(y + offset.y()).segment(spans[s].x_begin + offset.x(), spans[s].x_end - spans[s].x_begin).setConstant(i);
+
+                row_spans[y + offset.y()].append({spans[s].x_begin + offset.x(), spans[s].x_end + offset.x()});
+            }
+        }
+    }
+
+    // Unknowns of the joint system (the overlapping spans are merged)
+    const UnknownIndexMap index_map = ComputationHandler::maskToIndexMap(SelectionMask(m_rect.width(), m_rect.height(), row_spans));
+
+    // Target part under the layers (a window of the cached planes of the whole target)
+    const ImagePlanes tgt_planes = ComputationHandler::targetWindowPlanes(m_target_img, m_rect);
+
+    const MatrixX3d b = computeIndependentTerms(tgt_planes, owners, index_map);
+
+    m_stats.setup_time = timer.restart();
+
+    if (isCancelled())
+        return;
+
+    // Matrix-free solvers only: the system is built once, a factorization would not be reused.
+    // The union of many layers is rarely a full rectangle and has holes, which the fast Poisson
+    // preconditioner handles badly: the multigrid solver is used then, one channel per thread.
+    MatrixX3d x;
+
+    m_stats.bytes_allocated = (3 * b.size() + owners.size()) * (qint64) sizeof(float);
+
+    if (ComputationHandler::isFullRectangle(index_map)) {
+        FastPoissonSolver solver(index_map);
+
+        m_stats.solver = SolverFastPoisson;
+
+        x = solver.solve(b);
+
+        m_stats.converged = true;
+        m_stats.bytes_allocated += solver.allocatedBytes();
+    }
+    else {
+        const MatrixX3d x0 = computeInitialGuess(owners, index_map);
+
+        QVector<SolveStats> channel_stats(3);
+
+        m_stats.solver = SolverMultigrid;
+
+        x.resize(b.rows(), 3);
+
+        ComputationHandler::parallelFor(3, [&](int channel) {
+            MultigridSolver solver(index_map);
+            solver.setTolerance(m_solver_tolerance);
+            solver.setCancelFlag(&m_cancelled);
+
+            const VectorXd x_channel = solver.solveWithGuess(b.col(channel), x0.col(channel));
+            x.col(channel) = x_channel;
+
+            channel_stats[channel].iterations = solver.iterations();
+            channel_stats[channel].error = solver.error();
+            channel_stats[channel].bytes_allocated = solver.allocatedBytes();
+        });
+
+        for (int ch = 0 ; ch < 3 ; ch++) {
+            m_stats.iterations = qMax(m_stats.iterations, channel_stats[ch].iterations);
+            m_stats.error = qMax(m_stats.error, channel_stats[ch].error);
+            m_stats.bytes_allocated += channel_stats[ch].bytes_allocated;
+        }
+
+        m_stats.converged = m_stats.error < m_solver_tolerance;
+    }
+
+    // An interrupted solve is not a solution
+    if (isCancelled())
+        return;
+
+    // Split the solution between the layers (each one gets all its mask, even under the layers above)
+    m_blended_images.resize(m_layers.size());
+
+    for (int i = 0 ; i < m_layers.size() ; i++) {
+        const UnknownIndexMap &layer_map = m_layers[i].index_map;
+        const QPoint offset = m_layers[i].position - m_rect.topLeft();
+
+        MatrixX3d layer_solution(layer_map.pixels.size(), 3);
+
+        for (int k = 0 ; k < layer_map.pixels.size() ; k++) {
+            const QPoint p = layer_map.pixels[k] + offset;
+            layer_solution.row(k) = x.row(index_map.index(p.y(), p.x()));
+        }
+
+        m_blended_images[i] = ComputationHandler::solutionToImage(layer_solution, layer_map);
+    }
+
+    m_stats.solve_time = timer.elapsed();
+}
+
+/**
+ * @brief JointBlendingComputationUnit::computeIndependentTerms
+ * @param tgt_img
+ * @param owners
+ * @param index_map
+ * @return
+ *
+ * This function assembles the independent terms of the joint system (3 channels interleaved).
+ * The guidance of a pixel comes from the source of its layer, except towards a pixel of another
+ * layer: the gradients of both sources are averaged (plain) or the largest one is kept (mixed),
+ * which keeps the guidance field antisymmetric along the seams.
+ */
+MatrixX3d JointBlendingComputationUnit::computeIndependentTerms(const ImagePlanes &tgt_img, const IndexMatrix &owners, const UnknownIndexMap &index_map) {
+    MatrixX3d b(index_map.pixels.size(), 3);
+
+    const SelectionMask &unknowns = index_map.unknowns;
+
+    // Offsets of the 4 neighbors (right, left, bottom, top)
+    const int dx[4] = {1, -1, 0, 0};
+    const int dy[4] = {0, 0, 1, -1};
+
+    float *out = b.data();
+
+    for (int y = 0 ; y < unknowns.height() ; y++) {
+        const SelectionMask::Span *spans = unknowns.rowSpans(y);
+
+        for (int s = 0 ; s < unknowns.spanCount(y) ; s++) {
+            for (int x = spans[s].x_begin ; x < spans[s].x_end ; x++, out += 3) {
+                const Layer &layer = m_layers[owners(y, x)];
+                const QPoint p = QPoint(x, y) + m_rect.topLeft() - layer.position;
+
+                for (int ch = 0 ; ch < 3 ; ch++) {
+                    const float src_p = layer.source.at(ch, p.y(), p.x());
+                    const float tgt_p = tgt_img.at(ch, y, x);
+
+                    float sum = 0.0f;
+
+                    for (int n = 0 ; n < 4 ; n++) {
+                        const int neighbor = owners(y + dy[n], x + dx[n]);
+                        const float tgt_q = tgt_img.at(ch, y + dy[n], x + dx[n]);
+
+                        float guidance = src_p - layer.source.at(ch, p.y() + dy[n], p.x() + dx[n]);
+                        bool mixed = layer.mixed_blending;
+
+                        // Seam between two layers (both sources cover the two pixels, thanks to the mask margins)
+                        if (neighbor >= 0 && &m_layers[neighbor] != &layer) {
+                            const Layer &other = m_layers[neighbor];
+                            const QPoint q = QPoint(x, y) + m_rect.topLeft() - other.position;
+                            const float other_guidance = other.source.at(ch, q.y(), q.x()) - other.source.at(ch, q.y() + dy[n], q.x() + dx[n]);
+
+                            mixed = mixed || other.mixed_blending;
+                            guidance = mixed ? (qAbs(other_guidance) > qAbs(guidance) ? other_guidance : guidance)
+                                             : 0.5f * (guidance + other_guidance);
+                        }
+
+                        // Keep the most important difference in absolute value
+                        if (mixed) {
+                            const float tgt_diff = tgt_p - tgt_q;
+                            guidance = (qAbs(tgt_diff) > qAbs(guidance)) ? tgt_diff : guidance;
+                        }
+
+                        // Target values of the neighbors out of the union (∂Ω)
+                        sum += guidance + (neighbor < 0 ? tgt_q : 0.0f);
+                    }
+
+                    out[ch] = sum;
+                }
+            }
+        }
+    }
+
+    return b;
+}
+
+/**
+ * @brief JointBlendingComputationUnit::computeInitialGuess
+ * @param owners
+ * @param index_map
+ * @return
+ *
+ * This function returns the starting point of the solver: the current blending of each
+ * layer, or its source if it has never been blended.
+ */
+MatrixX3d JointBlendingComputationUnit::computeInitialGuess(const IndexMatrix &owners, const UnknownIndexMap &index_map) {
+    MatrixX3d x0(index_map.pixels.size(), 3);
+
+    for (int i = 0 ; i < index_map.pixels.size() ; i++) {
+        const QPoint &pixel = index_map.pixels[i];
+        const Layer &layer = m_layers[owners(pixel.y(), pixel.x())];
+        const QPoint p = pixel + m_rect.topLeft() - layer.position;
+
+        if (!layer.blended_image.isNull()) {
+            const QRgb color = layer.blended_image.pixel(p);
+
+            x0(i,0) = qRed(color) / 255.0f;
+            x0(i,1) = qGreen(color) / 255.0f;
+            x0(i,2) = qBlue(color) / 255.0f;
+        }
+        else {
+            x0(i,0) = layer.source.at(0, p.y(), p.x());
+            x0(i,1) = layer.source.at(1, p.y(), p.x());
+            x0(i,2) = layer.source.at(2, p.y(), p.x());
+        }
+    }
+
+    return x0;
+}
+
+QVector<QImage> JointBlendingComputationUnit::getBlendedImages() {
+    return m_blended_images;
+}
+
+SolveStats JointBlendingComputationUnit::getSolveStats() {
+    return m_stats;
+}
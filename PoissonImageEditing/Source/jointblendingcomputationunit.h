@@ -0,0 +1,72 @@
+#ifndef JOINTBLENDINGCOMPUTATIONUNIT_H
+#define JOINTBLENDINGCOMPUTATIONUNIT_H
+
+#include <QAtomicInt>
+#include <QObject>
+#include <QRunnable>
+
+#include "computationhandler.h"
+
+/*
+ * Blending of all the pasted layers in a single masked Poisson system.
+ *
+ * The unknowns are the union of the layer masks over the target. Each pixel belongs to
+ * the topmost layer covering it, whose source gives the guidance field. Between two
+ * pixels of different layers (seam), the guidance is the mean of the gradients of both
+ * sources (or the largest one for the mixed blending), so the layers are blended with
+ * each other instead of against a fixed composite. The pixels out of the union are the
+ * Dirichlet boundary (base target).
+ */
+class JointBlendingComputationUnit : public QObject, public QRunnable
+{
+    Q_OBJECT
+
+public:
+    // One pasted layer, in stacking order (bottom first)
+    struct Layer {
+        ImagePlanes source;
+        UnknownIndexMap index_map;
+        QPoint position;            // Top-left corner of the layer in the target
+        bool mixed_blending;
+        QImage blended_image;       // Current blending (initial guess), null if none
+    };
+
+    JointBlendingComputationUnit(
+            QImage target_img,
+            QVector<Layer> layers,
+            float solver_tolerance
+        );
+
+    void run() override;
+
+    void cancel();
+    bool isCancelled() const;
+
+    QVector<QImage> getBlendedImages();
+    SolveStats getSolveStats();
+
+signals:
+    void computationStarted();
+    void computationFinished();
+
+private:
+    void computeBlendingData();
+    MatrixX3d computeIndependentTerms(const ImagePlanes &tgt_img, const IndexMatrix &owners, const UnknownIndexMap &index_map);
+    MatrixX3d computeInitialGuess(const IndexMatrix &owners, const UnknownIndexMap &index_map);
+
+    // Input attributes
+    QImage m_target_img;
+    QVector<Layer> m_layers;
+    float m_solver_tolerance;
+
+    // Union of the layer rectangles in the target (coordinates of the system)
+    QRect m_rect;
+
+    // Output attributes
+    QVector<QImage> m_blended_images;
+    SolveStats m_stats;
+
+    QAtomicInt m_cancelled;
+};
+
+#endif // JOINTBLENDINGCOMPUTATIONUNIT_H
@@ -0,0 +1,135 @@
+#include "laplacianoperator.h"
+
+
+typedef Eigen::Map<Eigen::ArrayXf> ArrayMap;
+typedef Eigen::Map<const Eigen::ArrayXf> ConstArrayMap;
+
+
+LaplacianOperator::LaplacianOperator(const UnknownIndexMap &index_map)
+{
+    m_size = index_map.pixels.size();
+
+    // First pixel (x) and row (y) of each run
+    QVector<QPoint> run_origins;
+
+    // Split the unknowns into horizontal runs
+    for (int i = 0 ; i < m_size ; i++) {
+        const QPoint &p = index_map.pixels[i];
+
+        // Continue the current run if this pixel is the right neighbor of the previous one
+        if (i > 0 && p.y() == index_map.pixels[i-1].y() && p.x() == index_map.pixels[i-1].x() + 1) {
+            m_runs.last().length++;
+            continue;
+        }
+
+        Run run;
+        run.start = i;
+        run.length = 1;
+
+        m_runs.append(run);
+        run_origins.append(p);
+    }
+
+    // Find the overlaps between the runs of consecutive rows
+    int row_start = 0;      // First run of the current row
+    int prev_start = 0;     // First run of the previous row
+    int prev_end = 0;       // End of the runs of the previous row
+
+    for (int r = 0 ; r < m_runs.size() ; r++) {
+        // New row
+        if (r == 0 || run_origins[r].y() != run_origins[r-1].y()) {
+            const bool consecutive = (r > 0 && run_origins[r].y() == run_origins[r-1].y() + 1);
+
+            // The previous row has no run if it is not just above
+            prev_start = consecutive ? row_start : r;
+            prev_end = r;
+            row_start = r;
+        }
+
+        const int x0 = run_origins[r].x();
+        const int x1 = x0 + m_runs[r].length;
+
+        // Runs of the previous row that overlap [x0, x1)
+        for (int q = prev_start ; q < prev_end ; q++) {
+            const int qx0 = run_origins[q].x();
+            const int qx1 = qx0 + m_runs[q].length;
+
+            const int ox0 = qMax(x0, qx0);
+            const int ox1 = qMin(x1, qx1);
+
+            if (ox0 >= ox1)
+                continue;
+
+            VerticalPair pair;
+            pair.top = m_runs[q].start + (ox0 - qx0);
+            pair.bottom = m_runs[r].start + (ox0 - x0);
+            pair.length = ox1 - ox0;
+
+            m_vertical_pairs.append(pair);
+        }
+    }
+}
+
+int LaplacianOperator::size() const {
+    return m_size;
+}
+
+/**
+ * @brief LaplacianOperator::apply
+ * @param in
+ * @param out
+ *
+ * out = A*in for the 3 color channels (row-major N×3 matrices)
+ */
+void LaplacianOperator::apply(const MatrixX3d &in, MatrixX3d &out) const {
+    out.resize(m_size, 3);
+    apply(in.data(), out.data(), 3);
+}
+
+/**
+ * @brief LaplacianOperator::apply
+ * @param in
+ * @param out
+ *
+ * out = A*in for a single channel
+ */
+void LaplacianOperator::apply(const VectorXd &in, VectorXd &out) const {
+    out.resize(m_size);
+    apply(in.data(), out.data(), 1);
+}
+
+/**
+ * @brief LaplacianOperator::apply
+ * @param in
+ * @param out
+ * @param stride
+ *
+ * Stencil kernel on interleaved data ('stride' values per unknown).
+ * 'in' and 'out' must not overlap.
+ */
+void LaplacianOperator::apply(const float *in, float *out, int stride) const {
+    // Diagonal
+    ArrayMap(out, m_size * stride) = 4.0f * ConstArrayMap(in, m_size * stride);
+
+    // Left and right neighbors, inside each run
+    for (int r = 0 ; r < m_runs.size() ; r++) {
+        const int start = m_runs[r].start * stride;
+        const int length = (m_runs[r].length - 1) * stride;
+
+        if (length == 0)
+            continue;
+
+        ArrayMap(out + start + stride, length) -= ConstArrayMap(in + start, length);
+        ArrayMap(out + start, length) -= ConstArrayMap(in + start + stride, length);
+    }
+
+    // Top and bottom neighbors
+    for (int v = 0 ; v < m_vertical_pairs.size() ; v++) {
+        const int top = m_vertical_pairs[v].top * stride;
+        const int bottom = m_vertical_pairs[v].bottom * stride;
+        const int length = m_vertical_pairs[v].length * stride;
+
+        ArrayMap(out + bottom, length) -= ConstArrayMap(in + top, length);
+        ArrayMap(out + top, length) -= ConstArrayMap(in + bottom, length);
+    }
+}
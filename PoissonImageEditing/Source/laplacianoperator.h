@@ -0,0 +1,48 @@
+#ifndef LAPLACIANOPERATOR_H
+#define LAPLACIANOPERATOR_H
+
+#include <QVector>
+
+#include "computationhandler.h"
+
+/*
+ * Matrix-free masked laplacian (5-point stencil) on the compact unknowns.
+ *
+ * The unknowns are numbered in row-major order, so a horizontal run of pixels
+ * inside the mask is a contiguous range of unknowns, and the overlap of two runs
+ * on consecutive rows is also a pair of contiguous ranges. The product is then
+ * only made of contiguous vector operations (vectorized by Eigen), without any
+ * indirect indexing.
+ */
+class LaplacianOperator
+{
+public:
+    LaplacianOperator(const UnknownIndexMap &index_map);
+
+    int size() const;
+
+    void apply(const MatrixX3d &in, MatrixX3d &out) const;
+    void apply(const VectorXd &in, VectorXd &out) const;
+
+private:
+    // Contiguous ranges of unknowns
+    struct Run {
+        int start;
+        int length;
+    };
+
+    // Vertical neighbors: unknowns [top, top+length) are above [bottom, bottom+length)
+    struct VerticalPair {
+        int top;
+        int bottom;
+        int length;
+    };
+
+    void apply(const float *in, float *out, int stride) const;
+
+    int m_size;
+    QVector<Run> m_runs;
+    QVector<VerticalPair> m_vertical_pairs;
+};
+
+#endif // LAPLACIANOPERATOR_H
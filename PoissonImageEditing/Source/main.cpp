@@ -1,10 +1,24 @@
 #include "mainwindow.h"
+#include "computationhandler.h"
 
 #include <QApplication>
+#include <QCommandLineParser>
 
 int main(int argc, char *argv[])
 {
     QApplication a(argc, argv);
+
+    // Command line options
+    QCommandLineParser parser;
+    parser.addHelpOption();
+
+    QCommandLineOption threads_option("threads", "Number of threads of the background computations (default: one per core).", "count", "0");
+    parser.addOption(threads_option);
+    parser.process(a);
+
+    // Size of the computation thread pool (applied when the main window initializes it)
+    ComputationHandler::setThreadCount(parser.value(threads_option).toInt());
+
     MainWindow w;
     w.show();
     return a.exec();
@@ -5,21 +5,28 @@
 #include "targetgraphicsscene.h"
 #include "computationhandler.h"
 #include "pastedsourceitem.h"
+#include "tiledblendingcomputationunit.h"
 
 #include <QGraphicsPixmapItem>
+#include <QActionGroup>
 #include <QGraphicsScene>
 #include <QElapsedTimer>
 #include <QImageReader>
 #include <QImageWriter>
+#include <QInputDialog>
 #include <QFileDialog>
 #include <QMessageBox>
 #include <QKeyEvent>
+#include <QTimer>
 
 #define PROGRAM_SIGNATURE   "PIB-ELECY412"
 #define PROJECT_FILE_EXT    "Poisson Image Blending Project (*.pibproj)"
 #define IMAGE_EXTENSIONS    "All Images (*.png *.jpg *.jpeg *.bmp *.tif *.tiff *.gif);;" \
                             "PNG (*.png);;JPG (*.jpg *.jpeg);;BMP (*.bmp);;TIFF (*.tif *.tiff);;GIF (*.gif)"
 #define IMAGE_WRITE_EXT     "PNG (*.png);;JPG (*.jpg);;BMP (*.bmp);;TIFF (*.tif);;GIF (*.gif)"
+#define TILED_WRITE_EXT     "PPM (*.ppm);;" IMAGE_WRITE_EXT
+#define JOB_STATS_INTERVAL  500     // ms
+#define SOLVE_REPORT_TIME   5000    // ms
 
 
 MainWindow::MainWindow(QWidget *parent)
@@ -36,9 +43,34 @@ MainWindow::MainWindow(QWidget *parent)
     m_label_size = new QLabel();
     m_status_bar->addPermanentWidget(m_label_size);
 
+    // Create a label to display the computation queues
+    m_label_jobs = new QLabel();
+    m_status_bar->addPermanentWidget(m_label_jobs);
+
+    // Refresh the queue statistics periodically
+    m_job_stats_timer = new QTimer(this);
+    m_job_stats_timer->setInterval(JOB_STATS_INTERVAL);
+    connect(m_job_stats_timer, SIGNAL(timeout()), this, SLOT(updateJobStatistics()));
+    m_job_stats_timer->start();
+
     // Initialize the computation handler
     ComputationHandler::initializeComputationHandler(this);
 
+    // Only one solver can be checked at once
+    m_solver_action_group = new QActionGroup(this);
+    m_solver_action_group->addAction(ui->actionSolver_cholesky);
+    m_solver_action_group->addAction(ui->actionSolver_conjugate_gradient);
+    m_solver_action_group->addAction(ui->actionSolver_multigrid);
+    m_solver_action_group->addAction(ui->actionSolver_fast_poisson);
+    m_solver_action_group->addAction(ui->actionSolver_domain_decomposition);
+
+    // Relative residual tolerance of the iterative solvers
+    m_solver_tolerance = DEFAULT_SOLVER_TOLERANCE;
+
+    // No out-of-core export running
+    m_tiled_job = nullptr;
+    m_memory_budget = DEFAULT_MEMORY_BUDGET_MB;
+
     // Create graphics scenes
     m_scene_source = new SourceGraphicsScene(this);
     m_scene_target = new TargetGraphicsScene(this);
@@ -73,6 +105,8 @@ MainWindow::MainWindow(QWidget *parent)
 
     connect(ui->actionExport,       SIGNAL(triggered(bool)), this, SLOT(exportResultDirect()));
     connect(ui->actionExport_as,    SIGNAL(triggered(bool)), this, SLOT(exportResultAs()));
+    connect(ui->actionExport_tiled, SIGNAL(triggered(bool)), this, SLOT(exportResultTiled()));
+    connect(ui->actionMemory_budget, SIGNAL(triggered(bool)), this, SLOT(askMemoryBudget()));
 
     connect(ui->actionClear_selection,    SIGNAL(triggered(bool)), this, SLOT(clearLassoSelection()));
     connect(ui->actionTransfer_selection, SIGNAL(triggered(bool)), this, SLOT(transferLassoSelection()));
@@ -82,10 +116,15 @@ MainWindow::MainWindow(QWidget *parent)
     connect(ui->actionDelete_all_layers,     SIGNAL(triggered(bool)), this,           SLOT(askRemoveAllLayers()));
 
     connect(ui->actionReal_time_blending, SIGNAL(toggled(bool)), m_scene_target, SLOT(changeRealTimeBlending(bool)));
+    connect(ui->actionLive_preview, SIGNAL(toggled(bool)), m_scene_target, SLOT(changeLivePreview(bool)));
     connect(ui->actionMixed_blending,     SIGNAL(toggled(bool)), m_scene_target, SLOT(changeMixedBlending(bool)));
 
+    connect(m_solver_action_group, SIGNAL(triggered(QAction*)), this, SLOT(solverActionTriggered()));
+    connect(ui->actionSolver_tolerance, SIGNAL(triggered(bool)), this, SLOT(askSolverTolerance()));
+
     connect(ui->actionRecompute_selected_layer, SIGNAL(triggered(bool)), m_scene_target, SLOT(recomputeBlendingSelected()));
     connect(ui->actionRecompute_all_layers,     SIGNAL(triggered(bool)), m_scene_target, SLOT(recomputeBlendingAll()));
+    connect(ui->actionJoint_solve,              SIGNAL(toggled(bool)),   m_scene_target, SLOT(changeJointSolve(bool)));
 
     connect(ui->actionAbout_Qt, SIGNAL(triggered(bool)), this, SLOT(aboutQtDialog()));
     connect(ui->actionAbout,    SIGNAL(triggered(bool)), this, SLOT(aboutProgramDialog()));
@@ -98,6 +137,7 @@ MainWindow::MainWindow(QWidget *parent)
     connect(m_scene_target, SIGNAL(keyPressed(QKeyEvent*)),  this, SLOT(targetSceneKeyPressed(QKeyEvent*)));
     connect(m_scene_target, SIGNAL(selectionChanged()),      this, SLOT(targetSceneSelectionChanged()));
     connect(m_scene_target, SIGNAL(sourceItemListChanged()), this, SLOT(pastedItemListChanged()));
+    connect(m_scene_target, SIGNAL(blendingSolved(QString)),  this, SLOT(targetSceneBlendingSolved(QString)));
 
     // Drag & drop actions from graphics views
     connect(ui->graphicsViewSource, SIGNAL(imageFileDropped(QString)), this, SLOT(openSourceImage(QString)));
@@ -106,6 +146,13 @@ MainWindow::MainWindow(QWidget *parent)
 
 MainWindow::~MainWindow()
 {
+    // Stop the export and hand it to the scheduler (deleted now, or by its thread when it exits)
+    if (m_tiled_job) {
+        m_tiled_job->disconnect(this);
+        m_tiled_job->cancel();
+        ComputationHandler::releaseComputationJob(m_tiled_job);
+    }
+
     delete ui;
     delete m_pix_item_source;
     delete m_pix_item_target;
@@ -235,6 +282,7 @@ void MainWindow::openTargetImage(QString filename) {
 
     // Update the target image
     m_target_image = new_image;
+    m_target_filename = filename;
 
     // Remove the currently pasted layers (if one)
     m_scene_target->removeAllSrcItem();
@@ -341,6 +389,9 @@ void MainWindow::openProjectDataFile(QString filename) {
     in >> m_source_image;
     in >> m_target_image;
 
+    // The target image is not read from a file anymore
+    m_target_filename.clear();
+
     // Update the source and target with the new images
     updateSourceScene();
     updateTargetScene();
@@ -372,6 +423,30 @@ void MainWindow::openProjectDataFile(QString filename) {
     m_scene_target->changeMixedBlending(is_mixed);
     m_scene_target->changeRealTimeBlending(is_realtime);
 
+    // The solver setting is missing in older project files
+    if (!in.atEnd()) {
+        int solver_type;
+        in >> solver_type;
+
+        setSelectedSolverType((SolverType) solver_type);
+    }
+
+    if (!in.atEnd()) {
+        in >> m_solver_tolerance;
+    }
+
+    if (!in.atEnd()) {
+        bool is_live_preview;
+        in >> is_live_preview;
+
+        ui->actionLive_preview->setChecked(is_live_preview);
+    }
+
+    m_scene_target->changeLivePreview(ui->actionLive_preview->isChecked());
+
+    m_scene_target->changeSolverType(selectedSolverType());
+    m_scene_target->changeSolverTolerance(m_solver_tolerance);
+
     // Recovering from file done !
 }
 
@@ -413,6 +488,9 @@ void MainWindow::saveProjectDataToFile(QString filename) {
     // ----- Blending settings ----- //
     out << ui->actionMixed_blending->isChecked();
     out << ui->actionReal_time_blending->isChecked();
+    out << (int) selectedSolverType();
+    out << m_solver_tolerance;
+    out << ui->actionLive_preview->isChecked();
 }
 
 /**
@@ -495,6 +573,143 @@ void MainWindow::exportBlendingResult(QString filename) {
     }
 }
 
+/**
+ * @brief MainWindow::exportResultTiled
+ *
+ * This slot asks for an export file location then blends all the pasted layers at the
+ * full resolution of the target, out of core (threaded, see TiledBlendingComputationUnit).
+ * Only the PPM format is written without the whole image in memory.
+ */
+void MainWindow::exportResultTiled() {
+    // Only one export at once
+    if (m_tiled_job)
+        return;
+
+    // Ask for export location
+    QString filename = QFileDialog::getSaveFileName(
+                this,
+                "Export the full resolution blending as...",
+                QDir::homePath(),
+                TILED_WRITE_EXT);
+
+    // If the save dialog was canceled
+    if (filename.isEmpty())
+        return;
+
+    // The pasted layers, bottom first
+    QVector<TiledBlendingComputationUnit::Layer> layers;
+
+    foreach (PastedSourceItem *item, m_scene_target->getSourceItemList()) {
+        if (item->indexMap().pixels.isEmpty())
+            continue;
+
+        TiledBlendingComputationUnit::Layer layer;
+        layer.source = item->originalPlanes();
+        layer.unknowns = item->indexMap().unknowns;
+        layer.position = item->layerRect().topLeft();
+        layer.mixed_blending = item->isMixedBlending();
+
+        layers.append(layer);
+    }
+
+    m_tiled_job = new TiledBlendingComputationUnit(
+                m_target_filename,
+                m_target_image,
+                layers,
+                filename,
+                m_solver_tolerance,
+                m_memory_budget * 1024LL * 1024LL);
+
+    connect(m_tiled_job, SIGNAL(progressChanged(int,int,float)), this, SLOT(tiledExportProgress(int,int,float)));
+    connect(m_tiled_job, SIGNAL(computationFinished()), this, SLOT(tiledExportFinished()));
+
+    ComputationHandler::startComputationJob(m_tiled_job, PriorityBatch);
+
+    m_status_bar->showMessage("Exporting the full resolution blending...");
+
+    // Update UI
+    updateUiComponents();
+}
+
+/**
+ * @brief MainWindow::tiledExportProgress
+ * @param layer
+ * @param cycle
+ * @param error
+ *
+ * This slot displays the progress of the out-of-core export.
+ */
+void MainWindow::tiledExportProgress(int layer, int cycle, float error) {
+    m_status_bar->showMessage(
+                QString("Exporting the full resolution blending: layer %1, cycle %2 (relative residual %3)...")
+                .arg(layer + 1)
+                .arg(cycle)
+                .arg(error));
+}
+
+/**
+ * @brief MainWindow::tiledExportFinished
+ *
+ * This slot is called when the out-of-core export exits.
+ */
+void MainWindow::tiledExportFinished() {
+    // If there is no running job -> abort
+    if (!m_tiled_job)
+        return;
+
+    const bool succeeded = m_tiled_job->succeeded();
+    const QString error_string = m_tiled_job->errorString();
+    const SolveStats stats = m_tiled_job->getSolveStats();
+
+    // Delete the computation unit
+    delete m_tiled_job;
+    m_tiled_job = nullptr;
+
+    updateUiComponents();
+
+    if (!succeeded) {
+        m_status_bar->clearMessage();
+
+        if (!error_string.isEmpty()) {
+            QMessageBox::critical(
+                        this,
+                        "Blending exportation error",
+                        error_string);
+        }
+
+        return;
+    }
+
+    // The iterations are the window cycles of the slowest layer
+    m_status_bar->showMessage(QString("Full resolution blending exported (%1).")
+                              .arg(ComputationHandler::solveStatsText(stats)));
+}
+
+/**
+ * @brief MainWindow::askMemoryBudget
+ *
+ * This slot asks for the memory budget of the out-of-core export.
+ */
+void MainWindow::askMemoryBudget() {
+    bool ok;
+
+    int budget = QInputDialog::getInt(
+                this,
+                "Memory budget",
+                "Memory budget of the full resolution export (MB):",
+                m_memory_budget,
+                64,
+                1024 * 1024,
+                64,
+                &ok);
+
+    // If the dialog was canceled
+    if (!ok)
+        return;
+
+    m_memory_budget = budget;
+}
+
 /**
  * @brief MainWindow::updateSourceScene
  *
@@ -517,6 +732,9 @@ void MainWindow::updateSourceScene() {
  * This slot updates the pixmap on the target graphics scene
  */
 void MainWindow::updateTargetScene() {
+    // Convert the new target for the blendings in the background
+    ComputationHandler::prepareTargetPlanes(m_target_image);
+
     // Update the picture of the pixmap item
     m_pix_item_target->setPixmap(QPixmap::fromImage(m_target_image));
 
@@ -553,6 +771,32 @@ void MainWindow::sourceLassoRemoved() {
     m_label_size->clear();
 }
 
+/**
+ * @brief MainWindow::updateJobStatistics
+ *
+ * This slot displays the computation queues in the status bar (hidden when they are empty)
+ */
+void MainWindow::updateJobStatistics() {
+    const JobStatistics interactive = ComputationHandler::jobStatistics(PriorityInteractive);
+    const JobStatistics background = ComputationHandler::jobStatistics(PriorityBackground);
+    const JobStatistics batch = ComputationHandler::jobStatistics(PriorityBatch);
+
+    const int pending = interactive.queued + interactive.running + background.queued +
+                        background.running + batch.queued + batch.running;
+
+    if (pending == 0) {
+        m_label_jobs->clear();
+        return;
+    }
+
+    // Average waiting time of the interactive jobs (the latency seen by the user)
+    const qint64 interactive_wait = interactive.finished + interactive.running > 0 ?
+                interactive.total_wait / (interactive.finished + interactive.running) : 0;
+
+    m_label_jobs->setText(QString("Jobs: %1 interactive, %2 background, %3 batch queued (interactive wait: %4 ms)")
+                          .arg(interactive.queued).arg(background.queued).arg(batch.queued).arg(interactive_wait));
+}
+
 /**
  * @brief MainWindow::clearLassoSelection
  *
@@ -621,6 +865,20 @@ void MainWindow::targetSceneSelectionChanged() {
     ui->actionRecompute_selected_layer->setEnabled(selection_count > 0);
 }
 
+/**
+ * @brief MainWindow::targetSceneBlendingSolved
+ * @param report
+ *
+ * This slot is called by the scene when a blending is solved: the solver report
+ * is shown in the status bar for a while (not over the progress of an export).
+ */
+void MainWindow::targetSceneBlendingSolved(QString report) {
+    if (m_tiled_job)
+        return;
+
+    m_status_bar->showMessage(report, SOLVE_REPORT_TIME);
+}
+
 /**
  * @brief MainWindow::pastedItemListChanged
  *
@@ -655,6 +913,90 @@ void MainWindow::askRemoveAllLayers() {
 }
 
 
+/**
+ * @brief MainWindow::solverActionTriggered
+ *
+ * This slot is called when a solver is chosen in the blending menu.
+ */
+void MainWindow::solverActionTriggered() {
+    m_scene_target->changeSolverType(selectedSolverType());
+}
+
+/**
+ * @brief MainWindow::askSolverTolerance
+ *
+ * This slot asks for the relative residual tolerance of the iterative solvers
+ * (conjugate gradient and multigrid).
+ */
+void MainWindow::askSolverTolerance() {
+    bool ok;
+
+    double tolerance = QInputDialog::getDouble(
+                this,
+                "Solver tolerance",
+                "Relative residual tolerance of the iterative solvers:",
+                m_solver_tolerance,
+                1e-8,
+                1e-1,
+                8,
+                &ok);
+
+    // If the dialog was canceled
+    if (!ok)
+        return;
+
+    m_solver_tolerance = tolerance;
+    m_scene_target->changeSolverTolerance(m_solver_tolerance);
+}
+
+/**
+ * @brief MainWindow::selectedSolverType
+ * @return
+ *
+ * This function returns the solver checked in the blending menu.
+ */
+SolverType MainWindow::selectedSolverType() {
+    if (ui->actionSolver_domain_decomposition->isChecked())
+        return SolverDomainDecomposition;
+
+    if (ui->actionSolver_fast_poisson->isChecked())
+        return SolverFastPoisson;
+
+    if (ui->actionSolver_multigrid->isChecked())
+        return SolverMultigrid;
+
+    if (ui->actionSolver_conjugate_gradient->isChecked())
+        return SolverConjugateGradient;
+
+    return SolverCholesky;
+}
+
+/**
+ * @brief MainWindow::setSelectedSolverType
+ * @param type
+ *
+ * This function checks the given solver in the blending menu.
+ */
+void MainWindow::setSelectedSolverType(SolverType type) {
+    switch (type) {
+    case SolverDomainDecomposition:
+        ui->actionSolver_domain_decomposition->setChecked(true);
+        break;
+    case SolverFastPoisson:
+        ui->actionSolver_fast_poisson->setChecked(true);
+        break;
+    case SolverMultigrid:
+        ui->actionSolver_multigrid->setChecked(true);
+        break;
+    case SolverConjugateGradient:
+        ui->actionSolver_conjugate_gradient->setChecked(true);
+        break;
+    default:
+        ui->actionSolver_cholesky->setChecked(true);
+        break;
+    }
+}
+
 /**
  * @brief MainWindow::updateUiComponents
  *
@@ -664,6 +1006,7 @@ void MainWindow::updateUiComponents() {
     ui->actionSave_project->setEnabled(!m_source_image.isNull() || !m_target_image.isNull());
     ui->actionExport->setEnabled(!m_target_image.isNull());
     ui->actionExport_as->setEnabled(!m_target_image.isNull());
+    ui->actionExport_tiled->setEnabled(!m_target_image.isNull() && !m_tiled_job);
 
     bool lasso_valid = m_scene_source->isSelectionValid();
     ui->actionClear_selection->setEnabled(lasso_valid);
@@ -709,9 +1052,11 @@ void MainWindow::transferLassoSelection() {
     QPainterPath path = m_scene_source->getSelectionPath();
 
     // Create the Pasted Source Item
-    PastedSourceItem *src_item = new PastedSourceItem(src_img_part, path, m_target_image);
+    PastedSourceItem *src_item = new PastedSourceItem(src_img_part, path, m_target_image, selectedSolverType());
     src_item->setRealTime(ui->actionReal_time_blending->isChecked());
+    src_item->setLivePreview(ui->actionLive_preview->isChecked());
     src_item->setMixedBlending(ui->actionMixed_blending->isChecked());
+    src_item->setSolverTolerance(m_solver_tolerance);
 
     // Add the source item to the target scene
     m_scene_target->addSourceItem(src_item);
@@ -5,11 +5,16 @@
 #include <QPainterPath>
 #include <QLabel>
 
+#include "computationhandler.h"
+
 class QGraphicsScene;
+class QActionGroup;
 class QGraphicsPixmapItem;
+class QTimer;
 
 class SourceGraphicsScene;
 class TargetGraphicsScene;
+class TiledBlendingComputationUnit;
 
 class ComputationHandler;
 
@@ -35,6 +40,10 @@ private slots:
 
     void exportResultDirect();
     void exportResultAs();
+    void exportResultTiled();
+    void tiledExportProgress(int layer, int cycle, float error);
+    void tiledExportFinished();
+    void askMemoryBudget();
 
     // Help action slots
     void aboutQtDialog();
@@ -49,13 +58,21 @@ private slots:
     void sourceLassoRemoved();
     void clearLassoSelection();
 
+    // Computation queues
+    void updateJobStatistics();
+
     // Target scene related slots
     void updateTargetScene();
     void targetSceneKeyPressed(QKeyEvent *event);
     void targetSceneSelectionChanged();
+    void targetSceneBlendingSolved(QString report);
     void pastedItemListChanged();
     void askRemoveAllLayers();
 
+    // Blending settings
+    void solverActionTriggered();
+    void askSolverTolerance();
+
     // UI component
     void updateUiComponents();
 
@@ -64,10 +81,18 @@ private:
     void saveProjectDataToFile(QString filename);
     void exportBlendingResult(QString filename);
 
+    SolverType selectedSolverType();
+    void setSelectedSolverType(SolverType type);
+
     Ui::MainWindow *ui;
 
     QStatusBar *m_status_bar;
     QLabel     *m_label_size;
+    QLabel     *m_label_jobs;
+    QTimer     *m_job_stats_timer;
+
+    QActionGroup *m_solver_action_group;
+    float m_solver_tolerance;
 
     SourceGraphicsScene *m_scene_source;
     TargetGraphicsScene *m_scene_target;
@@ -78,6 +103,13 @@ private:
     QImage m_source_image;
     QImage m_target_image;
 
+    // File of the target image (empty if it was loaded from a project)
+    QString m_target_filename;
+
     QString m_last_export_filename;
+
+    // Out-of-core export of the full resolution blending
+    TiledBlendingComputationUnit *m_tiled_job;
+    int m_memory_budget;    // MB
 };
 #endif // MAINWINDOW_H
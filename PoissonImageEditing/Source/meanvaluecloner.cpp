@@ -0,0 +1,302 @@
+#include "meanvaluecloner.h"
+
+#include <cmath>
+
+
+#define MVC_BOUNDARY_SPACING        2.0     // px (between two contour samples)
+#define MVC_MIN_BOUNDARY_POINTS     16
+#define MVC_MAX_BOUNDARY_POINTS     512
+#define MVC_GRID_SPACING            4       // px (between two interpolation nodes)
+#define MVC_MAX_GRID_NODES          8192
+
+
+MeanValueCloner::MeanValueCloner(QPainterPath selection_path, ImagePlanes src_img, const UnknownIndexMap &index_map)
+{
+    m_index_map = index_map;
+    m_size = QSize(index_map.index.cols(), index_map.index.rows());
+
+    // Source colors of the unknowns
+    m_source.resize(index_map.pixels.size(), 3);
+
+    for (int i = 0 ; i < index_map.pixels.size() ; i++) {
+        const QPoint &p = index_map.pixels[i];
+
+        for (int ch = 0 ; ch < 3 ; ch++) {
+            m_source(i,ch) = src_img.at(ch, p.y(), p.x());
+        }
+    }
+
+    // Selection contour in mask coordinates (same origin as in selectionToMask)
+    QRect b_rect = selection_path.boundingRect().toAlignedRect().adjusted(-1, -1, 1, 1);
+    QPolygonF contour = selection_path.toFillPolygon().translated(-b_rect.topLeft());
+
+    sampleBoundary(contour);
+
+    // Source colors along the contour
+    m_boundary_source.resize(m_boundary_pixels.size(), 3);
+
+    for (int i = 0 ; i < m_boundary_pixels.size() ; i++) {
+        const QPoint &p = m_boundary_pixels[i];
+
+        for (int ch = 0 ; ch < 3 ; ch++) {
+            m_boundary_source(i,ch) = src_img.at(ch, p.y(), p.x());
+        }
+    }
+
+    // Coarse interpolation grid covering the unknowns
+    QRect rect = ComputationHandler::unknownsBoundingRect(index_map);
+
+    m_grid_origin = rect.topLeft();
+    m_grid_spacing = MVC_GRID_SPACING;
+
+    do {
+        m_grid_width = (rect.width() - 1) / m_grid_spacing + 2;
+        m_grid_height = (rect.height() - 1) / m_grid_spacing + 2;
+    } while (m_grid_width * m_grid_height > MVC_MAX_GRID_NODES && m_grid_spacing++);
+
+    computeWeights();
+}
+
+int MeanValueCloner::boundarySize() const {
+    return m_boundary.size();
+}
+
+/**
+ * @brief MeanValueCloner::sampleBoundary
+ * @param contour
+ *
+ * This function samples the contour at regular arc length intervals, and finds the
+ * pixel outside the mask (Dirichlet boundary of the Poisson equation) closest to each sample.
+ */
+void MeanValueCloner::sampleBoundary(const QPolygonF &contour) {
+    QPolygonF points = contour;
+
+    // Remove the closing point
+    if (points.size() > 1 && points.first() == points.last()) {
+        points.removeLast();
+    }
+
+    if (points.size() < 3)
+        return;
+
+    // Length of each edge (the last one closes the contour)
+    QVector<double> lengths(points.size());
+    double perimeter = 0.0;
+
+    for (int i = 0 ; i < points.size() ; i++) {
+        const QPointF d = points[(i + 1) % points.size()] - points[i];
+
+        lengths[i] = std::sqrt(d.x() * d.x() + d.y() * d.y());
+        perimeter += lengths[i];
+    }
+
+    const int count = qBound(MVC_MIN_BOUNDARY_POINTS, (int) (perimeter / MVC_BOUNDARY_SPACING), MVC_MAX_BOUNDARY_POINTS);
+    const double step = perimeter / count;
+
+    int edge = 0;
+    double edge_start = 0.0;    // Arc length at the start of the current edge
+
+    for (int s = 0 ; s < count ; s++) {
+        const double arc = s * step;
+
+        while (edge < points.size() - 1 && edge_start + lengths[edge] <= arc) {
+            edge_start += lengths[edge];
+            edge++;
+        }
+
+        const double t = lengths[edge] > 0.0 ? (arc - edge_start) / lengths[edge] : 0.0;
+        const QPointF p = points[edge] + t * (points[(edge + 1) % points.size()] - points[edge]);
+
+        m_boundary.append(p);
+
+        // Nearest pixel, moved outside the mask if needed
+        QPoint pixel(qBound(0, qRound(p.x()), m_size.width() - 1), qBound(0, qRound(p.y()), m_size.height() - 1));
+
+        if (m_index_map.index(pixel.y(), pixel.x()) >= 0) {
+            double best_distance = -1.0;
+            QPoint best_pixel = pixel;
+
+            for (int dy = -1 ; dy <= 1 ; dy++) {
+                for (int dx = -1 ; dx <= 1 ; dx++) {
+                    const int x = pixel.x() + dx;
+                    const int y = pixel.y() + dy;
+
+                    if (x < 0 || y < 0 || x >= m_size.width() || y >= m_size.height() || m_index_map.index(y,x) >= 0)
+                        continue;
+
+                    const double distance = (x - p.x()) * (x - p.x()) + (y - p.y()) * (y - p.y());
+
+                    if (best_distance < 0.0 || distance < best_distance) {
+                        best_distance = distance;
+                        best_pixel = QPoint(x,y);
+                    }
+                }
+            }
+
+            pixel = best_pixel;
+        }
+
+        m_boundary_pixels.append(pixel);
+    }
+}
+
+/**
+ * @brief MeanValueCloner::computeWeights
+ *
+ * This function computes the mean-value coordinates of each grid node with
+ * respect to the sampled contour (Floater's formula with signed angles, valid
+ * for non-convex contours).
+ */
+void MeanValueCloner::computeWeights() {
+    const int nb = m_boundary.size();
+    const int nodes = m_grid_width * m_grid_height;
+
+    m_weights = MatrixXd::Zero(nodes, nb);
+
+    if (nb == 0)
+        return;
+
+    QVector<double> dx(nb), dy(nb), r(nb), tan_half(nb), w(nb);
+
+    for (int node = 0 ; node < nodes ; node++) {
+        const double x = m_grid_origin.x() + (node % m_grid_width) * m_grid_spacing;
+        const double y = m_grid_origin.y() + (node / m_grid_width) * m_grid_spacing;
+
+        int on_vertex = -1;
+
+        for (int i = 0 ; i < nb ; i++) {
+            dx[i] = m_boundary[i].x() - x;
+            dy[i] = m_boundary[i].y() - y;
+            r[i] = std::sqrt(dx[i] * dx[i] + dy[i] * dy[i]);
+
+            if (r[i] < 1e-6)
+                on_vertex = i;
+        }
+
+        // The node is a contour sample
+        if (on_vertex >= 0) {
+            m_weights(node, on_vertex) = 1.0;
+            continue;
+        }
+
+        int on_edge = -1;
+
+        // tan(alpha_i/2), alpha_i being the signed angle of the edge (i, i+1) seen from the node
+        for (int i = 0 ; i < nb ; i++) {
+            const int j = (i + 1) % nb;
+
+            const double cross = dx[i] * dy[j] - dy[i] * dx[j];
+            const double dot = dx[i] * dx[j] + dy[i] * dy[j];
+
+            if (std::abs(cross) < 1e-9 * r[i] * r[j] && dot < 0.0) {
+                on_edge = i;
+                break;
+            }
+
+            tan_half[i] = cross / (r[i] * r[j] + dot);
+        }
+
+        // The node lies on a contour edge: linear interpolation
+        if (on_edge >= 0) {
+            const int j = (on_edge + 1) % nb;
+
+            m_weights(node, on_edge) = r[j] / (r[on_edge] + r[j]);
+            m_weights(node, j) = r[on_edge] / (r[on_edge] + r[j]);
+            continue;
+        }
+
+        double sum = 0.0;
+
+        for (int i = 0 ; i < nb ; i++) {
+            w[i] = (tan_half[(i + nb - 1) % nb] + tan_half[i]) / r[i];
+            sum += w[i];
+        }
+
+        // Degenerate outside nodes: nearest contour sample
+        if (std::abs(sum) < 1e-12) {
+            int nearest = 0;
+
+            for (int i = 1 ; i < nb ; i++) {
+                if (r[i] < r[nearest])
+                    nearest = i;
+            }
+
+            m_weights(node, nearest) = 1.0;
+            continue;
+        }
+
+        for (int i = 0 ; i < nb ; i++) {
+            m_weights(node, i) = w[i] / sum;
+        }
+    }
+}
+
+/**
+ * @brief MeanValueCloner::blend
+ * @param target_img
+ * @param offset
+ * @return
+ *
+ * This function returns the cloned image (transparent outside the mask) for the item
+ * placed at 'offset' in the target image.
+ */
+QImage MeanValueCloner::blend(const QImage &target_img, QPoint offset) const {
+    QImage blended(m_size, QImage::Format_ARGB32);
+    blended.fill(Qt::transparent);
+
+    const int nb = m_boundary_pixels.size();
+
+    // Target-source differences along the contour
+    MatrixX3d diff(nb, 3);
+
+    for (int i = 0 ; i < nb ; i++) {
+        const int x = qBound(0, m_boundary_pixels[i].x() + offset.x(), target_img.width() - 1);
+        const int y = qBound(0, m_boundary_pixels[i].y() + offset.y(), target_img.height() - 1);
+
+        const QRgb color = target_img.pixel(x,y);
+
+        diff(i,0) = qRed(color) / 255.0f - m_boundary_source(i,0);
+        diff(i,1) = qGreen(color) / 255.0f - m_boundary_source(i,1);
+        diff(i,2) = qBlue(color) / 255.0f - m_boundary_source(i,2);
+    }
+
+    // Membrane on the grid nodes
+    const MatrixX3d membrane = m_weights * diff;
+
+    int row_y = -1;
+    QRgb *row = nullptr;
+
+    for (int i = 0 ; i < m_index_map.pixels.size() ; i++) {
+        const int x = m_index_map.pixels[i].x();
+        const int y = m_index_map.pixels[i].y();
+
+        // The unknowns are in row-major order
+        if (y != row_y) {
+            row_y = y;
+            row = (QRgb*) blended.scanLine(y);
+        }
+
+        // Bilinear interpolation of the membrane
+        const int lx = x - m_grid_origin.x();
+        const int ly = y - m_grid_origin.y();
+        const int gx = lx / m_grid_spacing;
+        const int gy = ly / m_grid_spacing;
+        const float tx = (float) (lx - gx * m_grid_spacing) / m_grid_spacing;
+        const float ty = (float) (ly - gy * m_grid_spacing) / m_grid_spacing;
+
+        const int n = gy * m_grid_width + gx;
+
+        const Eigen::RowVector3f value = m_source.row(i)
+                + (1.0f - ty) * ((1.0f - tx) * membrane.row(n) + tx * membrane.row(n + 1))
+                + ty * ((1.0f - tx) * membrane.row(n + m_grid_width) + tx * membrane.row(n + m_grid_width + 1));
+
+        row[x] = qRgba(
+                qBound(0.0f, value(0) * 255.0f, 255.0f),
+                qBound(0.0f, value(1) * 255.0f, 255.0f),
+                qBound(0.0f, value(2) * 255.0f, 255.0f),
+                255
+            );
+    }
+
+    return blended;
+}
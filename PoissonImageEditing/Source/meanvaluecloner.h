@@ -0,0 +1,61 @@
+#ifndef MEANVALUECLONER_H
+#define MEANVALUECLONER_H
+
+#include <QImage>
+#include <QPainterPath>
+#include <QPolygonF>
+#include <QSharedPointer>
+#include <QVector>
+
+#include "computationhandler.h"
+
+/*
+ * Mean-value coordinates cloning (Farbman et al., "Coordinates for instant image cloning").
+ *
+ * The boundary membrane of the seamless cloning is approximated by the mean-value
+ * interpolation of the target-source differences along the selection contour.
+ * The mean-value weights only depend on the selection, so they are computed once
+ * (on a coarse grid of the interior, interpolated bilinearly per pixel). A new
+ * position of the item then only costs a small dense product.
+ *
+ * The result is an approximation of the plain (not mixed) Poisson blending, used as
+ * a live preview while the item is dragged.
+ */
+class MeanValueCloner
+{
+public:
+    MeanValueCloner(QPainterPath selection_path, ImagePlanes src_img, const UnknownIndexMap &index_map);
+
+    int boundarySize() const;
+
+    QImage blend(const QImage &target_img, QPoint offset) const;
+
+private:
+    void sampleBoundary(const QPolygonF &contour);
+    void computeWeights();
+
+    // Selection (mask coordinates)
+    UnknownIndexMap m_index_map;
+    QSize m_size;
+
+    // Source colors of the unknowns (one column per color channel)
+    MatrixX3d m_source;
+
+    // Sampled contour and the pixel just outside the mask at each sample
+    QPolygonF m_boundary;
+    QVector<QPoint> m_boundary_pixels;
+    MatrixX3d m_boundary_source;
+
+    // Interpolation grid covering the unknowns
+    QPoint m_grid_origin;
+    int m_grid_spacing;
+    int m_grid_width;
+    int m_grid_height;
+
+    // Mean-value weights (one row per grid node, one column per boundary sample)
+    MatrixXd m_weights;
+};
+
+typedef QSharedPointer<const MeanValueCloner> MeanValueClonerPtr;
+
+#endif // MEANVALUECLONER_H
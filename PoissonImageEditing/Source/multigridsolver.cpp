@@ -0,0 +1,495 @@
+#include "multigridsolver.h"
+
+#include <cmath>
+
+
+#define PRE_SMOOTHING_SWEEPS    2
+#define POST_SMOOTHING_SWEEPS   2
+#define COARSEST_SWEEPS         50
+#define COARSEST_MAX_SIZE       4     // px (larger inner side)
+#define COARSE_CHILDREN_NUM     3     // Fraction of the children inside the mask
+#define COARSE_CHILDREN_DEN     4     // for a coarse cell to be inside
+
+
+MultigridSolver::MultigridSolver(const UnknownIndexMap &index_map)
+{
+    m_index_map = index_map;
+
+    m_cycle_type = VCycle;
+    m_tolerance = 1e-5;
+    m_max_iterations = 100;
+    m_cancel_flag = nullptr;
+
+    m_iterations = 0;
+    m_error = 0.0;
+    m_allocated_bytes = 0;
+
+    // The finest level is the selection mask (it already has a 1px margin)
+    Level fine;
+    fine.height = index_map.index.rows();
+    fine.width = index_map.index.cols();
+    fine.mask.fill(0, fine.width * fine.height);
+    fine.last_col_extent = 1;
+    fine.last_row_extent = 1;
+
+    for (int i = 0 ; i < index_map.pixels.size() ; i++) {
+        fine.mask[index_map.pixels[i].y() * fine.width + index_map.pixels[i].x()] = 1;
+    }
+
+    m_levels.append(fine);
+
+    // Restrict the mask level by level until the grid is small enough.
+    // The larger side decides, so that thin and long selections are coarsened too
+    // (the smaller side stops at 1 px).
+    while (qMax(m_levels.last().width, m_levels.last().height) - 2 > COARSEST_MAX_SIZE) {
+        const Level &f = m_levels.last();
+
+        Level coarse;
+        coarse.height = (f.height - 2 + 1) / 2 + 2;
+        coarse.width = (f.width - 2 + 1) / 2 + 2;
+        coarse.mask.fill(0, coarse.width * coarse.height);
+
+        // Extent (in finest pixels) of the last inner column and row: the cells there
+        // only have the children left by an odd fine size
+        coarse.last_col_extent = (f.width % 2) ? f.last_col_extent : (1 << (m_levels.size()-1)) + f.last_col_extent;
+        coarse.last_row_extent = (f.height % 2) ? f.last_row_extent : (1 << (m_levels.size()-1)) + f.last_row_extent;
+
+        // Count the children of each coarse cell (inside the mask, and in the fine grid)
+        QVector<uchar> inside(coarse.width * coarse.height, 0);
+        QVector<uchar> available(coarse.width * coarse.height, 0);
+
+        for (int y = 1 ; y < f.height-1 ; y++) {
+            for (int x = 1 ; x < f.width-1 ; x++) {
+                const int c = ((y-1)/2 + 1) * coarse.width + (x-1)/2 + 1;
+
+                available[c]++;
+
+                if (f.mask[y * f.width + x])
+                    inside[c]++;
+            }
+        }
+
+        // A coarse cell is inside if most of its children are inside. With the "any child" rule,
+        // the 1px gaps between touching regions close on the coarse grids, and the coarse
+        // correction no longer sees the Dirichlet values there.
+        for (int c = 0 ; c < coarse.mask.size() ; c++) {
+            coarse.mask[c] = (inside[c] > 0 && inside[c] * COARSE_CHILDREN_DEN >= available[c] * COARSE_CHILDREN_NUM);
+        }
+
+        m_levels.append(coarse);
+    }
+
+    for (int l = 0 ; l < m_levels.size() ; l++) {
+        Level &lvl = m_levels[l];
+        const int size = lvl.width * lvl.height;
+
+        // The Dirichlet values lie 1 fine pixel away from the boundary cells,
+        // which is (h_l/2 + 1/2) away from a coarse cell center (h_l = 2^l fine pixels).
+        // With a linear extrapolation of the ghost value, each neighbor outside the mask
+        // adds (1/theta - 1) to the diagonal of the 5-point stencil.
+        const float h_l = (float) (1 << l);
+        const float theta = (h_l + 1.0f) / (2.0f * h_l);
+        const float boundary_weight = 1.0f / theta - 1.0f;
+
+        lvl.diag.fill(4.0, size);
+
+        for (int y = 1 ; y < lvl.height-1 ; y++) {
+            for (int x = 1 ; x < lvl.width-1 ; x++) {
+                const int i = y * lvl.width + x;
+
+                if (!lvl.mask[i])
+                    continue;
+
+                const int outside = 4 - lvl.mask[i-1] - lvl.mask[i+1] - lvl.mask[i-lvl.width] - lvl.mask[i+lvl.width];
+                lvl.diag[i] += outside * boundary_weight;
+
+                // The last column and row may be narrower than h_l: the Dirichlet values
+                // past them are (extent/2 + 1/2) away from the cell center
+                if (x == lvl.width-2 && !lvl.mask[i+1])
+                    lvl.diag[i] += 2.0f * h_l / (lvl.last_col_extent + 1.0f) - 1.0f - boundary_weight;
+
+                if (y == lvl.height-2 && !lvl.mask[i+lvl.width])
+                    lvl.diag[i] += 2.0f * h_l / (lvl.last_row_extent + 1.0f) - 1.0f - boundary_weight;
+            }
+        }
+
+        // Allocate the work buffers (the margin stays at 0)
+        lvl.x.fill(0.0, size);
+        lvl.b.fill(0.0, size);
+        lvl.r.fill(0.0, size);
+    }
+}
+
+void MultigridSolver::setCycleType(CycleType type) {
+    m_cycle_type = type;
+}
+
+void MultigridSolver::setTolerance(float tolerance) {
+    m_tolerance = tolerance;
+}
+
+void MultigridSolver::setMaxIterations(int max_iterations) {
+    m_max_iterations = max_iterations;
+}
+
+void MultigridSolver::setCancelFlag(const QAtomicInt *cancel_flag) {
+    m_cancel_flag = cancel_flag;
+}
+
+void MultigridSolver::setProgressCallback(SolverProgressCallback callback) {
+    m_progress_callback = callback;
+}
+
+int MultigridSolver::iterations() const {
+    return m_iterations;
+}
+
+float MultigridSolver::error() const {
+    return m_error;
+}
+
+qint64 MultigridSolver::allocatedBytes() const {
+    return m_allocated_bytes;
+}
+
+/**
+ * @brief MultigridSolver::solve
+ * @param b
+ * @return
+ *
+ * This function solves A*x = b (b and x are given on the compact unknowns), starting from x = 0.
+ */
+VectorXd MultigridSolver::solve(const VectorXd &b) {
+    return solveWithGuess(b, VectorXd::Zero(b.size()));
+}
+
+/**
+ * @brief MultigridSolver::solveWithGuess
+ * @param b
+ * @param x0
+ * @return
+ *
+ * This function solves A*x = b (b and x are given on the compact unknowns), starting from x = x0.
+ * Flexible preconditioned CG iterations are done until the relative residual is below the tolerance.
+ */
+VectorXd MultigridSolver::solveWithGuess(const VectorXd &b, const VectorXd &x0) {
+    const Level &fine = m_levels[0];
+    const int size = fine.width * fine.height;
+
+    // Work vectors on the finest grid (0 outside the mask)
+    QVector<float> x(size, 0.0), r(size, 0.0), z(size, 0.0), z_old(size, 0.0), p(size, 0.0), q(size, 0.0);
+
+    // Scatter the initial guess and the right-hand side on the finest grid
+    for (int i = 0 ; i < m_index_map.pixels.size() ; i++) {
+        const int grid_idx = m_index_map.pixels[i].y() * fine.width + m_index_map.pixels[i].x();
+
+        x[grid_idx] = x0(i);
+        p[grid_idx] = b(i);
+    }
+
+    // Initial residual r = b - A*x
+    applyOperator(x, q);
+
+    for (int i = 0 ; i < size ; i++) {
+        r[i] = p[i] - q[i];
+    }
+
+    const double b_norm = b.norm();
+
+    m_iterations = 0;
+    m_error = std::sqrt(dot(r, r)) / b_norm;
+
+    // Grid hierarchy (mask, diagonal, x, b and r of each level) and the 6 work vectors
+    m_allocated_bytes = 6 * size * (qint64) sizeof(float);
+
+    for (int l = 0 ; l < m_levels.size() ; l++) {
+        m_allocated_bytes += m_levels[l].width * m_levels[l].height * (qint64) (sizeof(uchar) + 4 * sizeof(float));
+    }
+
+    if (m_progress_callback)
+        m_progress_callback(m_iterations, m_error);
+
+    // Nothing to solve
+    if (b_norm == 0.0) {
+        m_error = 0.0;
+        return VectorXd::Zero(b.size());
+    }
+
+    // The guess is already good enough
+    if (m_error < m_tolerance)
+        return x0;
+
+    applyPreconditioner(r, z);
+    p = z;
+
+    double rz = dot(r, z);
+
+    while (m_iterations < m_max_iterations) {
+        // The caller does not need the solution anymore
+        if (m_cancel_flag && m_cancel_flag->loadAcquire())
+            break;
+
+        applyOperator(p, q);
+
+        const double alpha = rz / dot(p, q);
+
+        for (int i = 0 ; i < size ; i++) {
+            x[i] += alpha * p[i];
+            r[i] -= alpha * q[i];
+        }
+
+        m_iterations++;
+
+        // Relative residual norm
+        m_error = std::sqrt(dot(r, r)) / b_norm;
+
+        if (m_progress_callback)
+            m_progress_callback(m_iterations, m_error);
+
+        if (m_error < m_tolerance)
+            break;
+
+        z_old.swap(z);
+        applyPreconditioner(r, z);
+
+        // Polak-Ribiere formula (the multigrid preconditioner is not exactly symmetric)
+        double rz_new = dot(r, z);
+        const double beta = (rz_new - dot(r, z_old)) / rz;
+        rz = rz_new;
+
+        for (int i = 0 ; i < size ; i++) {
+            p[i] = z[i] + beta * p[i];
+        }
+    }
+
+    // Gather the solution on the compact unknowns
+    VectorXd x_vect(b.size());
+
+    for (int i = 0 ; i < m_index_map.pixels.size() ; i++) {
+        x_vect(i) = x[m_index_map.pixels[i].y() * fine.width + m_index_map.pixels[i].x()];
+    }
+
+    return x_vect;
+}
+
+/**
+ * @brief MultigridSolver::applyOperator
+ * @param in
+ * @param out
+ *
+ * out = A*in on the finest grid (matrix-free 5-point stencil, 0 outside the mask)
+ */
+void MultigridSolver::applyOperator(const QVector<float> &in, QVector<float> &out) {
+    const Level &fine = m_levels[0];
+    const int w = fine.width;
+
+    const float *u = in.data();
+    const uchar *mask = fine.mask.data();
+    float *v = out.data();
+
+    for (int y = 1 ; y < fine.height-1 ; y++) {
+        for (int x = 1 ; x < w-1 ; x++) {
+            const int i = y * w + x;
+            v[i] = mask[i] ? 4.0f * u[i] - u[i-1] - u[i+1] - u[i-w] - u[i+w] : 0.0f;
+        }
+    }
+}
+
+/**
+ * @brief MultigridSolver::applyPreconditioner
+ * @param in
+ * @param out
+ *
+ * out = M^-1 * in, with M^-1 one multigrid cycle started from 0
+ */
+void MultigridSolver::applyPreconditioner(const QVector<float> &in, QVector<float> &out) {
+    Level &fine = m_levels[0];
+
+    fine.b = in;
+    fine.x.fill(0.0);
+
+    cycle(0, m_cycle_type);
+
+    out = fine.x;
+}
+
+/**
+ * @brief MultigridSolver::dot
+ * @param a
+ * @param b
+ * @return
+ *
+ * Dot product of two grids (accumulated in double precision)
+ */
+double MultigridSolver::dot(const QVector<float> &a, const QVector<float> &b) {
+    double sum = 0.0;
+
+    for (int i = 0 ; i < a.size() ; i++) {
+        sum += (double) a[i] * b[i];
+    }
+
+    return sum;
+}
+
+/**
+ * @brief MultigridSolver::smooth
+ * @param lvl
+ * @param sweeps
+ *
+ * Red-black Gauss-Seidel sweeps on the 5-point stencil.
+ * The values outside the mask are kept to 0, so no neighbor test is needed.
+ */
+void MultigridSolver::smooth(Level &lvl, int sweeps) {
+    const int w = lvl.width;
+
+    float *x = lvl.x.data();
+    const float *b = lvl.b.data();
+    const uchar *mask = lvl.mask.data();
+    const float *diag = lvl.diag.data();
+
+    for (int s = 0 ; s < sweeps ; s++) {
+        for (int color = 0 ; color < 2 ; color++) {
+            for (int y = 1 ; y < lvl.height-1 ; y++) {
+                for (int x_pos = 1 + (y + color + 1) % 2 ; x_pos < w-1 ; x_pos += 2) {
+                    const int i = y * w + x_pos;
+
+                    if (!mask[i])
+                        continue;
+
+                    x[i] = (b[i] + x[i-1] + x[i+1] + x[i-w] + x[i+w]) / diag[i];
+                }
+            }
+        }
+    }
+}
+
+/**
+ * @brief MultigridSolver::computeResidual
+ * @param lvl
+ *
+ * r = b - A*x (0 outside the mask)
+ */
+void MultigridSolver::computeResidual(Level &lvl) {
+    const int w = lvl.width;
+
+    const float *x = lvl.x.data();
+    const float *b = lvl.b.data();
+    const uchar *mask = lvl.mask.data();
+    const float *diag = lvl.diag.data();
+    float *r = lvl.r.data();
+
+    for (int y = 1 ; y < lvl.height-1 ; y++) {
+        for (int x_pos = 1 ; x_pos < w-1 ; x_pos++) {
+            const int i = y * w + x_pos;
+
+            if (!mask[i]) {
+                r[i] = 0.0;
+                continue;
+            }
+
+            r[i] = b[i] - (diag[i] * x[i] - x[i-1] - x[i+1] - x[i-w] - x[i+w]);
+        }
+    }
+}
+
+/**
+ * @brief MultigridSolver::restrictResidual
+ * @param fine
+ * @param coarse
+ *
+ * The coarse right-hand side is 4x the mean residual of the children inside the mask
+ * (the stencil is not divided by h², so it scales by 4 from a level to the next).
+ */
+void MultigridSolver::restrictResidual(const Level &fine, Level &coarse) {
+    coarse.b.fill(0.0);
+
+    QVector<uchar> count(coarse.width * coarse.height, 0);
+
+    for (int y = 1 ; y < fine.height-1 ; y++) {
+        for (int x = 1 ; x < fine.width-1 ; x++) {
+            const int i = y * fine.width + x;
+
+            if (!fine.mask[i])
+                continue;
+
+            const int ci = ((y-1)/2 + 1) * coarse.width + (x-1)/2 + 1;
+            coarse.b[ci] += fine.r[i];
+            count[ci]++;
+        }
+    }
+
+    for (int i = 0 ; i < coarse.b.size() ; i++) {
+        if (count[i] > 0) {
+            coarse.b[i] *= 4.0f / count[i];
+        }
+    }
+}
+
+/**
+ * @brief MultigridSolver::prolongateCorrection
+ * @param coarse
+ * @param fine
+ *
+ * Cell-centered bilinear interpolation of the coarse correction (weights 9/16, 3/16, 3/16, 1/16).
+ * Coarse values outside the coarse mask are 0 (Dirichlet).
+ */
+void MultigridSolver::prolongateCorrection(const Level &coarse, Level &fine) {
+    const int cw = coarse.width;
+    const float *e = coarse.x.data();
+
+    for (int y = 1 ; y < fine.height-1 ; y++) {
+        // Parent row and the nearest other coarse row
+        const int cy = (y-1)/2 + 1;
+        const int ny = ((y-1) % 2 == 0) ? cy-1 : cy+1;
+
+        for (int x = 1 ; x < fine.width-1 ; x++) {
+            const int i = y * fine.width + x;
+
+            if (!fine.mask[i])
+                continue;
+
+            // Parent column and the nearest other coarse column
+            const int cx = (x-1)/2 + 1;
+            const int nx = ((x-1) % 2 == 0) ? cx-1 : cx+1;
+
+            fine.x[i] += 0.5625f * e[cy*cw + cx]
+                       + 0.1875f * (e[ny*cw + cx] + e[cy*cw + nx])
+                       + 0.0625f * e[ny*cw + nx];
+        }
+    }
+}
+
+/**
+ * @brief MultigridSolver::cycle
+ * @param level
+ * @param type
+ *
+ * Recursive V-cycle/F-cycle. The F-cycle does an F-cycle then a V-cycle on the coarse level.
+ */
+void MultigridSolver::cycle(int level, CycleType type) {
+    Level &lvl = m_levels[level];
+
+    // Coarsest level -> (almost) exact solve by relaxation
+    if (level == m_levels.size()-1) {
+        smooth(lvl, COARSEST_SWEEPS);
+        return;
+    }
+
+    Level &coarse = m_levels[level+1];
+
+    smooth(lvl, PRE_SMOOTHING_SWEEPS);
+
+    // Coarse-grid correction
+    computeResidual(lvl);
+    restrictResidual(lvl, coarse);
+    coarse.x.fill(0.0);
+
+    if (type == FCycle) {
+        cycle(level+1, FCycle);
+    }
+    cycle(level+1, VCycle);
+
+    prolongateCorrection(coarse, lvl);
+
+    smooth(lvl, POST_SMOOTHING_SWEEPS);
+}
@@ -0,0 +1,86 @@
+#ifndef MULTIGRIDSOLVER_H
+#define MULTIGRIDSOLVER_H
+
+#include <QAtomicInt>
+#include <QVector>
+
+#include "computationhandler.h"
+
+/*
+ * Matrix-free geometric multigrid solver for the masked Poisson equation.
+ * The mask is restricted level by level (a coarse cell is inside if at least 3/4
+ * of its children are inside, counting only the children left by odd sizes).
+ * The pixels outside the mask are Dirichlet boundaries: their contribution is
+ * already in the right-hand side (see computeIndependentTerms).
+ *
+ * One V-cycle or F-cycle is used as the preconditioner of a flexible conjugate
+ * gradient, which keeps the convergence robust on irregular masks where the
+ * coarse grids only approximate the boundary.
+ */
+class MultigridSolver
+{
+public:
+    enum CycleType {
+        VCycle,
+        FCycle
+    };
+
+    MultigridSolver(const UnknownIndexMap &index_map);
+
+    void setCycleType(CycleType type);
+    void setTolerance(float tolerance);
+    void setMaxIterations(int max_iterations);
+    void setCancelFlag(const QAtomicInt *cancel_flag);
+    void setProgressCallback(SolverProgressCallback callback);
+
+    VectorXd solve(const VectorXd &b);
+    VectorXd solveWithGuess(const VectorXd &b, const VectorXd &x0);
+
+    int iterations() const;
+    float error() const;
+    qint64 allocatedBytes() const;
+
+private:
+    // One grid of the hierarchy (row-major, with a 1px zero margin)
+    struct Level {
+        int width;
+        int height;
+        int last_col_extent;    // finest pixels covered by the last inner column
+        int last_row_extent;    // and row
+        QVector<uchar> mask;
+        QVector<float> diag;
+        QVector<float> x;
+        QVector<float> b;
+        QVector<float> r;
+    };
+
+    void smooth(Level &lvl, int sweeps);
+    void computeResidual(Level &lvl);
+    void restrictResidual(const Level &fine, Level &coarse);
+    void prolongateCorrection(const Level &coarse, Level &fine);
+    void cycle(int level, CycleType type);
+    void applyOperator(const QVector<float> &in, QVector<float> &out);
+    void applyPreconditioner(const QVector<float> &in, QVector<float> &out);
+    double dot(const QVector<float> &a, const QVector<float> &b);
+
+    QVector<Level> m_levels;
+    UnknownIndexMap m_index_map;
+
+    CycleType m_cycle_type;
+    float m_tolerance;
+    int m_max_iterations;
+
+    // Checked between the iterations (the solve stops early when it is set)
+    const QAtomicInt *m_cancel_flag;
+
+    // Called with the residual of each iteration
+    SolverProgressCallback m_progress_callback;
+
+    int m_iterations;
+    float m_error;
+
+    // Size of the work buffers (setup and last solve)
+    qint64 m_allocated_bytes;
+};
+
+#endif // MULTIGRIDSOLVER_H
@@ -1,6 +1,8 @@
 #include "pastedsourceitem.h"
 #include "transfercomputationunit.h"
 #include "blendingcomputationunit.h"
+#include "responsecomputationunit.h"
+#include "targetgraphicsscene.h"
 
 #include <QGraphicsSceneMouseEvent>
 #include <QPropertyAnimation>
@@ -17,12 +19,14 @@
 #define SELECTION_WIDTH 1.5
 #define DASH_SIZE       6.0
 #define ANIM_INTERVAL   250   // ms
+#define PROGRESS_COLOR  QColor(150, 190, 255, 160)
 
 
 PastedSourceItem::PastedSourceItem(
         QImage src_img,
         QPainterPath selection_path,
         QImage target_image,
+        SolverType solver_type,
         bool compute_transfer_data,
         QGraphicsItem *parent)
     : QGraphicsObject(parent)
@@ -30,9 +34,26 @@ PastedSourceItem::PastedSourceItem(
     // Blending settings
     m_is_real_time = true;
     m_is_mixed_blending = true;
+    m_is_live_preview = true;
+    m_solver_type = solver_type;
+    m_solver_tolerance = DEFAULT_SOLVER_TOLERANCE;
 
-    // Initialize the transfer job to nullptr
+    // No previous solution to warm start from
+    m_last_boundary_mean.setZero();
+
+    // Initialize the transfer, blending and response jobs to nullptr
     m_transfer_job = nullptr;
+    m_blending_job = nullptr;
+    m_response_job = nullptr;
+
+    // No blending requested yet
+    m_blending_generation = 0;
+    m_blending_pending = false;
+    m_blending_priority = PriorityBackground;
+    m_blending_progress = 0.0;
+
+    // No blending solved yet
+    m_blended_rect = QRect();
 
     // Save the link to target image
     m_target_image = target_image;
@@ -106,19 +127,40 @@ PastedSourceItem::PastedSourceItem(
         setComputing(true);
 
         // Create and configure the transfer computation unit
-        m_transfer_job = new TransferComputationUnit(m_orig_image, m_selection_path);
+        m_transfer_job = new TransferComputationUnit(m_orig_image, m_selection_path, m_solver_type);
 
         // Connect the transfer job signal
         connect(m_transfer_job, SIGNAL(computationFinished()), this, SLOT(transferFinished()));
 
-        // Send the transfer job to the computation handler
-        ComputationHandler::startComputationJob(m_transfer_job);
+        // Send the transfer job to the computation handler (the user waits for this item)
+        ComputationHandler::startComputationJob(m_transfer_job, PriorityInteractive);
     }
 }
 
 PastedSourceItem::~PastedSourceItem() {
     m_anim_timer->stop();
     delete m_anim_timer;
+
+    // Stop the jobs of the item and hand them to the scheduler (deleted now, or by their thread when they exit)
+    if (m_transfer_job) {
+        m_transfer_job->disconnect(this);
+        ComputationHandler::releaseComputationJob(m_transfer_job);
+        m_transfer_job = nullptr;
+    }
+
+    if (m_blending_job) {
+        m_blending_job->disconnect(this);
+        m_blending_job->cancel();
+        ComputationHandler::releaseComputationJob(m_blending_job);
+        m_blending_job = nullptr;
+    }
+
+    if (m_response_job) {
+        m_response_job->disconnect(this);
+        m_response_job->cancel();
+        ComputationHandler::releaseComputationJob(m_response_job);
+        m_response_job = nullptr;
+    }
 }
 
 
@@ -177,6 +219,15 @@ void PastedSourceItem::paint(QPainter *painter, const QStyleOptionGraphicsItem *
         painter->setPen(pen);
         painter->setBrush(QBrush(m_wait_anim_color));
         painter->drawPolygon(m_normalized_path.toFillPolygon());
+
+        // Solver progress: the selection is filled from left to right
+        if (m_blending_progress > 0.0) {
+            painter->save();
+            painter->setClipRect(QRectF(0, 0, m_blending_progress * m_orig_image.width(), m_orig_image.height()));
+            painter->setBrush(QBrush(PROGRESS_COLOR));
+            painter->drawPolygon(m_normalized_path.toFillPolygon());
+            painter->restore();
+        }
     }
     else if (isMoving()) {
         // Do nothing
@@ -235,13 +286,13 @@ QImage PastedSourceItem::originalImage() {
 }
 
 /**
- * @brief PastedSourceItem::originalMatrices
+ * @brief PastedSourceItem::originalPlanes
  * @return
  *
- * This function returns the original image in matrices format
+ * This function returns the original image in planar format
  */
-ImageMatricesRGB PastedSourceItem::originalMatrices() {
-    return m_orig_matrices;
+ImagePlanes PastedSourceItem::originalPlanes() {
+    return m_orig_planes;
 }
 
 /**
@@ -255,23 +306,23 @@ QImage PastedSourceItem::blendedImage() {
 }
 
 /**
- * @brief PastedSourceItem::masks
+ * @brief PastedSourceItem::mask
  * @return
  *
- * This function returns the masks used for this pasted source.
+ * This function returns the selection mask used for this pasted source.
  */
-SelectMaskMatrices PastedSourceItem::masks() {
-    return m_masks;
+SelectionMask PastedSourceItem::mask() {
+    return m_mask;
 }
 
 /**
- * @brief PastedSourceItem::laplacianMatrix
+ * @brief PastedSourceItem::indexMap
  * @return
  *
- * This function returns the sparse laplacian matrix
+ * This function returns the map between the masked pixels and the unknowns
  */
-SparseMatrixXd PastedSourceItem::laplacianMatrix() {
-    return m_laplacian_matrix;
+UnknownIndexMap PastedSourceItem::indexMap() {
+    return m_index_map;
 }
 
 /**
@@ -305,21 +356,21 @@ void PastedSourceItem::setSelected(bool s) {
  * This function updates the control policy of the item.
  */
 void PastedSourceItem::updateItemControls() {
-    // If blending computation is running
-    if (isComputing()) {
+    // If transfer computation is running (nothing can be blended yet)
+    if (m_transfer_job) {
         // This item becomes fixed
         setFlag(QGraphicsItem::ItemIsMovable, false);
 
         // The cursor is now the loading cursor
         setCursor(Qt::WaitCursor);
     }
-    // If it has been selected
+    // If it has been selected (a running blending is superseded by a move)
     else if (isSelected()) {
         // This item becomes movable
         setFlag(QGraphicsItem::ItemIsMovable, true);
 
-        // The cursor is now the move cursor
-        setCursor(Qt::SizeAllCursor);
+        // The cursor is now the move cursor (busy while blending)
+        setCursor(isComputing() ? Qt::BusyCursor : Qt::SizeAllCursor);
     }
     // If it has been unselected
     else {
@@ -386,6 +437,8 @@ void PastedSourceItem::setComputing(bool en) {
 
     updateItemControls();
     update();
+
+    emit computingChanged(en);
 }
 
 /**
@@ -426,6 +479,72 @@ bool PastedSourceItem::isMixedBlending() {
  */
 void PastedSourceItem::setMixedBlending(bool en) {
     m_is_mixed_blending = en;
+
+    // The plain blending may now use the boundary response
+    startResponseComputation();
+}
+
+/**
+ * @brief PastedSourceItem::isLivePreview
+ * @return
+ *
+ * This function returns true if the blending is previewed while the item is moved
+ */
+bool PastedSourceItem::isLivePreview() {
+    return m_is_live_preview;
+}
+
+/**
+ * @brief PastedSourceItem::setLivePreview
+ * @param en
+ *
+ * This function enables/disables the live blending preview
+ */
+void PastedSourceItem::setLivePreview(bool en) {
+    m_is_live_preview = en;
+}
+
+/**
+ * @brief PastedSourceItem::solverType
+ * @return
+ *
+ * This function returns the linear solver used for the blending
+ */
+SolverType PastedSourceItem::solverType() {
+    return m_solver_type;
+}
+
+/**
+ * @brief PastedSourceItem::setSolverType
+ * @param type
+ *
+ * This function sets the linear solver used for the blending
+ */
+void PastedSourceItem::setSolverType(SolverType type) {
+    m_solver_type = type;
+
+    // The chosen solver may now be replaced by the boundary response
+    startResponseComputation();
+}
+
+/**
+ * @brief PastedSourceItem::solverTolerance
+ * @return
+ *
+ * This function returns the relative residual tolerance of the iterative solvers
+ */
+float PastedSourceItem::solverTolerance() {
+    return m_solver_tolerance;
+}
+
+/**
+ * @brief PastedSourceItem::setSolverTolerance
+ * @param tolerance
+ *
+ * This function sets the relative residual tolerance of the iterative solvers
+ */
+void PastedSourceItem::setSolverTolerance(float tolerance) {
+    m_solver_tolerance = tolerance;
 }
 
 /**
@@ -452,49 +571,270 @@ void PastedSourceItem::setWaitAnimColor(QColor color) {
     update();
 }
 
+/**
+ * @brief PastedSourceItem::updateLivePreview
+ *
+ * This function shows the mean-value cloning of the item at its current position.
+ * It approximates the Poisson blending fast enough to follow the mouse moves.
+ */
+void PastedSourceItem::updateLivePreview() {
+    // The mean-value weights are only computed for the items which are dragged with the preview
+    if (m_mvc_cloner.isNull()) {
+        m_mvc_cloner = MeanValueClonerPtr(new MeanValueCloner(m_selection_path, m_orig_planes, m_index_map));
+    }
+
+    // Target under the item (composite of the layers beneath it)
+    QRect target_rect = layerRect();
+    QImage target = compositeTarget(&target_rect);
+
+    m_pixmap = QPixmap::fromImage(m_mvc_cloner->blend(target, target_rect.topLeft()));
+    update();
+}
+
+/**
+ * @brief PastedSourceItem::compositeTarget
+ * @param rect
+ * @return
+ *
+ * This function returns the image this item is blended against: the base target, or the
+ * composite of the layers beneath it when some of them overlap rect. In the latter case,
+ * the image only covers rect, which is moved to (0,0).
+ */
+QImage PastedSourceItem::compositeTarget(QRect *rect) {
+    TargetGraphicsScene *target_scene = qobject_cast<TargetGraphicsScene*>(scene());
+
+    if (!target_scene)
+        return m_target_image;
+
+    return target_scene->compositeBelow(this, m_target_image, rect);
+}
+
+/**
+ * @brief PastedSourceItem::layerRect
+ * @return
+ *
+ * This function returns the target pixels covered by this item at its current position
+ */
+QRect PastedSourceItem::layerRect() const {
+    return QRect(pos().toPoint(), boundingRect().size().toSize());
+}
+
+/**
+ * @brief PastedSourceItem::blendedRect
+ * @return
+ *
+ * This function returns the target pixels covered by the last valid blending of this item
+ * (null if it has never been blended)
+ */
+QRect PastedSourceItem::blendedRect() const {
+    return m_blended_rect;
+}
+
 /**
  * @brief PastedSourceItem::startBlendingComputation
+ * @param priority
  *
- * This function starts a new blending job (threaded)
+ * This function starts a new blending job (threaded).
+ * The blending of a selected item is always interactive.
  */
-void PastedSourceItem::startBlendingComputation() {
-    // Check if a blending job is already running
-    if (m_blending_unit_list.size() > 0)
+void PastedSourceItem::startBlendingComputation(JobPriority priority) {
+    // Nothing can be blended before the transfer data is computed
+    if (m_transfer_job)
         return;
 
+    // This request supersedes all the previous ones (latest wins)
+    m_blending_generation++;
+    m_blending_priority = isSelected() ? PriorityInteractive : priority;
+
     // Enable computing state
     setComputing(true);
 
-    // Get the interesting part of the target image
-    QRect copy_rect(pos().toPoint(), boundingRect().size().toSize());
-    QImage target_image_part = m_target_image.copy(copy_rect);
+    // Check if a blending job is already queued or running
+    if (m_blending_job) {
+        // A queued job has not started yet: it is simply replaced
+        if (ComputationHandler::cancelComputationJob(m_blending_job)) {
+            delete m_blending_job;
+            m_blending_job = nullptr;
+        }
+        // A running job is interrupted, this request starts when it exits (see blendingFinished)
+        else {
+            m_blending_job->cancel();
+            m_blending_pending = true;
+            return;
+        }
+    }
 
-    // For each color channel
-    for (int i = 0 ; i < 3 ; i++) {
-        // Create the computation unit
-        BlendingComputationUnit *bcu = new BlendingComputationUnit(
-                    i,
-                    target_image_part,
-                    m_orig_matrices[i],
-                    m_masks,
-                    m_laplacian_matrix,
-                    m_is_mixed_blending);
+    startBlendingJob();
+}
 
-        // Connect the computation unit to the slot
-        connect(bcu, SIGNAL(computationFinished()), this, SLOT(blendingFinished()));
+/**
+ * @brief PastedSourceItem::startBlendingJob
+ *
+ * This function creates the blending job of the current request and sends it to the thread pool
+ */
+void PastedSourceItem::startBlendingJob() {
+    // Interesting part of the target image (the job only takes a window of the whole target),
+    // made of the base target and the layers beneath this item
+    QRect target_rect = layerRect();
+    QImage target = compositeTarget(&target_rect);
+
+    // Create the computation unit (the 3 color channels are solved together)
+    m_blending_job = new BlendingComputationUnit(
+                target,
+                target_rect,
+                m_orig_planes,
+                m_guidance,
+                m_index_map,
+                m_components,
+                m_laplacian_factorization,
+                m_dd_solvers,
+                m_boundary_response,
+                m_is_mixed_blending,
+                m_solver_type,
+                m_solver_tolerance,
+                m_last_solution,
+                m_last_boundary_mean);
+
+    m_blending_job->setGeneration(m_blending_generation);
+
+    // No progress reported yet
+    m_blending_progress = 0.0;
+
+    // Connect the computation unit to the slots
+    connect(m_blending_job, SIGNAL(computationFinished()), this, SLOT(blendingFinished()));
+    connect(m_blending_job, SIGNAL(progressChanged(int,float,float)), this, SLOT(blendingProgress(int,float,float)));
+
+    //Add the computation unit to the thread pool queue
+    ComputationHandler::startComputationJob(m_blending_job, m_blending_priority);
+}
 
-        // Lock the blending unit list
-        m_blending_mutex.lock();
+/**
+ * @brief PastedSourceItem::cancelBlendingComputation
+ *
+ * This function drops the current blending request (the item is moved again).
+ * The running job stops at its next solver iteration, its result is ignored.
+ */
+void PastedSourceItem::cancelBlendingComputation() {
+    // Any job still in flight is now outdated
+    m_blending_generation++;
+    m_blending_pending = false;
+
+    if (m_blending_job) {
+        if (ComputationHandler::cancelComputationJob(m_blending_job)) {
+            delete m_blending_job;
+            m_blending_job = nullptr;
+        }
+        else {
+            m_blending_job->cancel();
+        }
+    }
 
-        // Add this computation unit to the control list
-        m_blending_unit_list.append(bcu);
+    // Exit the computing state (not while the transfer data is computed)
+    if (isComputing() && !m_transfer_job) {
+        setComputing(false);
+    }
+}
+
+
+/**
+ * @brief PastedSourceItem::targetImage
+ * @return
+ *
+ * This function returns the whole target image this item is pasted on
+ */
+QImage PastedSourceItem::targetImage() {
+    return m_target_image;
+}
+
+/**
+ * @brief PastedSourceItem::startJointBlending
+ *
+ * This function drops the own blending request of this item: it is blended with the other
+ * layers by a job of the scene, and stays in the computing state until finishJointBlending().
+ */
+void PastedSourceItem::startJointBlending() {
+    cancelBlendingComputation();
 
-        // Unlock the blending unit list
-        m_blending_mutex.unlock();
+    setComputing(true);
+}
+
+/**
+ * @brief PastedSourceItem::finishJointBlending
+ * @param blended_image
+ * @param report
+ *
+ * This function shows the blending of this item computed by the joint job of the scene.
+ * A null image means that the joint blending has been cancelled or that this item has moved
+ * since it started. The result is ignored if the item has requested its own blending meanwhile.
+ */
+void PastedSourceItem::finishJointBlending(QImage blended_image, QString report) {
+    if (m_blending_job || !isComputing())
+        return;
+
+    if (!blended_image.isNull()) {
+        m_blended_image = blended_image;
+        m_pixmap = QPixmap::fromImage(m_blended_image);
+        m_blended_rect = layerRect();
 
-        //Add the computation unit to the thread pool queue
-        ComputationHandler::startComputationJob(bcu);
+        // Solver report of the joint system
+        setToolTip(report);
+
+        // The result is now valid (the layers above are blended by the same job)
+        m_is_invalid = false;
     }
+
+    // Exit the computing state
+    setComputing(false);
+}
+
+/**
+ * @brief PastedSourceItem::canUseBoundaryResponse
+ * @return
+ *
+ * This function returns true if the blending job would use the boundary response with the
+ * current settings (see BlendingComputationUnit::computeBlendingData): plain blending only,
+ * and not instead of the Cholesky substitutions when the factorization is already cached.
+ */
+bool PastedSourceItem::canUseBoundaryResponse() {
+    if (m_is_mixed_blending)
+        return false;
+
+    // Full rectangles are always solved in closed form
+    if (ComputationHandler::isFullRectangle(m_index_map))
+        return true;
+
+    return !(m_solver_type == SolverCholesky && !m_laplacian_factorization.isNull());
+}
+
+/**
+ * @brief PastedSourceItem::startResponseComputation
+ *
+ * This function starts the computation of the boundary response (threaded),
+ * if the blending can use it and if it fits in the memory budget.
+ */
+void PastedSourceItem::startResponseComputation() {
+    // Nothing to precompute before the transfer data
+    if (m_transfer_job || m_guidance.isNull())
+        return;
+
+    // Check if the response is already computed or running
+    if (!m_boundary_response.isNull() || m_response_job)
+        return;
+
+    if (!canUseBoundaryResponse())
+        return;
+
+    if (!BoundaryResponse::isWithinBudget(m_index_map))
+        return;
+
+    // Create the computation unit
+    m_response_job = new ResponseComputationUnit(m_guidance, m_index_map, m_laplacian_factorization);
+
+    // Connect the computation unit to the slot
+    connect(m_response_job, SIGNAL(computationFinished()), this, SLOT(responseFinished()));
+
+    // Add the computation unit to the thread pool queue (precomputation for the next blendings)
+    ComputationHandler::startComputationJob(m_response_job, PriorityBatch);
 }
 
 
@@ -506,10 +846,16 @@ void PastedSourceItem::startBlendingComputation() {
  */
 void PastedSourceItem::transferFinished() {
     // Retreive the computation results
-    m_orig_matrices     = m_transfer_job->getOriginalMatrices();
-    m_masks             = m_transfer_job->getMasks();
+    m_orig_planes       = m_transfer_job->getOriginalPlanes();
+    m_mask              = m_transfer_job->getMask();
+    m_index_map         = m_transfer_job->getIndexMap();
+    m_components        = m_transfer_job->getComponents();
+    m_guidance          = m_transfer_job->getGuidanceField();
     m_orig_image_masked = m_transfer_job->getOriginalImageMasked();
-    m_laplacian_matrix  = m_transfer_job->getLaplacian();
+    m_laplacian_factorization = m_transfer_job->getFactorization();
+
+    // The preview weights of the previous selection are rebuilt on the next drag
+    m_mvc_cloner.clear();
 
     // Update the current pixmap with the original masked image
     m_pixmap = QPixmap::fromImage(m_orig_image_masked);
@@ -520,57 +866,119 @@ void PastedSourceItem::transferFinished() {
 
     // Set computing as finished
     setComputing(false);
+
+    // Precompute the boundary response in the background
+    startResponseComputation();
+}
+
+
+/**
+ * @brief PastedSourceItem::responseFinished
+ *
+ * This slot is called by the response computation unit when
+ * the computation is finished
+ */
+void PastedSourceItem::responseFinished() {
+    // If there is no running job -> abort
+    if (!m_response_job)
+        return;
+
+    // The next plain blendings are a dense product
+    m_boundary_response = m_response_job->getResponse();
+
+    // Delete the computation unit
+    delete m_response_job;
+    m_response_job = nullptr;
 }
 
 
+/**
+ * @brief PastedSourceItem::blendingProgress
+ * @param iterations
+ * @param error
+ * @param progress
+ *
+ * This slot is called periodically by the running blending job
+ */
+void PastedSourceItem::blendingProgress(int iterations, float error, float progress) {
+    Q_UNUSED(iterations);
+    Q_UNUSED(error);
+
+    // Ignore the reports of the superseded jobs
+    if (!m_blending_job || sender() != m_blending_job || m_blending_job->isCancelled())
+        return;
+
+    m_blending_progress = progress;
+    update();
+}
+
 /**
  * @brief PastedSourceItem::blendingFinished
  *
- * This slot is called by the blending computation units when
+ * This slot is called by the blending computation unit when
  * the computation is finished
  */
 void PastedSourceItem::blendingFinished() {
-    // Retrive the sender of the computationFinished signal
-    BlendingComputationUnit *bcu = qobject_cast<BlendingComputationUnit*> (sender());
-
-    // If the sender was not found -> abort
-    if (!bcu)
+    // If there is no running job -> abort
+    if (!m_blending_job)
         return;
 
-    // Thead-lock this section
-    m_blending_mutex.lock();
+    // Keep the factorization if it has been computed by the blending job (whatever the request)
+    if (m_laplacian_factorization.isNull()) {
+        m_laplacian_factorization = m_blending_job->getFactorization();
+    }
 
-    // Retreive the computation unit's channel number
-    int channel = bcu->getChannelNumber();
+    // Same for the domain decomposition solvers (the next job only starts once this one has exited)
+    m_dd_solvers = m_blending_job->getDomainDecompositionSolvers();
 
-    // Save the blended matrix for this channel
-    m_blended_matrices[channel] = bcu->getBlendedChannel();
+    // The job has been superseded by a newer request -> drop its result
+    if (m_blending_job->isCancelled() || m_blending_job->generation() != m_blending_generation) {
+        delete m_blending_job;
+        m_blending_job = nullptr;
 
-    // Remove this computation unit from the list
-    m_blending_unit_list.removeAll(bcu);
+        // Start the latest request, which was waiting for this job to exit
+        if (m_blending_pending) {
+            m_blending_pending = false;
+            startBlendingJob();
+        }
 
-    // Check if the blending if finished for all channels
-    if (m_blending_unit_list.size() == 0) {
-        // BLENDING FINISHED ! //
+        return;
+    }
 
-        // Convert the blended matrices to a QImage
-        m_blended_image = ComputationHandler::matricesToImage(m_blended_matrices, m_masks.positive_mask);
+    // Save the blended image
+    m_blended_image = m_blending_job->getBlendedImage();
 
-        // Update the graphics
-        m_pixmap = QPixmap::fromImage(m_blended_image);
+    // Keep the solution to warm start the next blending
+    m_last_solution = m_blending_job->getSolution();
+    m_last_boundary_mean = m_blending_job->getBoundaryMean();
 
-        // Exit the computing state
-        setComputing(false);
+    // Report the convergence of the solver (tooltip of the item and status bar)
+    const QString report = QString("%1 unknowns, %2")
+            .arg(m_index_map.pixels.size())
+            .arg(ComputationHandler::solveStatsText(m_blending_job->getSolveStats()));
 
-        // The result is now valid
-        m_is_invalid = false;
-    }
+    setToolTip(report);
+    emit blendingSolved(report);
+
+    // Update the graphics
+    m_pixmap = QPixmap::fromImage(m_blended_image);
+
+    // The layers above this one are blended against the new result
+    const QRect previous_rect = m_blended_rect;
+    m_blended_rect = layerRect();
 
     // Delete the computation unit
-    delete bcu;
+    delete m_blending_job;
+    m_blending_job = nullptr;
 
-    // Unlock this section
-    m_blending_mutex.unlock();
+    // The result is now valid
+    m_is_invalid = false;
+
+    // The layers above are marked first: they wait until this item exits the computing state
+    emit blendingUpdated(previous_rect);
+
+    // Exit the computing state
+    setComputing(false);
 }
 
 
@@ -589,9 +997,17 @@ void PastedSourceItem::mouseMoveEvent(QGraphicsSceneMouseEvent *event) {
     if (!isMoving() && isSelected() && flags() & QGraphicsItem::ItemIsMovable) {
         m_is_moving = true;
 
+        // The blending at the previous position is not needed anymore
+        cancelBlendingComputation();
+
         // Mark the computed blending as invalid
         invalidateBlending();
     }
+
+    // Show the approximated blending at the new position
+    if (isMoving() && m_is_live_preview) {
+        updateLivePreview();
+    }
 }
 
 void PastedSourceItem::mouseReleaseEvent(QGraphicsSceneMouseEvent *event) {
@@ -662,14 +1078,24 @@ QDataStream &operator>>(QDataStream &in, PastedSourceItem *&o) {
     in >> sel_path;
 
     // Initialize the object (don't compute transfer data)
-    o = new PastedSourceItem(src_img, sel_path, tgt_img, false);
+    o = new PastedSourceItem(src_img, sel_path, tgt_img, SolverCholesky, false);
     o->setPos(pos);
 
     in >> o->m_orig_image_masked;
-    in >> o->m_orig_matrices;
+    in >> o->m_orig_planes;
     in >> o->m_blended_image;
-    in >> o->m_masks;
-    in >> o->m_laplacian_matrix;
+    in >> o->m_mask;
+
+    // The laplacian is not stored anymore (implied by the mask), skip its slot
+    SparseMatrixXd laplacian_placeholder;
+    in >> laplacian_placeholder;
+
+    // The index map is not stored, rebuild it from the mask
+    o->m_index_map = ComputationHandler::maskToIndexMap(o->m_mask);
+    o->m_components = UnknownComponentsPtr(new QVector<UnknownComponent>(ComputationHandler::connectedComponents(o->m_index_map)));
+
+    // Neither is the guidance field, recompute it from the source planes
+    o->m_guidance = GuidanceFieldPtr(new MatrixX3d(ComputationHandler::computeGuidanceField(o->m_orig_planes, o->m_index_map)));
 
     in >> o->m_is_real_time;
     in >> o->m_is_mixed_blending;
@@ -688,6 +1114,9 @@ QDataStream &operator>>(QDataStream &in, PastedSourceItem *&o) {
     in >> is_selected;
     o->setSelected(is_selected);
 
+    // Precompute the boundary response in the background
+    o->startResponseComputation();
+
     return in;
 }
 
@@ -698,10 +1127,13 @@ QDataStream &operator<<(QDataStream &out, PastedSourceItem *o) {
     out << o->m_selection_path;
 
     out << o->m_orig_image_masked;
-    out << o->m_orig_matrices;
+    out << o->m_orig_planes;
     out << o->m_blended_image;
-    out << o->m_masks;
-    out << o->m_laplacian_matrix;
+    out << o->m_mask;
+
+    // The laplacian is not stored anymore, keep an empty slot (file compatibility)
+    SparseMatrixXd laplacian_placeholder;
+    out << laplacian_placeholder;
 
     out << o->m_is_real_time;
     out << o->m_is_mixed_blending;
@@ -1,12 +1,14 @@
 #ifndef PASTEDSOURCEITEM_H
 #define PASTEDSOURCEITEM_H
 
-#include <QMutex>
 #include <QImage>
 #include <QPainterPath>
 #include <QGraphicsObject>
 
 #include "computationhandler.h"
+#include "meanvaluecloner.h"
+#include "boundaryresponse.h"
+#include "domaindecompositionsolver.h"
 
 class QPropertyAnimation;
 
@@ -18,6 +20,7 @@ public:
     PastedSourceItem(QImage src_img,
                      QPainterPath selection_path,
                      QImage target_image,
+                     SolverType solver_type,
                      bool compute_transfer_data = true,
                      QGraphicsItem *parent = nullptr);
     ~PastedSourceItem();
@@ -34,9 +37,9 @@ public:
     QImage originalImageMasked();
     QImage blendedImage();
 
-    ImageMatricesRGB originalMatrices();
-    SelectMaskMatrices masks();
-    SparseMatrixXd laplacianMatrix();
+    ImagePlanes originalPlanes();
+    SelectionMask mask();
+    UnknownIndexMap indexMap();
 
     // Item control functions
     bool isMoving();
@@ -55,11 +58,37 @@ public:
     bool isMixedBlending();
     void setMixedBlending(bool en);
 
-    void startBlendingComputation();
+    bool isLivePreview();
+    void setLivePreview(bool en);
+
+    SolverType solverType();
+    void setSolverType(SolverType type);
+
+    float solverTolerance();
+    void setSolverTolerance(float tolerance);
+
+    void startBlendingComputation(JobPriority priority = PriorityBackground);
+
+    // Joint blending of all the layers (see TargetGraphicsScene::startJointBlending)
+    QImage targetImage();
+    void startJointBlending();
+    void finishJointBlending(QImage blended_image, QString report);
+
+    // Layer compositing (see TargetGraphicsScene::compositeBelow)
+    QRect layerRect() const;
+    QRect blendedRect() const;
+
+signals:
+    // A new blending is shown (previous_rect: where the former one was)
+    void blendingUpdated(QRect previous_rect);
+    void computingChanged(bool en);
+    void blendingSolved(QString report);
 
 public slots:
     void transferFinished();
     void blendingFinished();
+    void blendingProgress(int iterations, float error, float progress);
+    void responseFinished();
 
 protected:
     virtual void mousePressEvent(QGraphicsSceneMouseEvent *event) override;
@@ -77,19 +106,44 @@ private:
     QColor waitAnimColor();
     void setWaitAnimColor(QColor color);
 
+    void updateLivePreview();
+    bool canUseBoundaryResponse();
+    void startResponseComputation();
+    void startBlendingJob();
+    QImage compositeTarget(QRect *rect);
+    void cancelBlendingComputation();
+
     // Link to the whole target image
     QImage m_target_image;
 
     // Original/blended image data
     QImage m_orig_image;
     QImage m_orig_image_masked;
-    ImageMatricesRGB m_orig_matrices;
+    ImagePlanes m_orig_planes;
 
     QImage m_blended_image;
-    ImageMatricesRGB m_blended_matrices;
+    QRect m_blended_rect;
 
-    SelectMaskMatrices m_masks;
-    SparseMatrixXd m_laplacian_matrix;
+    // Last solution of the linear system (warm start of the iterative solvers)
+    MatrixX3d m_last_solution;
+    Eigen::RowVector3f m_last_boundary_mean;
+
+    SelectionMask m_mask;
+    UnknownIndexMap m_index_map;
+    UnknownComponentsPtr m_components;
+    LaplacianFactorizationPtr m_laplacian_factorization;
+
+    // Domain decomposition solvers (setup kept between the blendings, see BlendingComputationUnit)
+    QVector<DomainDecompositionSolverPtr> m_dd_solvers;
+
+    // Guidance field of the plain blending (position-invariant)
+    GuidanceFieldPtr m_guidance;
+
+    // Mean-value cloning of the live preview
+    MeanValueClonerPtr m_mvc_cloner;
+
+    // Precomputed boundary response (plain blending without sparse solve)
+    BoundaryResponsePtr m_boundary_response;
 
     // Graphics attributes
     QPixmap m_pixmap;
@@ -112,13 +166,22 @@ private:
     // Blending attributes
     bool m_is_real_time;
     bool m_is_mixed_blending;
+    bool m_is_live_preview;
+    SolverType m_solver_type;
+    float m_solver_tolerance;
 
     // Transfer computation attributes
     TransferComputationUnit *m_transfer_job;
 
-    // Blending management attributes
-    QList<BlendingComputationUnit*> m_blending_unit_list;
-    QMutex m_blending_mutex;
+    // Blending computation attributes (only the latest request is solved)
+    BlendingComputationUnit *m_blending_job;
+    quint64 m_blending_generation;
+    bool m_blending_pending;
+    JobPriority m_blending_priority;
+    float m_blending_progress;
+
+    // Boundary response computation attributes
+    ResponseComputationUnit *m_response_job;
 
 
     // Operator overloaded to write objects from this class into a files
@@ -0,0 +1,47 @@
+#include "responsecomputationunit.h"
+
+ResponseComputationUnit::ResponseComputationUnit(
+        GuidanceFieldPtr guidance,
+        UnknownIndexMap index_map,
+        LaplacianFactorizationPtr factorization)
+    : QObject(), QRunnable()
+{
+    m_guidance = guidance;
+    m_index_map = index_map;
+    m_factorization = factorization;
+
+    setAutoDelete(false);
+}
+
+void ResponseComputationUnit::run() {
+    // Emit started signal
+    emit computationStarted();
+
+    // Compute the boundary response of the item
+    m_response = BoundaryResponsePtr(new BoundaryResponse(*m_guidance, m_index_map, m_factorization, &m_cancelled));
+
+    // An interrupted response is incomplete
+    if (isCancelled())
+        m_response.reset();
+
+    // Emit finished signal
+    emit computationFinished();
+}
+
+/**
+ * @brief ResponseComputationUnit::cancel
+ *
+ * This function asks the running job to stop (thread-safe).
+ * The response is then null.
+ */
+void ResponseComputationUnit::cancel() {
+    m_cancelled.storeRelease(1);
+}
+
+bool ResponseComputationUnit::isCancelled() const {
+    return m_cancelled.loadAcquire() != 0;
+}
+
+BoundaryResponsePtr ResponseComputationUnit::getResponse() {
+    return m_response;
+}
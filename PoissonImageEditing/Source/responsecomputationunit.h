@@ -0,0 +1,47 @@
+#ifndef RESPONSECOMPUTATIONUNIT_H
+#define RESPONSECOMPUTATIONUNIT_H
+
+#include <QAtomicInt>
+#include <QObject>
+#include <QRunnable>
+
+#include "computationhandler.h"
+#include "boundaryresponse.h"
+
+class ResponseComputationUnit : public QObject, public QRunnable
+{
+    Q_OBJECT
+
+public:
+    ResponseComputationUnit(
+            GuidanceFieldPtr guidance,
+            UnknownIndexMap index_map,
+            LaplacianFactorizationPtr factorization
+        );
+
+    void run() override;
+
+    // Cooperative cancellation (checked between the blocks of the response)
+    void cancel();
+    bool isCancelled() const;
+
+    BoundaryResponsePtr getResponse();
+
+signals:
+    void computationStarted();
+    void computationFinished();
+
+private:
+    // Input attributes
+    GuidanceFieldPtr m_guidance;
+    UnknownIndexMap m_index_map;
+    LaplacianFactorizationPtr m_factorization;
+
+    // Set by cancel(), read by the worker thread
+    QAtomicInt m_cancelled;
+
+    // Output attributes
+    BoundaryResponsePtr m_response;
+};
+
+#endif // RESPONSECOMPUTATIONUNIT_H
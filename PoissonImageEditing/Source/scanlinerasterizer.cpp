@@ -0,0 +1,141 @@
+#include "scanlinerasterizer.h"
+#include "computationhandler.h"
+
+#include <algorithm>
+#include <cmath>
+#include <utility>
+
+
+#define RASTER_BAND_HEIGHT          32          // Rows per parallel band
+#define RASTER_PARALLEL_MIN_PIXELS  (256*256)   // Smaller selections are rasterized serially
+
+
+ScanlineRasterizer::ScanlineRasterizer(const QPainterPath &path)
+{
+    m_fill_rule = path.fillRule();
+
+    // Flattened subpaths (each one is implicitly closed, like in QPainterPath::contains)
+    const QList<QPolygonF> polygons = path.toSubpathPolygons();
+
+    for (const QPolygonF &polygon : polygons) {
+        for (int i = 0 ; i < polygon.size() ; i++) {
+            QPointF p1 = polygon[i];
+            QPointF p2 = polygon[(i + 1) % polygon.size()];
+
+            // Horizontal edges never cross a scanline
+            if (qFuzzyCompare(p1.y(), p2.y()))
+                continue;
+
+            Edge edge;
+            edge.direction = 1;
+
+            if (p2.y() < p1.y()) {
+                std::swap(p1, p2);
+                edge.direction = -1;
+            }
+
+            edge.y_top = p1.y();
+            edge.y_bottom = p2.y();
+            edge.x_top = p1.x();
+            edge.slope = (p2.x() - p1.x()) / (p2.y() - p1.y());
+
+            m_edges.append(edge);
+        }
+    }
+
+    std::sort(m_edges.begin(), m_edges.end(), [](const Edge &a, const Edge &b) {
+        return a.y_top < b.y_top;
+    });
+}
+
+/**
+ * @brief ScanlineRasterizer::rasterize
+ * @param rect
+ * @return
+ *
+ * This function returns the mask of the path on the pixels of 'rect'.
+ * The pixel (x,y) of the mask is the point rect.topLeft() + (x,y).
+ */
+SelectionMask ScanlineRasterizer::rasterize(QRect rect) const {
+    QVector<QVector<SelectionMask::Span>> row_spans(rect.height());
+
+    // Spans of each row (the bands write distinct rows)
+    QVector<SelectionMask::Span> *spans = row_spans.data();
+
+    // Large selections: independent bands of rows
+    if (rect.width() * rect.height() >= RASTER_PARALLEL_MIN_PIXELS) {
+        const int band_count = (rect.height() + RASTER_BAND_HEIGHT - 1) / RASTER_BAND_HEIGHT;
+
+        ComputationHandler::parallelFor(band_count, [&](int band) {
+            const int first_row = band * RASTER_BAND_HEIGHT;
+            rasterizeRows(spans, rect, first_row, qMin(first_row + RASTER_BAND_HEIGHT, rect.height()));
+        });
+    }
+    else {
+        rasterizeRows(spans, rect, 0, rect.height());
+    }
+
+    return SelectionMask(rect.width(), rect.height(), row_spans);
+}
+
+/**
+ * @brief ScanlineRasterizer::rasterizeRows
+ * @param row_spans
+ * @param rect
+ * @param first_row
+ * @param end_row
+ *
+ * This function computes the inside spans of the rows [first_row, end_row), with an active edge table.
+ */
+void ScanlineRasterizer::rasterizeRows(QVector<SelectionMask::Span> *row_spans, QRect rect, int first_row, int end_row) const {
+    QVector<int> active;                        // Edges crossing the current scanline
+    QVector<std::pair<double,int>> crossings;   // (x, direction) on the current scanline
+
+    int next_edge = 0;
+
+    for (int row = first_row ; row < end_row ; row++) {
+        const double y = rect.top() + row;
+
+        // Activate the edges starting above the scanline
+        while (next_edge < m_edges.size() && m_edges[next_edge].y_top <= y) {
+            active.append(next_edge);
+            next_edge++;
+        }
+
+        // Retire the edges ending above the scanline (half-open in y)
+        active.erase(std::remove_if(active.begin(), active.end(), [&](int e) {
+            return m_edges[e].y_bottom <= y;
+        }), active.end());
+
+        if (active.isEmpty())
+            continue;
+
+        crossings.clear();
+
+        for (int e : active) {
+            const Edge &edge = m_edges[e];
+            crossings.append(std::make_pair(edge.x_top + edge.slope * (y - edge.y_top), edge.direction));
+        }
+
+        std::sort(crossings.begin(), crossings.end());
+
+        // The pixels in [crossing i, crossing i+1) have the winding number of the crossings 0..i
+        int winding = 0;
+
+        for (int i = 0 ; i < crossings.size() - 1 ; i++) {
+            winding += crossings[i].second;
+
+            const bool inside = (m_fill_rule == Qt::WindingFill) ? (winding != 0) : (winding % 2 != 0);
+
+            if (!inside)
+                continue;
+
+            const int x0 = qMax(0, (int) std::ceil(crossings[i].first - rect.left()));
+            const int x1 = qMin(rect.width(), (int) std::ceil(crossings[i+1].first - rect.left()));
+
+            if (x0 < x1) {
+                row_spans[row].append(SelectionMask::Span{x0, x1});
+            }
+        }
+    }
+}
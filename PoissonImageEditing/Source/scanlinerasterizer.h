@@ -0,0 +1,46 @@
+#ifndef SCANLINERASTERIZER_H
+#define SCANLINERASTERIZER_H
+
+#include <QPainterPath>
+#include <QRect>
+#include <QVector>
+
+#include "selectionmask.h"
+
+/*
+ * Scanline rasterizer of a selection path (active edge table).
+ *
+ * The path is flattened into polygon edges once. Each row of pixels then only
+ * intersects the edges crossing it, and the crossings sorted along the row give the
+ * inside spans directly (instead of a point-in-path test per pixel), which are also
+ * the storage of the mask.
+ *
+ * The inside/outside rule is the one of QPainterPath::contains(): the edges are
+ * half-open in y, a crossing counts for the pixels at its right (or on it), and the
+ * winding number is tested with the fill rule of the path.
+ */
+class ScanlineRasterizer
+{
+public:
+    ScanlineRasterizer(const QPainterPath &path);
+
+    SelectionMask rasterize(QRect rect) const;
+
+private:
+    // Polygon edge, oriented downwards (y_top < y_bottom)
+    struct Edge {
+        double y_top;
+        double y_bottom;
+        double x_top;
+        double slope;       // dx/dy
+        int direction;      // +1 if the original edge goes downwards, -1 otherwise
+    };
+
+    void rasterizeRows(QVector<SelectionMask::Span> *row_spans, QRect rect, int first_row, int end_row) const;
+
+    // Edges sorted by y_top
+    QVector<Edge> m_edges;
+    Qt::FillRule m_fill_rule;
+};
+
+#endif // SCANLINERASTERIZER_H
@@ -0,0 +1,225 @@
+#include "selectionmask.h"
+
+#include <algorithm>
+#include <vector>
+
+
+// First value of a serialized mask (the former format starts with a row count instead)
+#define SELECTION_MASK_STREAM_TAG   (-1)
+
+
+SelectionMask::SelectionMask()
+{
+    m_width = 0;
+    m_height = 0;
+    m_pixel_count = 0;
+    m_words_per_row = 0;
+}
+
+/**
+ * @brief SelectionMask::SelectionMask
+ * @param width
+ * @param height
+ * @param row_spans
+ *
+ * Builds the mask from the inside spans of each row (height rows).
+ * The spans of a row may be unsorted, overlapping or touching: they are sorted, merged
+ * and clipped to [0, width).
+ */
+SelectionMask::SelectionMask(int width, int height, const QVector<QVector<Span>> &row_spans)
+{
+    m_width = width;
+    m_height = height;
+    m_pixel_count = 0;
+    m_words_per_row = (width + 63) / 64;
+
+    m_row_offsets.resize(height + 1);
+    m_bits.fill(0, m_words_per_row * height);
+
+    for (int y = 0 ; y < height ; y++) {
+        m_row_offsets[y] = m_spans.size();
+
+        QVector<Span> spans = row_spans.value(y);
+
+        std::sort(spans.begin(), spans.end(), [](const Span &a, const Span &b) {
+            return a.x_begin < b.x_begin;
+        });
+
+        for (const Span &span : spans) {
+            const int x_begin = qMax(0, span.x_begin);
+            const int x_end = qMin(width, span.x_end);
+
+            if (x_begin >= x_end)
+                continue;
+
+            // Merge with the previous span of the row if they touch
+            if (m_spans.size() > m_row_offsets[y] && m_spans.last().x_end >= x_begin) {
+                m_spans.last().x_end = qMax(m_spans.last().x_end, x_end);
+            }
+            else {
+                m_spans.append(Span{x_begin, x_end});
+            }
+        }
+
+        // Bit-plane and pixel count of the row
+        quint64 *bits = m_bits.data() + y * m_words_per_row;
+
+        for (int s = m_row_offsets[y] ; s < m_spans.size() ; s++) {
+            for (int x = m_spans[s].x_begin ; x < m_spans[s].x_end ; x++) {
+                bits[x >> 6] |= quint64(1) << (x & 63);
+            }
+
+            m_pixel_count += m_spans[s].x_end - m_spans[s].x_begin;
+        }
+    }
+
+    m_row_offsets[height] = m_spans.size();
+}
+
+bool SelectionMask::isNull() const {
+    return m_width == 0 || m_height == 0;
+}
+
+int SelectionMask::width() const {
+    return m_width;
+}
+
+int SelectionMask::height() const {
+    return m_height;
+}
+
+int SelectionMask::pixelCount() const {
+    return m_pixel_count;
+}
+
+int SelectionMask::spanCount(int y) const {
+    return m_row_offsets[y+1] - m_row_offsets[y];
+}
+
+const SelectionMask::Span *SelectionMask::rowSpans(int y) const {
+    return m_spans.constData() + m_row_offsets[y];
+}
+
+/**
+ * @brief SelectionMask::contains
+ * @param x
+ * @param y
+ * @return
+ *
+ * This function returns true if the pixel (x,y) is inside the mask (false out of its bounds).
+ */
+bool SelectionMask::contains(int x, int y) const {
+    if (x < 0 || y < 0 || x >= m_width || y >= m_height)
+        return false;
+
+    return (m_bits[y * m_words_per_row + (x >> 6)] >> (x & 63)) & 1;
+}
+
+/**
+ * @brief SelectionMask::clipped
+ * @param rect
+ * @return
+ *
+ * This function returns the mask restricted to the pixels of rect (same dimensions).
+ */
+SelectionMask SelectionMask::clipped(QRect rect) const {
+    QVector<QVector<Span>> row_spans(m_height);
+
+    for (int y = qMax(0, rect.top()) ; y <= qMin(m_height - 1, rect.bottom()) ; y++) {
+        const Span *spans = rowSpans(y);
+
+        for (int s = 0 ; s < spanCount(y) ; s++) {
+            row_spans[y].append(Span{qMax(spans[s].x_begin, rect.left()), qMin(spans[s].x_end, rect.right() + 1)});
+        }
+    }
+
+    return SelectionMask(m_width, m_height, row_spans);
+}
+
+
+/*
+ * Serialization: the spans only (the bit-plane is rebuilt)
+ */
+
+QDataStream &operator>>(QDataStream &in, SelectionMask &p) {
+    // Eigen::Index values are serialized on 64 bits (see computationhandler.cpp)
+    qint64 tag;
+    in >> tag;
+
+    if (tag == SELECTION_MASK_STREAM_TAG) {
+        qint32 width, height;
+        in >> width;
+        in >> height;
+
+        QVector<QVector<SelectionMask::Span>> row_spans(height);
+
+        for (int y = 0 ; y < height ; y++) {
+            qint32 count;
+            in >> count;
+
+            for (int s = 0 ; s < count ; s++) {
+                qint32 x_begin, x_end;
+                in >> x_begin;
+                in >> x_end;
+
+                row_spans[y].append(SelectionMask::Span{x_begin, x_end});
+            }
+        }
+
+        p = SelectionMask(width, height, row_spans);
+    }
+    else {
+        // Former format: positive then negative column-major float matrices
+        qint64 rows = tag, cols;
+        in >> cols;
+
+        std::vector<float> values(rows * cols);
+        in.readRawData((char*) values.data(), values.size() * sizeof(float));
+
+        QVector<QVector<SelectionMask::Span>> row_spans(rows);
+
+        for (int y = 0 ; y < rows ; y++) {
+            for (int x = 0 ; x < cols ; x++) {
+                if (values[x * rows + y] == 0.0)
+                    continue;
+
+                // Extend the last span of the row, or start a new one
+                if (!row_spans[y].isEmpty() && row_spans[y].last().x_end == x) {
+                    row_spans[y].last().x_end++;
+                }
+                else {
+                    row_spans[y].append(SelectionMask::Span{x, x + 1});
+                }
+            }
+        }
+
+        p = SelectionMask(cols, rows, row_spans);
+
+        // The negative mask is implied
+        qint64 neg_rows, neg_cols;
+        in >> neg_rows;
+        in >> neg_cols;
+        in.skipRawData(neg_rows * neg_cols * sizeof(float));
+    }
+
+    return in;
+}
+
+QDataStream &operator<<(QDataStream &out, const SelectionMask &p) {
+    out << (qint64) SELECTION_MASK_STREAM_TAG;
+    out << (qint32) p.m_width;
+    out << (qint32) p.m_height;
+
+    for (int y = 0 ; y < p.m_height ; y++) {
+        const SelectionMask::Span *spans = p.rowSpans(y);
+
+        out << (qint32) p.spanCount(y);
+
+        for (int s = 0 ; s < p.spanCount(y) ; s++) {
+            out << (qint32) spans[s].x_begin;
+            out << (qint32) spans[s].x_end;
+        }
+    }
+
+    return out;
+}
@@ -0,0 +1,64 @@
+#ifndef SELECTIONMASK_H
+#define SELECTIONMASK_H
+
+#include <QDataStream>
+#include <QRect>
+#include <QVector>
+
+/*
+ * Binary mask of a selection (inside / outside pixels).
+ *
+ * The inside pixels are stored twice, in compact forms:
+ *  - as horizontal spans on each row, sorted by x (the kernels walk the inside pixels
+ *    span by span, in the row-major order of the unknowns)
+ *  - as a bit-plane, for the random "is this neighbor inside" tests
+ *
+ * The data is implicitly shared (QVector), so copying a mask is cheap.
+ */
+class SelectionMask
+{
+public:
+    // Inside pixels [x_begin, x_end) of a row
+    struct Span {
+        int x_begin;
+        int x_end;
+    };
+
+    SelectionMask();
+    SelectionMask(int width, int height, const QVector<QVector<Span>> &row_spans);
+
+    bool isNull() const;
+
+    int width() const;
+    int height() const;
+    int pixelCount() const;
+
+    int spanCount(int y) const;
+    const Span *rowSpans(int y) const;
+
+    bool contains(int x, int y) const;
+
+    SelectionMask clipped(QRect rect) const;
+
+private:
+    friend QDataStream &operator>>(QDataStream &in, SelectionMask &p);
+    friend QDataStream &operator<<(QDataStream &out, const SelectionMask &p);
+
+    int m_width;
+    int m_height;
+    int m_pixel_count;
+
+    // Spans of all the rows, the ones of row y start at m_row_offsets[y]
+    QVector<Span> m_spans;
+    QVector<int> m_row_offsets;
+
+    // One bit per pixel, each row starts on a new word
+    QVector<quint64> m_bits;
+    int m_words_per_row;
+};
+
+// Also reads the former format of the masks (two float matrices)
+QDataStream &operator>>(QDataStream &in, SelectionMask &p);
+QDataStream &operator<<(QDataStream &out, const SelectionMask &p);
+
+#endif // SELECTIONMASK_H
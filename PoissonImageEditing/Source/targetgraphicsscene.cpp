@@ -1,15 +1,27 @@
 #include "targetgraphicsscene.h"
 #include "pastedsourceitem.h"
+#include "jointblendingcomputationunit.h"
 
 #include <QKeyEvent>
 #include <QMessageBox>
+#include <QPainter>
 
 TargetGraphicsScene::TargetGraphicsScene(QObject *parent) : QGraphicsScene(parent)
 {
-
+    m_joint_solve = false;
+    m_joint_job = nullptr;
+    m_joint_pending = false;
 }
 
 TargetGraphicsScene::~TargetGraphicsScene() {
+    // Stop the joint blending and hand it to the scheduler (deleted now, or by its thread when it exits)
+    if (m_joint_job) {
+        m_joint_job->disconnect(this);
+        m_joint_job->cancel();
+        ComputationHandler::releaseComputationJob(m_joint_job);
+        m_joint_job = nullptr;
+    }
+
     // Remove and delete all pasted items
     foreach (PastedSourceItem *item, m_source_item_list) {
         removeItem(item);
@@ -48,6 +60,13 @@ void TargetGraphicsScene::addSourceItem(PastedSourceItem *src_item, bool place_c
     // Add the item to the scene
     addItem(src_item);
 
+    // The layers above an item are blended again when its blending changes
+    connect(src_item, SIGNAL(blendingUpdated(QRect)), this, SLOT(layerBlendingUpdated(QRect)));
+    connect(src_item, SIGNAL(computingChanged(bool)), this, SLOT(layerComputingChanged(bool)));
+
+    // The solver reports of the layers are shown by the main window
+    connect(src_item, SIGNAL(blendingSolved(QString)), this, SIGNAL(blendingSolved(QString)));
+
     if (place_center) {
         // Place the item on the center of the target
         src_item->setPos(QPointF(sceneRect().width()/2 - src_item->boundingRect().width()/2,
@@ -85,6 +104,187 @@ bool TargetGraphicsScene::isRectangleInsertable(QRectF rect) {
     return scene_rect_cmp.contains(rect);
 }
 
+/**
+ * @brief TargetGraphicsScene::compositeBelow
+ * @param item
+ * @param base
+ * @param rect
+ * @return
+ *
+ * This function returns the image an item is blended against: the base target with the
+ * valid blendings of the layers beneath the item painted over it.
+ * If none of them overlaps rect, the base target itself is returned. Otherwise, the
+ * composite only covers rect, which is moved to (0,0).
+ */
+QImage TargetGraphicsScene::compositeBelow(PastedSourceItem *item, QImage base, QRect *rect) {
+    const int index = m_source_item_list.indexOf(item);
+
+    // Layers beneath the item that overlap the rect
+    QList<PastedSourceItem*> layers;
+
+    for (int i = 0 ; i < index ; i++) {
+        PastedSourceItem *below = m_source_item_list[i];
+
+        if (!below->isInvalid() && below->blendedRect().intersects(*rect)) {
+            layers.append(below);
+        }
+    }
+
+    if (layers.isEmpty())
+        return base;
+
+    // Paint them from bottom to top over the part of the base target
+    QImage composite = base.copy(*rect);
+    QPainter painter(&composite);
+
+    foreach (PastedSourceItem *below, layers) {
+        painter.drawImage(below->blendedRect().topLeft() - rect->topLeft(), below->blendedImage());
+    }
+
+    painter.end();
+
+    rect->moveTo(0, 0);
+
+    return composite;
+}
+
+/**
+ * @brief TargetGraphicsScene::markLayersAbove
+ * @param first
+ * @param changed_rect
+ * @param priority
+ *
+ * This function marks the layers from index first that depend on the changed part of the composite.
+ * A layer depends on the layers beneath it that overlap it (a directed acyclic graph in stacking
+ * order). A marked layer changes the composite too, so the layers above it are checked against it.
+ * Only the layers with a blending (valid or being computed) are marked.
+ */
+void TargetGraphicsScene::markLayersAbove(int first, QRect changed_rect, JobPriority priority) {
+    // Changed parts of the composite
+    QVector<QRect> changed_rects;
+    changed_rects.append(changed_rect);
+
+    for (int i = first ; i < m_source_item_list.size() ; i++) {
+        PastedSourceItem *layer = m_source_item_list[i];
+
+        if (layer->isInvalid() && !layer->isComputing())
+            continue;
+
+        const QRect layer_rect = layer->layerRect();
+        bool depends = false;
+
+        foreach (const QRect &rect, changed_rects) {
+            if (rect.intersects(layer_rect)) {
+                depends = true;
+                break;
+            }
+        }
+
+        if (!depends)
+            continue;
+
+        // Its blending will change where it was and where it is now
+        changed_rects.append(layer_rect.united(layer->blendedRect()));
+
+        // An already marked layer keeps its priority
+        if (!m_dirty_layers.contains(layer)) {
+            m_dirty_layers.insert(layer, priority);
+        }
+    }
+}
+
+/**
+ * @brief TargetGraphicsScene::scheduleDirtyLayers
+ *
+ * This function blends again the marked layers whose overlapping layers beneath are done
+ * (neither computing nor marked). The others wait for the next call.
+ */
+void TargetGraphicsScene::scheduleDirtyLayers() {
+    if (m_dirty_layers.isEmpty())
+        return;
+
+    for (int i = 0 ; i < m_source_item_list.size() ; i++) {
+        PastedSourceItem *layer = m_source_item_list[i];
+
+        if (!m_dirty_layers.contains(layer))
+            continue;
+
+        // Wait for the overlapping layers beneath
+        const QRect layer_rect = layer->layerRect();
+        bool ready = true;
+
+        for (int j = 0 ; j < i && ready ; j++) {
+            PastedSourceItem *below = m_source_item_list[j];
+
+            if ((below->isComputing() || m_dirty_layers.contains(below)) && below->layerRect().intersects(layer_rect)) {
+                ready = false;
+            }
+        }
+
+        if (!ready)
+            continue;
+
+        const JobPriority priority = m_dirty_layers.take(layer);
+
+        // Without real time blending, the layer is only marked as outdated
+        if (layer->isRealTime() || priority == PriorityBatch) {
+            layer->startBlendingComputation(priority);
+        }
+        else {
+            layer->invalidateBlending();
+            layer->update();
+        }
+    }
+}
+
+/**
+ * @brief TargetGraphicsScene::layerBlendingUpdated
+ * @param previous_rect
+ *
+ * This slot is called when a layer shows a new blending: the layers above
+ * that overlap its former or new place are blended again.
+ */
+void TargetGraphicsScene::layerBlendingUpdated(QRect previous_rect) {
+    PastedSourceItem *item = qobject_cast<PastedSourceItem*>(sender());
+
+    if (!item)
+        return;
+
+    markLayersAbove(m_source_item_list.indexOf(item) + 1, previous_rect.united(item->layerRect()), PriorityBackground);
+    scheduleDirtyLayers();
+}
+
+/**
+ * @brief TargetGraphicsScene::layerComputingChanged
+ * @param en
+ *
+ * This slot is called when a layer starts/stops computing: the layers waiting for it can start.
+ */
+void TargetGraphicsScene::layerComputingChanged(bool en) {
+    if (!en) {
+        scheduleDirtyLayers();
+    }
+}
+
+/**
+ * @brief TargetGraphicsScene::removeSourceItem
+ * @param item
+ *
+ * This function removes a pasted item from the scene and the list then deletes it.
+ * The layers above it are marked (they were blended against it).
+ */
+void TargetGraphicsScene::removeSourceItem(PastedSourceItem *item) {
+    const int index = m_source_item_list.indexOf(item);
+    const QRect changed_rect = item->blendedRect().united(item->layerRect());
+
+    m_dirty_layers.remove(item);
+    m_source_item_list.removeAll(item);
+    removeItem(item);
+    delete item;
+
+    markLayersAbove(index, changed_rect, PriorityBackground);
+}
+
 /**
  * @brief TargetGraphicsScene::removeSelectedSrcItem
  *
@@ -101,12 +301,13 @@ void TargetGraphicsScene::removeSelectedSrcItem() {
         // If the cast was successful -> this is a PastedSourceItem
         if (psi) {
             // Remove this item from the scene and the list then delete it
-            m_source_item_list.removeAll(psi);
-            removeItem(psi);
-            delete psi;
+            removeSourceItem(psi);
         }
     }
 
+    // Blend the layers that were above the removed ones
+    scheduleDirtyLayers();
+
     // Emit the sourceItemListChanged() signal
     emit sourceItemListChanged();
 }
@@ -125,6 +326,8 @@ void TargetGraphicsScene::removeAllSrcItem() {
         delete item;
     }
 
+    m_dirty_layers.clear();
+
     // Emit the sourceItemListChanged() signal
     emit sourceItemListChanged();
 }
@@ -154,13 +357,137 @@ void TargetGraphicsScene::recomputeBlendingSelected() {
 /**
  * @brief TargetGraphicsScene::recomputeBlendingAll
  *
- * This slot informs all the items to recompute its blending
+ * This slot informs all the items to recompute its blending, from bottom to top
+ * (or all at once in the joint solve mode)
  */
 void TargetGraphicsScene::recomputeBlendingAll() {
-    // Inform all items that are in the list
+    // All the layers in a single system
+    if (m_joint_solve) {
+        startJointBlending();
+        return;
+    }
+
+    // Mark all items that are in the list (bulk work, after the interactive and visible ones)
+    foreach (PastedSourceItem *item, m_source_item_list) {
+        m_dirty_layers.insert(item, PriorityBatch);
+    }
+
+    // Each layer is blended once the overlapping layers beneath it are done
+    scheduleDirtyLayers();
+}
+
+/**
+ * @brief TargetGraphicsScene::startJointBlending
+ *
+ * This function blends all the layers in a single Poisson system (threaded, bulk work).
+ * The layers stay in the computing state until the job is done. A running joint job is
+ * interrupted first: the new request starts when it exits (see jointBlendingFinished).
+ */
+void TargetGraphicsScene::startJointBlending() {
+    if (m_joint_job) {
+        if (ComputationHandler::cancelComputationJob(m_joint_job)) {
+            delete m_joint_job;
+            m_joint_job = nullptr;
+        }
+        else {
+            m_joint_job->cancel();
+            m_joint_pending = true;
+            return;
+        }
+    }
+
+    // The layers ready to be blended (transfer data computed), bottom first
+    QVector<JointBlendingComputationUnit::Layer> layers;
+    QImage target;
+    float solver_tolerance = DEFAULT_SOLVER_TOLERANCE;
+
+    m_joint_layers.clear();
+    m_joint_rects.clear();
+
     foreach (PastedSourceItem *item, m_source_item_list) {
-        // Inform the item to recompute its blending
-        item->startBlendingComputation();
+        if (item->indexMap().pixels.isEmpty())
+            continue;
+
+        JointBlendingComputationUnit::Layer layer;
+        layer.source = item->originalPlanes();
+        layer.index_map = item->indexMap();
+        layer.position = item->layerRect().topLeft();
+        layer.mixed_blending = item->isMixedBlending();
+        layer.blended_image = (!item->isInvalid() && item->blendedRect() == item->layerRect()) ? item->blendedImage() : QImage();
+
+        layers.append(layer);
+        target = item->targetImage();
+        solver_tolerance = qMin(solver_tolerance, item->solverTolerance());
+
+        m_joint_layers.append(item);
+        m_joint_rects.append(item->layerRect());
+    }
+
+    if (layers.isEmpty())
+        return;
+
+    // The layers are not blended one by one anymore
+    m_dirty_layers.clear();
+
+    foreach (PastedSourceItem *item, m_joint_layers) {
+        item->startJointBlending();
+    }
+
+    m_joint_job = new JointBlendingComputationUnit(target, layers, solver_tolerance);
+
+    connect(m_joint_job, SIGNAL(computationFinished()), this, SLOT(jointBlendingFinished()));
+
+    ComputationHandler::startComputationJob(m_joint_job, PriorityBatch);
+}
+
+/**
+ * @brief TargetGraphicsScene::jointBlendingFinished
+ *
+ * This slot is called when the joint job exits: each layer still at the place it was
+ * blended at gets its part of the solution.
+ */
+void TargetGraphicsScene::jointBlendingFinished() {
+    // If there is no running job -> abort
+    if (!m_joint_job)
+        return;
+
+    const QVector<QImage> blended_images = m_joint_job->getBlendedImages();
+    const bool solved = !m_joint_job->isCancelled() && blended_images.size() == m_joint_layers.size();
+
+    // Same report as the blending of a single layer (see PastedSourceItem::blendingFinished)
+    QString report;
+
+    if (solved) {
+        report = QString("Joint blending of %1 layers, %2")
+                .arg(m_joint_layers.size())
+                .arg(ComputationHandler::solveStatsText(m_joint_job->getSolveStats()));
+    }
+
+    // Delete the computation unit
+    delete m_joint_job;
+    m_joint_job = nullptr;
+
+    for (int i = 0 ; i < m_joint_layers.size() ; i++) {
+        PastedSourceItem *item = m_joint_layers[i];
+
+        // Removed meanwhile
+        if (!item)
+            continue;
+
+        const bool unchanged = solved && item->layerRect() == m_joint_rects[i];
+        item->finishJointBlending(unchanged ? blended_images[i] : QImage(), report);
+    }
+
+    m_joint_layers.clear();
+    m_joint_rects.clear();
+
+    if (solved)
+        emit blendingSolved(report);
+
+    // Start the latest request, which was waiting for this job to exit
+    if (m_joint_pending) {
+        m_joint_pending = false;
+        startJointBlending();
     }
 }
 
@@ -192,6 +519,59 @@ void TargetGraphicsScene::changeMixedBlending(bool en) {
     }
 }
 
+/**
+ * @brief TargetGraphicsScene::changeLivePreview
+ * @param en
+ *
+ * This slot enables/disables the live blending preview for
+ * all pasted source items.
+ */
+void TargetGraphicsScene::changeLivePreview(bool en) {
+    // Set the live preview status for all pasted items
+    foreach (PastedSourceItem *item, m_source_item_list) {
+        item->setLivePreview(en);
+    }
+}
+
+/**
+ * @brief TargetGraphicsScene::changeSolverType
+ * @param type
+ *
+ * This slot changes the linear solver used by
+ * all pasted source items.
+ */
+void TargetGraphicsScene::changeSolverType(SolverType type) {
+    // Set the solver for all pasted items
+    foreach (PastedSourceItem *item, m_source_item_list) {
+        item->setSolverType(type);
+    }
+}
+
+/**
+ * @brief TargetGraphicsScene::changeSolverTolerance
+ * @param tolerance
+ *
+ * This slot changes the tolerance of the iterative solvers for
+ * all pasted source items.
+ */
+void TargetGraphicsScene::changeSolverTolerance(float tolerance) {
+    // Set the solver tolerance for all pasted items
+    foreach (PastedSourceItem *item, m_source_item_list) {
+        item->setSolverTolerance(tolerance);
+    }
+}
+
+/**
+ * @brief TargetGraphicsScene::changeJointSolve
+ * @param en
+ *
+ * This slot enables/disables the blending of all the layers in a single
+ * system when all the blendings are recomputed.
+ */
+void TargetGraphicsScene::changeJointSolve(bool en) {
+    m_joint_solve = en;
+}
+
 /**
  * @brief TargetGraphicsScene::keyPressEvent
  * @param event
@@ -2,8 +2,13 @@
 #define TARGETGRAPHICSSCENE_H
 
 #include <QGraphicsScene>
+#include <QHash>
+#include <QPointer>
+
+#include "computationhandler.h"
 
 class PastedSourceItem;
+class JointBlendingComputationUnit;
 
 class TargetGraphicsScene : public QGraphicsScene
 {
@@ -18,6 +23,9 @@ public:
 
     bool isRectangleInsertable(QRectF rect);
 
+    // Layer compositing (the item list is the stacking order, bottom first)
+    QImage compositeBelow(PastedSourceItem *item, QImage base, QRect *rect);
+
 public slots:
     void removeSelectedSrcItem();
     void removeAllSrcItem();
@@ -27,16 +35,41 @@ public slots:
 
     void changeRealTimeBlending(bool en);
     void changeMixedBlending(bool en);
+    void changeLivePreview(bool en);
+    void changeSolverType(SolverType type);
+    void changeSolverTolerance(float tolerance);
+    void changeJointSolve(bool en);
 
 protected:
     virtual void keyPressEvent(QKeyEvent *event) override;
 
+private slots:
+    void layerBlendingUpdated(QRect previous_rect);
+    void layerComputingChanged(bool en);
+    void jointBlendingFinished();
+
 signals:
     void keyPressed(QKeyEvent*);
     void sourceItemListChanged();
+    void blendingSolved(QString report);
 
 private:
+    void markLayersAbove(int first, QRect changed_rect, JobPriority priority);
+    void scheduleDirtyLayers();
+    void removeSourceItem(PastedSourceItem *item);
+    void startJointBlending();
+
     QList<PastedSourceItem*> m_source_item_list;
+
+    // Layers to blend again once the overlapping layers beneath them are done
+    QHash<PastedSourceItem*, JobPriority> m_dirty_layers;
+
+    // Joint blending of all the layers in one system (see startJointBlending)
+    bool m_joint_solve;
+    JointBlendingComputationUnit *m_joint_job;
+    bool m_joint_pending;
+    QList<QPointer<PastedSourceItem>> m_joint_layers;
+    QList<QRect> m_joint_rects;
 };
 
 #endif // TARGETGRAPHICSSCENE_H
@@ -0,0 +1,749 @@
+#include "tiledblendingcomputationunit.h"
+#include "laplacianoperator.h"
+#include "multigridsolver.h"
+#include "tiledimageplanes.h"
+
+#include <QElapsedTimer>
+#include <QFileInfo>
+#include <QImageReader>
+#include <QScopedPointer>
+
+#include <cmath>
+
+
+#define WINDOW_SIZE             256     // px (side of the core of the windows)
+#define WINDOW_OVERLAP          16      // px (extension of the windows into their neighbors)
+#define WINDOW_CYCLES           2       // Multigrid iterations of a window, per sweep
+#define COARSE_REGULARIZATION   1e-3f   // Relative increase of the diagonal of the coarse system
+#define MAX_CYCLES              30
+
+// Estimated memory of a coarse cell (stencil, sparse system and its factorization)
+#define COARSE_BYTES_PER_CELL   1024
+
+// Estimated memory of a pixel of a window (planes, index maps, multigrid levels)
+#define WINDOW_BYTES_PER_PIXEL  160
+
+// Shares of the memory budget (the rest is left to the windows)
+#define COMPOSITE_BUDGET_SHARE  0.375
+#define SOLUTION_BUDGET_SHARE   0.25
+#define COARSE_BUDGET_SHARE     0.25
+
+
+/*
+ * Returns the mask of the pixels of unknowns inside domain, on the frame rectangle
+ * (frame coordinates, the mask has the dimensions of the frame)
+ */
+static SelectionMask windowMask(const SelectionMask &unknowns, QRect domain, QRect frame) {
+    QVector<QVector<SelectionMask::Span>> row_spans(frame.height());
+
+    for (int y = domain.top() ; y <= domain.bottom() ; y++) {
+        const SelectionMask::Span *spans = unknowns.rowSpans(y);
+
+        for (int s = 0 ; s < unknowns.spanCount(y) ; s++) {
+            const int x_begin = qMax(spans[s].x_begin, domain.left());
+            const int x_end = qMin(spans[s].x_end, domain.right() + 1);
+
+            if (x_begin < x_end) {
+                row_spans[y - frame.top()].append({x_begin - frame.left(), x_end - frame.left()});
+            }
+        }
+    }
+
+    return SelectionMask(frame.width(), frame.height(), row_spans);
+}
+
+
+TiledBlendingComputationUnit::TiledBlendingComputationUnit(
+        QString target_filename,
+        QImage target_img,
+        QVector<Layer> layers,
+        QString output_filename,
+        float solver_tolerance,
+        qint64 memory_budget)
+    : QObject(), QRunnable()
+{
+    m_target_filename = target_filename;
+    m_target_img = target_img;
+    m_layers = layers;
+    m_output_filename = output_filename;
+    m_solver_tolerance = solver_tolerance;
+    m_memory_budget = memory_budget;
+
+    m_composite = nullptr;
+    m_solution = nullptr;
+    m_coarse_factor = 1;
+
+    m_succeeded = false;
+    m_stats = SolveStats();
+
+    setAutoDelete(false);
+}
+
+void TiledBlendingComputationUnit::run() {
+    // Emit started signal
+    emit computationStarted();
+
+    // Compute...
+    computeBlendingData();
+
+    // Emit finished signal
+    emit computationFinished();
+}
+
+/**
+ * @brief TiledBlendingComputationUnit::cancel
+ *
+ * This function asks the job to stop as soon as possible (thread-safe).
+ * No file is written, but computationFinished() is still emitted.
+ */
+void TiledBlendingComputationUnit::cancel() {
+    m_cancelled.storeRelease(1);
+}
+
+bool TiledBlendingComputationUnit::isCancelled() const {
+    return m_cancelled.loadAcquire() != 0;
+}
+
+void TiledBlendingComputationUnit::computeBlendingData() {
+    QElapsedTimer timer;
+    timer.start();
+
+    // The target is read from its file if it is still there (one row of tiles at once)
+    const bool from_file = !m_target_filename.isEmpty() && QImageReader(m_target_filename).size() == m_target_img.size();
+
+    QScopedPointer<TiledImagePlanes> composite(new TiledImagePlanes(m_target_img.width(), m_target_img.height(),
+                                                                    m_memory_budget * COMPOSITE_BUDGET_SHARE));
+    m_composite = composite.data();
+
+    // Nothing else is allocated yet: the decoded strips of the file may use the rest of the budget
+    const bool imported = from_file ? m_composite->importImageFile(m_target_filename, m_memory_budget * (1.0 - COMPOSITE_BUDGET_SHARE))
+                                    : m_composite->importImage(m_target_img);
+
+    if (!imported || !m_composite->isValid()) {
+        m_error_string = "The target image could not be copied into the temporary tiles.";
+        return;
+    }
+
+    m_stats.solver = SolverMultigrid;
+    m_stats.converged = true;
+    m_stats.setup_time = timer.restart();
+
+    // Each layer is blended against the composite of the layers beneath it
+    for (int i = 0 ; i < m_layers.size() ; i++) {
+        if (!blendLayer(i))
+            return;
+    }
+
+    // The formats of Qt need the whole image in memory
+    const bool pixmap = QFileInfo(m_output_filename).suffix().toLower() == "ppm";
+
+    if (pixmap) {
+        if (!m_composite->savePixmap(m_output_filename)) {
+            m_error_string = "An error occurred while writing the blended image to the selected file.";
+            return;
+        }
+    }
+    else {
+        if (m_composite->width() * (qint64) m_composite->height() * 4 > m_memory_budget) {
+            m_error_string = "The blended image does not fit in the memory budget in this format, export it as a PPM file.";
+            return;
+        }
+
+        if (!m_composite->toImage().save(m_output_filename)) {
+            m_error_string = "An error occurred while writing the blended image to the selected file.";
+            return;
+        }
+    }
+
+    m_stats.solve_time = timer.elapsed();
+    m_succeeded = true;
+}
+
+/**
+ * @brief TiledBlendingComputationUnit::blendLayer
+ * @param layer_index
+ * @return
+ *
+ * This function blends a layer against the composite target, then writes it into the composite.
+ * It starts from the target plus the coarse correction (the first residual is the right-hand side
+ * of the correction), then does smoothing sweeps and coarse corrections until the relative residual
+ * is below the tolerance.
+ * Returns false if the job was cancelled or if the tiles could not be read or written.
+ */
+bool TiledBlendingComputationUnit::blendLayer(int layer_index) {
+    const Layer &layer = m_layers[layer_index];
+    const SelectionMask &unknowns = layer.unknowns;
+
+    if (unknowns.pixelCount() == 0)
+        return true;
+
+    QScopedPointer<TiledImagePlanes> solution(new TiledImagePlanes(unknowns.width(), unknowns.height(),
+                                                                   m_memory_budget * SOLUTION_BUDGET_SHARE));
+    m_solution = solution.data();
+
+    // Finest coarse grid fitting in its share of the budget (1: the whole layer is solved in memory)
+    m_coarse_factor = 1;
+
+    while (((unknowns.width() + m_coarse_factor - 1) / m_coarse_factor) * (qint64) ((unknowns.height() + m_coarse_factor - 1) / m_coarse_factor)
+           * COARSE_BYTES_PER_CELL > m_memory_budget * COARSE_BUDGET_SHARE) {
+        m_coarse_factor *= 2;
+    }
+
+    const CoarseGrid grid = setupCoarseGrid(unknowns);
+
+    // Core of the windows containing unknowns, in raster order
+    QVector<QRect> tiles;
+
+    for (int y = 0 ; y < unknowns.height() ; y += WINDOW_SIZE) {
+        for (int x = 0 ; x < unknowns.width() ; x += WINDOW_SIZE) {
+            const QRect core = QRect(x, y, WINDOW_SIZE, WINDOW_SIZE).intersected(QRect(0, 0, unknowns.width(), unknowns.height()));
+
+            if (windowMask(unknowns, core, core).pixelCount() > 0)
+                tiles.append(core);
+        }
+    }
+
+    const qint64 window_side = WINDOW_SIZE + 2 * WINDOW_OVERLAP + 2;
+
+    m_stats.bytes_allocated = qMax(m_stats.bytes_allocated, (qint64) (m_memory_budget * (COMPOSITE_BUDGET_SHARE + SOLUTION_BUDGET_SHARE)) +
+                                   grid.size * (qint64) COARSE_BYTES_PER_CELL + window_side * window_side * WINDOW_BYTES_PER_PIXEL);
+
+    // The first residual is the right-hand side of the correction of the target
+    MatrixXd coarse_rhs;
+    Eigen::Array3d r_norm;
+    Eigen::Array3d b_norm;
+
+    if (!residualPass(layer, tiles, grid, &coarse_rhs, &r_norm, &b_norm))
+        return false;
+
+    // Relative residual, like the other solvers
+    b_norm = b_norm.sqrt();
+
+    // Null right-hand sides are already solved
+    for (int c = 0 ; c < 3 ; c++) {
+        if (b_norm(c) == 0.0)
+            b_norm(c) = 1.0;
+    }
+
+    MatrixXd correction = grid.factorization->solve(coarse_rhs);
+    float error = 1.0f;
+    int cycle = 0;
+
+    while (cycle < MAX_CYCLES) {
+        if (!smoothingPass(layer, tiles, grid, correction) ||
+            !residualPass(layer, tiles, grid, &coarse_rhs, &r_norm))
+            return false;
+
+        cycle++;
+        error = (r_norm.sqrt() / b_norm).maxCoeff();
+
+        emit progressChanged(layer_index, cycle, error);
+
+        if (error < m_solver_tolerance)
+            break;
+
+        correction = grid.factorization->solve(coarse_rhs);
+    }
+
+    m_stats.iterations = qMax(m_stats.iterations, cycle);
+    m_stats.error = qMax(m_stats.error, error);
+    m_stats.converged = m_stats.converged && error < m_solver_tolerance;
+
+    return compositePass(layer, tiles);
+}
+
+/**
+ * @brief TiledBlendingComputationUnit::makeWindow
+ * @param unknowns
+ * @param core
+ * @param overlap
+ * @return
+ *
+ * This function returns the window of the core extended by overlap pixels: its unknowns
+ * are the ones of the extended core, the other ones are boundary values.
+ */
+TiledBlendingComputationUnit::Window TiledBlendingComputationUnit::makeWindow(const SelectionMask &unknowns, QRect core, int overlap) {
+    const QRect mask_rect(0, 0, unknowns.width(), unknowns.height());
+    const QRect domain = core.adjusted(-overlap, -overlap, overlap, overlap).intersected(mask_rect);
+
+    Window window;
+    window.core = core;
+    window.load = domain.adjusted(-1, -1, 1, 1).intersected(mask_rect);
+    window.index_map = ComputationHandler::maskToIndexMap(windowMask(unknowns, domain, window.load));
+
+    // Unknowns of the whole mask around the domain
+    window.unknowns = IndexMatrix::Zero(window.load.height(), window.load.width());
+
+    for (int y = window.load.top() ; y <= window.load.bottom() ; y++) {
+        const SelectionMask::Span *spans = unknowns.rowSpans(y);
+
+        for (int s = 0 ; s < unknowns.spanCount(y) ; s++) {
+            const int x_begin = qMax(spans[s].x_begin, window.load.left());
+            const int x_end = qMin(spans[s].x_end, window.load.right() + 1);
+
+            if (x_begin < x_end) {
+                window.unknowns.row(y - window.load.top()).segment(x_begin - window.load.left(), x_end - x_begin).setConstant(1);
+            }
+        }
+    }
+
+    return window;
+}
+
+/**
+ * @brief TiledBlendingComputationUnit::windowIndependentTerms
+ * @param layer
+ * @param window
+ * @param tgt_planes
+ * @param d_planes
+ * @param global_b
+ * @return
+ *
+ * This function returns the right-hand side of the Dirichlet problem of the window: the
+ * unknowns of the mask out of the window are boundary values (current solution), instead
+ * of the target like the pixels out of the mask.
+ * If global_b is not null, it receives the rows of the right-hand side of the whole blending
+ * (only the target out of the mask is a boundary value).
+ */
+MatrixX3d TiledBlendingComputationUnit::windowIndependentTerms(const Layer &layer, const Window &window, const ImagePlanes &tgt_planes, const ImagePlanes &d_planes, MatrixX3d *global_b) {
+    MatrixX3d b = ComputationHandler::computeIndependentTerms(layer.source.window(window.load), tgt_planes, layer.mixed_blending, window.index_map);
+
+    if (global_b)
+        *global_b = b;
+
+    const IndexMatrix &index = window.index_map.index;
+
+    // Offsets of the 4 neighbors (right, left, bottom, top)
+    const int dx[4] = {1, -1, 0, 0};
+    const int dy[4] = {0, 0, 1, -1};
+
+    for (int i = 0 ; i < window.index_map.pixels.size() ; i++) {
+        const QPoint &p = window.index_map.pixels[i];
+
+        for (int n = 0 ; n < 4 ; n++) {
+            const int x = p.x() + dx[n];
+            const int y = p.y() + dy[n];
+
+            if (index(y, x) < 0 && window.unknowns(y, x)) {
+                for (int ch = 0 ; ch < 3 ; ch++) {
+                    b(i, ch) += d_planes.at(ch, y, x);
+
+                    // Not a boundary of the whole blending (computeIndependentTerms added the target)
+                    if (global_b)
+                        (*global_b)(i, ch) -= tgt_planes.at(ch, y, x);
+                }
+            }
+        }
+    }
+
+    return b;
+}
+
+/**
+ * @brief TiledBlendingComputationUnit::gatherSolution
+ * @param window
+ * @param tgt_planes
+ * @param d_planes
+ * @return
+ *
+ * This function returns the current solution on the unknowns of the window.
+ */
+MatrixX3d TiledBlendingComputationUnit::gatherSolution(const Window &window, const ImagePlanes &tgt_planes, const ImagePlanes &d_planes) {
+    MatrixX3d x(window.index_map.pixels.size(), 3);
+
+    for (int i = 0 ; i < window.index_map.pixels.size() ; i++) {
+        const QPoint &p = window.index_map.pixels[i];
+
+        for (int ch = 0 ; ch < 3 ; ch++) {
+            x(i, ch) = tgt_planes.at(ch, p.y(), p.x()) + d_planes.at(ch, p.y(), p.x());
+        }
+    }
+
+    return x;
+}
+
+/**
+ * @brief TiledBlendingComputationUnit::smoothingPass
+ * @param layer
+ * @param tiles
+ * @param grid
+ * @param correction
+ * @return
+ *
+ * This function solves the windows one after the other (block Gauss-Seidel sweep), each one
+ * approximately. The coarse correction is added to the unknowns of a tile when it is first
+ * loaded in the sweep, so the solution is written once per tile.
+ */
+bool TiledBlendingComputationUnit::smoothingPass(const Layer &layer, const QVector<QRect> &tiles, const CoarseGrid &grid, const MatrixXd &correction) {
+    for (int t = 0 ; t < tiles.size() ; t++) {
+        if (isCancelled())
+            return false;
+
+        const Window window = makeWindow(layer.unknowns, tiles[t], WINDOW_OVERLAP);
+        const QRect &load = window.load;
+
+        const ImagePlanes tgt_planes = m_composite->read(load.translated(layer.position));
+        ImagePlanes d_planes = m_solution->read(load);
+
+        // Unknowns of the tiles not processed yet in this sweep (raster order)
+        for (int y = 0 ; y < load.height() ; y++) {
+            for (int x = 0 ; x < load.width() ; x++) {
+                const int mask_x = x + load.left();
+                const int mask_y = y + load.top();
+                const bool processed = (mask_y / WINDOW_SIZE < tiles[t].top() / WINDOW_SIZE) ||
+                                       (mask_y / WINDOW_SIZE == tiles[t].top() / WINDOW_SIZE && mask_x / WINDOW_SIZE < tiles[t].left() / WINDOW_SIZE);
+
+                if (!window.unknowns(y, x) || processed)
+                    continue;
+
+                const Eigen::RowVector3f value = prolongate(grid, correction, mask_x, mask_y);
+
+                for (int ch = 0 ; ch < 3 ; ch++) {
+                    d_planes.row(ch, y)[x] += value(ch);
+                }
+            }
+        }
+
+        const MatrixX3d b = windowIndependentTerms(layer, window, tgt_planes, d_planes);
+        const MatrixX3d x0 = gatherSolution(window, tgt_planes, d_planes);
+
+        // A few multigrid iterations per channel (one channel per thread). The right-hand side of a
+        // window is dominated by its boundary values, so the sweeps are only stopped by the global residual
+        MatrixX3d x(b.rows(), 3);
+
+        ComputationHandler::parallelFor(3, [&](int channel) {
+            MultigridSolver solver(window.index_map);
+            solver.setTolerance(0.0f);
+            solver.setMaxIterations(WINDOW_CYCLES);
+
+            const VectorXd x_channel = solver.solveWithGuess(b.col(channel), x0.col(channel));
+            x.col(channel) = x_channel;
+        });
+
+        for (int i = 0 ; i < window.index_map.pixels.size() ; i++) {
+            const QPoint &p = window.index_map.pixels[i];
+
+            for (int ch = 0 ; ch < 3 ; ch++) {
+                d_planes.row(ch, p.y())[p.x()] = x(i, ch) - tgt_planes.at(ch, p.y(), p.x());
+            }
+        }
+
+        // Only the core is kept (its neighbors are solved again by their own window)
+        if (!m_solution->write(tiles[t].topLeft(), d_planes.window(tiles[t].translated(-load.topLeft()))))
+            break;
+    }
+
+    if (!m_solution->isValid() || !m_composite->isValid()) {
+        m_error_string = "The temporary tiles could not be read or written.";
+        return false;
+    }
+
+    return true;
+}
+
+/**
+ * @brief TiledBlendingComputationUnit::residualPass
+ * @param layer
+ * @param tiles
+ * @param grid
+ * @param coarse_rhs
+ * @param r_norm
+ * @param b_norm
+ * @return
+ *
+ * This function computes the residual of the current solution, tile by tile. It returns
+ * its squared norm (per channel) and the right-hand side of the coarse correction P^T*r.
+ * The squared norm of the right-hand side of the whole blending is also returned if b_norm
+ * is not null (the edges of the windows inside the mask are not boundaries).
+ */
+bool TiledBlendingComputationUnit::residualPass(const Layer &layer, const QVector<QRect> &tiles, const CoarseGrid &grid, MatrixXd *coarse_rhs, Eigen::Array3d *r_norm, Eigen::Array3d *b_norm) {
+    // Accumulated in double precision (sums of many residuals)
+    Eigen::Matrix<double, Eigen::Dynamic, 3> sums = Eigen::Matrix<double, Eigen::Dynamic, 3>::Zero(grid.size, 3);
+
+    int cells[4];
+    float weights[4];
+
+    *r_norm = Eigen::Array3d::Zero();
+
+    if (b_norm)
+        *b_norm = Eigen::Array3d::Zero();
+
+    for (int t = 0 ; t < tiles.size() ; t++) {
+        if (isCancelled())
+            return false;
+
+        const Window window = makeWindow(layer.unknowns, tiles[t], 0);
+
+        const ImagePlanes tgt_planes = m_composite->read(window.load.translated(layer.position));
+        const ImagePlanes d_planes = m_solution->read(window.load);
+
+        MatrixX3d global_b;
+        const MatrixX3d b = windowIndependentTerms(layer, window, tgt_planes, d_planes, b_norm ? &global_b : nullptr);
+        const MatrixX3d x = gatherSolution(window, tgt_planes, d_planes);
+
+        MatrixX3d r(x.rows(), 3);
+        LaplacianOperator(window.index_map).apply(x, r);
+        r = b - r;
+
+        for (int i = 0 ; i < window.index_map.pixels.size() ; i++) {
+            const QPoint p = window.index_map.pixels[i] + window.load.topLeft();
+            const int count = interpolationWeights(grid, p.x(), p.y(), cells, weights);
+
+            for (int k = 0 ; k < count ; k++) {
+                sums.row(grid.nodes.data()[cells[k]]) += (double) weights[k] * r.row(i).cast<double>();
+            }
+        }
+
+        *r_norm += r.cast<double>().colwise().squaredNorm().transpose().array();
+
+        if (b_norm)
+            *b_norm += global_b.cast<double>().colwise().squaredNorm().transpose().array();
+    }
+
+    if (!m_solution->isValid() || !m_composite->isValid()) {
+        m_error_string = "The temporary tiles could not be read or written.";
+        return false;
+    }
+
+    *coarse_rhs = sums.cast<float>();
+
+    return true;
+}
+
+/**
+ * @brief TiledBlendingComputationUnit::compositePass
+ * @param layer
+ * @param tiles
+ * @return
+ *
+ * This function writes the blended layer into the composite target, rounded to 8 bits
+ * like the blended images composited by the target scene.
+ */
+bool TiledBlendingComputationUnit::compositePass(const Layer &layer, const QVector<QRect> &tiles) {
+    foreach (const QRect &core, tiles) {
+        ImagePlanes x_planes = m_composite->read(core.translated(layer.position));
+        const ImagePlanes d_planes = m_solution->read(core);
+
+        for (int ch = 0 ; ch < 3 ; ch++) {
+            for (int y = 0 ; y < core.height() ; y++) {
+                float *x_row = x_planes.row(ch, y);
+                const float *d_row = d_planes.constRow(ch, y);
+
+                for (int x = 0 ; x < core.width() ; x++) {
+                    x_row[x] += d_row[x];
+                }
+            }
+        }
+
+        x_planes = ComputationHandler::imageToPlanes(ComputationHandler::planesToImage(x_planes));
+
+        m_composite->write(core.topLeft() + layer.position, x_planes, windowMask(layer.unknowns, core, core));
+    }
+
+    if (!m_composite->isValid()) {
+        m_error_string = "The temporary tiles could not be read or written.";
+        return false;
+    }
+
+    return true;
+}
+
+/**
+ * @brief TiledBlendingComputationUnit::setupCoarseGrid
+ * @param unknowns
+ * @return
+ *
+ * This function builds the coarse space of the layer: the bilinear functions centered on the
+ * cells of m_coarse_factor x m_coarse_factor pixels (the ones not null on the unknowns), and
+ * factorizes the Galerkin system P^T*A*P. The coarse correction is then the best one of the
+ * coarse space (in the energy norm of A), whatever the shape of the mask.
+ * The system is assembled from the mask, without the fine matrix.
+ */
+TiledBlendingComputationUnit::CoarseGrid TiledBlendingComputationUnit::setupCoarseGrid(const SelectionMask &unknowns) const {
+    const int f = m_coarse_factor;
+
+    CoarseGrid grid;
+    grid.nodes = IndexMatrix::Constant((unknowns.height() + f - 1) / f + 2, (unknowns.width() + f - 1) / f + 2, -1);
+    grid.size = 0;
+
+    int cells[4];
+    float weights[4];
+
+    // Cells whose function is not null on the unknowns
+    for (int y = 0 ; y < unknowns.height() ; y++) {
+        const SelectionMask::Span *spans = unknowns.rowSpans(y);
+
+        for (int s = 0 ; s < unknowns.spanCount(y) ; s++) {
+            for (int x = spans[s].x_begin ; x < spans[s].x_end ; x++) {
+                const int count = interpolationWeights(grid, x, y, cells, weights);
+
+                for (int k = 0 ; k < count ; k++) {
+                    grid.nodes.data()[cells[k]] = 1;
+                }
+            }
+        }
+    }
+
+    QVector<int> node_cells;
+
+    for (int c = 0 ; c < grid.nodes.size() ; c++) {
+        if (grid.nodes.data()[c] > 0) {
+            grid.nodes.data()[c] = grid.size++;
+            node_cells.append(c);
+        }
+        else {
+            grid.nodes.data()[c] = -1;
+        }
+    }
+
+    // The functions of two nodes overlap if they are at most 2 cells apart (5x5 stencil)
+    const int columns = grid.nodes.cols();
+    std::vector<float> stencils(25 * (size_t) grid.size, 0.0f);
+
+    auto addProducts = [&](const int *cells_a, const float *weights_a, int count_a,
+                           const int *cells_b, const float *weights_b, int count_b, float coefficient) {
+        for (int a = 0 ; a < count_a ; a++) {
+            float *stencil = &stencils[25 * (size_t) grid.nodes.data()[cells_a[a]]];
+
+            for (int b = 0 ; b < count_b ; b++) {
+                const int dy = cells_b[b] / columns - cells_a[a] / columns;
+                const int dx = cells_b[b] % columns - cells_a[a] % columns;
+
+                stencil[5 * (dy + 2) + dx + 2] += coefficient * weights_a[a] * weights_b[b];
+            }
+        }
+    };
+
+    // Offsets of the 4 neighbors (right, left, bottom, top)
+    const int dx[4] = {1, -1, 0, 0};
+    const int dy[4] = {0, 0, 1, -1};
+
+    int neighbor_cells[4];
+    float neighbor_weights[4];
+
+    for (int y = 0 ; y < unknowns.height() ; y++) {
+        const SelectionMask::Span *spans = unknowns.rowSpans(y);
+
+        for (int s = 0 ; s < unknowns.spanCount(y) ; s++) {
+            for (int x = spans[s].x_begin ; x < spans[s].x_end ; x++) {
+                const int count = interpolationWeights(grid, x, y, cells, weights);
+
+                addProducts(cells, weights, count, cells, weights, count, 4.0f);
+
+                for (int n = 0 ; n < 4 ; n++) {
+                    const bool inside = (dy[n] == 0) ? (x + dx[n] >= spans[s].x_begin && x + dx[n] < spans[s].x_end)
+                                                     : unknowns.contains(x, y + dy[n]);
+
+                    if (!inside)
+                        continue;
+
+                    const int neighbor_count = interpolationWeights(grid, x + dx[n], y + dy[n], neighbor_cells, neighbor_weights);
+
+                    addProducts(cells, weights, count, neighbor_cells, neighbor_weights, neighbor_count, -1.0f);
+                }
+            }
+        }
+    }
+
+    std::vector<Eigen::Triplet<float>> triplets;
+    triplets.reserve(9 * (size_t) grid.size);
+
+    for (int node = 0 ; node < grid.size ; node++) {
+        for (int k = 0 ; k < 25 ; k++) {
+            float value = stencils[25 * (size_t) node + k];
+
+            if (value == 0.0f)
+                continue;
+
+            // The functions of a thin mask can be linearly dependent (P = I on a single cell)
+            if (k == 12 && f > 1)
+                value *= 1.0f + COARSE_REGULARIZATION;
+
+            const int cell = node_cells[node] + (k / 5 - 2) * columns + k % 5 - 2;
+            triplets.push_back(Eigen::Triplet<float>(node, grid.nodes.data()[cell], value));
+        }
+    }
+
+    std::vector<float>().swap(stencils);
+
+    SparseMatrixXd coarse(grid.size, grid.size);
+    coarse.setFromTriplets(triplets.begin(), triplets.end());
+
+    grid.factorization = ComputationHandler::factorizeLaplacian(coarse);
+
+    return grid;
+}
+
+/**
+ * @brief TiledBlendingComputationUnit::interpolationWeights
+ * @param grid
+ * @param x
+ * @param y
+ * @param cells
+ * @param weights
+ * @return
+ *
+ * This function returns the coarse cells (indices in grid.nodes) whose function is not null
+ * at the pixel (x,y) of the mask, with their value: bilinear interpolation of the cell centers.
+ */
+int TiledBlendingComputationUnit::interpolationWeights(const CoarseGrid &grid, int x, int y, int *cells, float *weights) const {
+    const float u = (x + 0.5f) / m_coarse_factor - 0.5f;
+    const float v = (y + 0.5f) / m_coarse_factor - 0.5f;
+
+    const int cx = (int) std::floor(u);
+    const int cy = (int) std::floor(v);
+    const float wx = u - cx;
+    const float wy = v - cy;
+
+    const float bilinear[4] = {(1.0f - wx) * (1.0f - wy), wx * (1.0f - wy), (1.0f - wx) * wy, wx * wy};
+    int count = 0;
+
+    for (int k = 0 ; k < 4 ; k++) {
+        if (bilinear[k] == 0.0f)
+            continue;
+
+        // 1 cell margin (the centers of the first cells are inside the pixels of the mask)
+        cells[count] = (cy + 1 + k / 2) * grid.nodes.cols() + cx + 1 + k % 2;
+        weights[count] = bilinear[k];
+        count++;
+    }
+
+    return count;
+}
+
+/**
+ * @brief TiledBlendingComputationUnit::prolongate
+ * @param grid
+ * @param correction
+ * @param x
+ * @param y
+ * @return
+ *
+ * This function returns the coarse correction at the pixel (x,y) of the mask.
+ */
+Eigen::RowVector3f TiledBlendingComputationUnit::prolongate(const CoarseGrid &grid, const MatrixXd &correction, int x, int y) const {
+    int cells[4];
+    float weights[4];
+
+    const int count = interpolationWeights(grid, x, y, cells, weights);
+
+    Eigen::RowVector3f value = Eigen::RowVector3f::Zero();
+
+    for (int k = 0 ; k < count ; k++) {
+        value += weights[k] * correction.row(grid.nodes.data()[cells[k]]);
+    }
+
+    return value;
+}
+
+bool TiledBlendingComputationUnit::succeeded() const {
+    return m_succeeded;
+}
+
+QString TiledBlendingComputationUnit::errorString() const {
+    return m_error_string;
+}
+
+SolveStats TiledBlendingComputationUnit::getSolveStats() {
+    return m_stats;
+}
@@ -0,0 +1,123 @@
+#ifndef TILEDBLENDINGCOMPUTATIONUNIT_H
+#define TILEDBLENDINGCOMPUTATIONUNIT_H
+
+#include <QAtomicInt>
+#include <QObject>
+#include <QRunnable>
+
+#include "computationhandler.h"
+
+class TiledImagePlanes;
+
+// Default memory budget of the tiled blending (see TiledBlendingComputationUnit)
+#define DEFAULT_MEMORY_BUDGET_MB 512
+
+/*
+ * Out-of-core blending of all the pasted layers, at the full resolution of the target,
+ * written to an image file.
+ *
+ * The composite target and the solution of the layer being blended are kept on disk in
+ * tiles (TiledImagePlanes), the whole target is never converted at once. Each layer is
+ * blended against the composite of the layers beneath it, then written into it.
+ *
+ * A layer is solved by a streaming two-grid cycle:
+ *  - the coarse correction (bilinear functions on blocks of the mask, as small as the memory
+ *    budget allows) is solved in memory by a factorization of its Galerkin system. Its
+ *    right-hand side is the restricted fine residual, gathered in a streaming pass over the tiles
+ *  - the fine grid is smoothed in a sweep over overlapping windows of the tiles: the
+ *    Dirichlet problem of each window (the unknowns around it are the boundary values)
+ *    is solved by a few multigrid cycles, and the core of the window is written back
+ * The peak memory depends on the budget and on the size of the windows, not on the image.
+ */
+class TiledBlendingComputationUnit : public QObject, public QRunnable
+{
+    Q_OBJECT
+
+public:
+    // One pasted layer, in stacking order (bottom first)
+    struct Layer {
+        ImagePlanes source;
+        SelectionMask unknowns;     // Mask of the unknowns (with its 1px margin)
+        QPoint position;            // Top-left corner of the mask in the target
+        bool mixed_blending;
+    };
+
+    TiledBlendingComputationUnit(
+            QString target_filename,
+            QImage target_img,
+            QVector<Layer> layers,
+            QString output_filename,
+            float solver_tolerance,
+            qint64 memory_budget
+        );
+
+    void run() override;
+
+    void cancel();
+    bool isCancelled() const;
+
+    bool succeeded() const;
+    QString errorString() const;
+    SolveStats getSolveStats();
+
+signals:
+    void computationStarted();
+    void computationFinished();
+    void progressChanged(int layer, int cycle, float error);
+
+private:
+    // Part of the mask loaded at once
+    struct Window {
+        QRect core;                 // Unknowns updated by the window (mask coordinates)
+        QRect load;                 // Loaded pixels: the domain with a 1px margin
+        UnknownIndexMap index_map;  // Unknowns of the domain, on the load rectangle
+        IndexMatrix unknowns;       // 1 on the unknowns of the whole mask, on the load rectangle
+    };
+
+    // Coarse space: bilinear functions centered on the cells of m_coarse_factor px
+    struct CoarseGrid {
+        IndexMatrix nodes;          // Node of each cell (1 cell margin), -1 if its function is null on the unknowns
+        int size;
+        LaplacianFactorizationPtr factorization;    // Galerkin system P^T*A*P
+    };
+
+    void computeBlendingData();
+    bool blendLayer(int layer_index);
+
+    Window makeWindow(const SelectionMask &unknowns, QRect core, int overlap);
+    MatrixX3d windowIndependentTerms(const Layer &layer, const Window &window, const ImagePlanes &tgt_planes, const ImagePlanes &d_planes, MatrixX3d *global_b = nullptr);
+    MatrixX3d gatherSolution(const Window &window, const ImagePlanes &tgt_planes, const ImagePlanes &d_planes);
+
+    bool smoothingPass(const Layer &layer, const QVector<QRect> &tiles, const CoarseGrid &grid, const MatrixXd &correction);
+    bool residualPass(const Layer &layer, const QVector<QRect> &tiles, const CoarseGrid &grid, MatrixXd *coarse_rhs, Eigen::Array3d *r_norm, Eigen::Array3d *b_norm = nullptr);
+    bool compositePass(const Layer &layer, const QVector<QRect> &tiles);
+
+    CoarseGrid setupCoarseGrid(const SelectionMask &unknowns) const;
+    int interpolationWeights(const CoarseGrid &grid, int x, int y, int *cells, float *weights) const;
+    Eigen::RowVector3f prolongate(const CoarseGrid &grid, const MatrixXd &correction, int x, int y) const;
+
+    // Input attributes
+    QString m_target_filename;
+    QImage m_target_img;
+    QVector<Layer> m_layers;
+    QString m_output_filename;
+    float m_solver_tolerance;
+    qint64 m_memory_budget;
+
+    // Stores of the composite target and of the solution of the current layer (stored as
+    // its difference with the composite, so the tiles never written are the target)
+    TiledImagePlanes *m_composite;
+    TiledImagePlanes *m_solution;
+
+    // Size of the coarse cells of the current layer (px)
+    int m_coarse_factor;
+
+    // Output attributes
+    bool m_succeeded;
+    QString m_error_string;
+    SolveStats m_stats;
+
+    QAtomicInt m_cancelled;
+};
+
+#endif // TILEDBLENDINGCOMPUTATIONUNIT_H
@@ -0,0 +1,432 @@
+#include "tiledimageplanes.h"
+#include "computationhandler.h"
+
+#include <QFile>
+#include <QImageReader>
+
+#include <cctype>
+#include <cstring>
+
+
+#define TILE_SIZE           128     // px (side of the tiles)
+#define MIN_CACHED_TILES    4
+#define STRIP_PIXEL_BYTES   16      // Decoded strip of an image file (32-bit QImage and 3 float planes)
+
+
+TiledImagePlanes::TiledImagePlanes(int width, int height, qint64 cache_bytes)
+{
+    m_width = width;
+    m_height = height;
+    m_tiles_x = (width + TILE_SIZE - 1) / TILE_SIZE;
+    m_tiles_y = (height + TILE_SIZE - 1) / TILE_SIZE;
+
+    m_valid = m_file.open();
+    m_on_disk.fill(false, m_tiles_x * m_tiles_y);
+
+    m_max_cached_tiles = qMax((qint64) MIN_CACHED_TILES, cache_bytes / tileBytes());
+    m_use_counter = 0;
+}
+
+/**
+ * @brief TiledImagePlanes::isValid
+ * @return
+ *
+ * This function returns false if the temporary file could not be created, or if a
+ * tile could not be written to it or read back (full disk...).
+ */
+bool TiledImagePlanes::isValid() const {
+    return m_valid;
+}
+
+int TiledImagePlanes::width() const {
+    return m_width;
+}
+
+int TiledImagePlanes::height() const {
+    return m_height;
+}
+
+QRect TiledImagePlanes::rect() const {
+    return QRect(0, 0, m_width, m_height);
+}
+
+/**
+ * @brief TiledImagePlanes::tileBytes
+ * @return
+ *
+ * This function returns the size of one tile, in memory and in the file.
+ */
+qint64 TiledImagePlanes::tileBytes() {
+    return 3 * TILE_SIZE * TILE_SIZE * (qint64) sizeof(float);
+}
+
+/**
+ * @brief TiledImagePlanes::tile
+ * @param tx
+ * @param ty
+ * @param modify
+ * @return
+ *
+ * This function returns the data of a tile, loaded from the file if it is not in memory.
+ * If modify is true, the tile will be written back to the file when it is released.
+ * Returns nullptr if the tile could not be loaded.
+ */
+float *TiledImagePlanes::tile(int tx, int ty, bool modify) {
+    const int index = ty * m_tiles_x + tx;
+
+    QHash<int, Tile>::iterator it = m_cache.find(index);
+
+    if (it == m_cache.end()) {
+        // Make room for the new tile
+        if (m_cache.size() >= m_max_cached_tiles && !evictTile())
+            return nullptr;
+
+        Tile new_tile;
+        new_tile.data.assign(3 * TILE_SIZE * TILE_SIZE, 0.0f);
+        new_tile.dirty = false;
+
+        if (m_on_disk[index]) {
+            if (!m_file.seek(index * tileBytes()) ||
+                m_file.read((char*) new_tile.data.data(), tileBytes()) != tileBytes()) {
+                m_valid = false;
+                return nullptr;
+            }
+        }
+
+        it = m_cache.insert(index, new_tile);
+    }
+
+    it->last_use = ++m_use_counter;
+    it->dirty = it->dirty || modify;
+
+    return it->data.data();
+}
+
+/**
+ * @brief TiledImagePlanes::evictTile
+ * @return
+ *
+ * This function releases the least recently used tile, written back to the file if it
+ * was modified. Returns false if the write failed.
+ */
+bool TiledImagePlanes::evictTile() {
+    QHash<int, Tile>::iterator oldest = m_cache.begin();
+
+    for (QHash<int, Tile>::iterator it = m_cache.begin() ; it != m_cache.end() ; ++it) {
+        if (it->last_use < oldest->last_use)
+            oldest = it;
+    }
+
+    if (oldest->dirty) {
+        if (!m_file.seek(oldest.key() * tileBytes()) ||
+            m_file.write((const char*) oldest->data.data(), tileBytes()) != tileBytes()) {
+            m_valid = false;
+            return false;
+        }
+
+        m_on_disk[oldest.key()] = true;
+    }
+
+    m_cache.erase(oldest);
+
+    return true;
+}
+
+/**
+ * @brief TiledImagePlanes::read
+ * @param rect
+ * @return
+ *
+ * This function returns a copy of the pixels of rect (null out of the image).
+ */
+ImagePlanes TiledImagePlanes::read(QRect rect) {
+    ImagePlanes planes(rect.width(), rect.height());
+
+    const QRect area = rect.intersected(this->rect());
+
+    if (area.isEmpty())
+        return planes;
+
+    for (int ty = area.top() / TILE_SIZE ; ty <= area.bottom() / TILE_SIZE ; ty++) {
+        for (int tx = area.left() / TILE_SIZE ; tx <= area.right() / TILE_SIZE ; tx++) {
+            const QRect part = area.intersected(QRect(tx * TILE_SIZE, ty * TILE_SIZE, TILE_SIZE, TILE_SIZE));
+            const float *data = tile(tx, ty, false);
+
+            if (!data)
+                continue;
+
+            for (int ch = 0 ; ch < 3 ; ch++) {
+                for (int y = part.top() ; y <= part.bottom() ; y++) {
+                    const float *src = data + (ch * TILE_SIZE + y - ty * TILE_SIZE) * TILE_SIZE + part.left() - tx * TILE_SIZE;
+
+                    std::memcpy(planes.row(ch, y - rect.top()) + part.left() - rect.left(), src, part.width() * sizeof(float));
+                }
+            }
+        }
+    }
+
+    return planes;
+}
+
+/**
+ * @brief TiledImagePlanes::write
+ * @param position
+ * @param planes
+ * @return
+ *
+ * This function copies the planes into the image, from position (the pixels out of the
+ * image are ignored). Returns false if a tile could not be loaded.
+ */
+bool TiledImagePlanes::write(QPoint position, const ImagePlanes &planes) {
+    QVector<QVector<SelectionMask::Span>> row_spans(planes.height(), QVector<SelectionMask::Span>({{0, planes.width()}}));
+
+    return write(position, planes, SelectionMask(planes.width(), planes.height(), row_spans));
+}
+
+/**
+ * @brief TiledImagePlanes::write
+ * @param position
+ * @param planes
+ * @param mask
+ * @return
+ *
+ * This function copies the pixels of the planes inside the mask (same dimensions as the
+ * planes) into the image, from position.
+ */
+bool TiledImagePlanes::write(QPoint position, const ImagePlanes &planes, const SelectionMask &mask) {
+    const QRect area = QRect(position, QSize(planes.width(), planes.height())).intersected(rect());
+
+    if (area.isEmpty())
+        return true;
+
+    bool ok = true;
+
+    for (int ty = area.top() / TILE_SIZE ; ty <= area.bottom() / TILE_SIZE ; ty++) {
+        for (int tx = area.left() / TILE_SIZE ; tx <= area.right() / TILE_SIZE ; tx++) {
+            const QRect part = area.intersected(QRect(tx * TILE_SIZE, ty * TILE_SIZE, TILE_SIZE, TILE_SIZE));
+            float *data = tile(tx, ty, true);
+
+            if (!data) {
+                ok = false;
+                continue;
+            }
+
+            for (int y = part.top() ; y <= part.bottom() ; y++) {
+                const int mask_y = y - position.y();
+                const SelectionMask::Span *spans = mask.rowSpans(mask_y);
+
+                for (int s = 0 ; s < mask.spanCount(mask_y) ; s++) {
+                    // Span in image coordinates, clipped to the tile
+                    const int x_begin = qMax(spans[s].x_begin + position.x(), part.left());
+                    const int x_end = qMin(spans[s].x_end + position.x(), part.right() + 1);
+
+                    if (x_begin >= x_end)
+                        continue;
+
+                    for (int ch = 0 ; ch < 3 ; ch++) {
+                        float *dst = data + (ch * TILE_SIZE + y - ty * TILE_SIZE) * TILE_SIZE + x_begin - tx * TILE_SIZE;
+
+                        std::memcpy(dst, planes.constRow(ch, mask_y) + x_begin - position.x(), (x_end - x_begin) * sizeof(float));
+                    }
+                }
+            }
+        }
+    }
+
+    return ok;
+}
+
+/**
+ * @brief TiledImagePlanes::importImage
+ * @param image
+ * @return
+ *
+ * This function copies the image (same dimensions) into the tiles, one row of tiles at once.
+ */
+bool TiledImagePlanes::importImage(const QImage &image) {
+    for (int y = 0 ; y < m_height ; y += TILE_SIZE) {
+        const int height = qMin(TILE_SIZE, m_height - y);
+
+        if (!write(QPoint(0, y), ComputationHandler::imageToPlanes(image.copy(0, y, m_width, height))))
+            return false;
+    }
+
+    return true;
+}
+
+/**
+ * @brief TiledImagePlanes::importImageFile
+ * @param filename
+ * @param strip_bytes
+ * @return
+ *
+ * This function reads an image file (same dimensions) into the tiles, without holding the whole
+ * image in memory when possible:
+ *  - binary PPM files (the output of savePixmap) are read sequentially, one row of tiles at once
+ *  - the formats that can decode a part of the image (JPEG...) are read by strips of about
+ *    strip_bytes. A reader decodes only once, and each strip decodes the file from its start,
+ *    so the strips are as high as the budget allows.
+ * The other formats are decoded at once.
+ */
+bool TiledImagePlanes::importImageFile(const QString &filename, qint64 strip_bytes) {
+    QFile file(filename);
+
+    if (file.open(QIODevice::ReadOnly) && file.peek(2) == "P6")
+        return importPixmapFile(file);
+
+    file.close();
+
+    QImageReader reader(filename);
+
+    if (reader.size() != QSize(m_width, m_height))
+        return false;
+
+    // Whole rows of tiles per strip
+    const int strip_height = qMax((qint64) 1, strip_bytes / (m_width * (qint64) STRIP_PIXEL_BYTES * TILE_SIZE)) * TILE_SIZE;
+
+    if (!reader.supportsOption(QImageIOHandler::ClipRect) || strip_height >= m_height) {
+        const QImage image = reader.read();
+
+        return !image.isNull() && importImage(image);
+    }
+
+    for (int y = 0 ; y < m_height ; y += strip_height) {
+        QImageReader strip_reader(filename);
+        strip_reader.setClipRect(QRect(0, y, m_width, qMin(strip_height, m_height - y)));
+
+        const QImage strip = strip_reader.read();
+
+        if (strip.isNull() || !write(QPoint(0, y), ComputationHandler::imageToPlanes(strip)))
+            return false;
+    }
+
+    return true;
+}
+
+/**
+ * @brief TiledImagePlanes::importPixmapFile
+ * @param file
+ * @return
+ *
+ * This function reads a binary PPM file (8-bit, same dimensions) into the tiles, sequentially.
+ */
+bool TiledImagePlanes::importPixmapFile(QFile &file) {
+    // Header: P6, width, height and maximum value, separated by blanks and comments
+    int values[3];
+    char c;
+
+    if (!file.getChar(&c) || !file.getChar(&c))
+        return false;
+
+    for (int v = 0 ; v < 3 ; v++) {
+        do {
+            if (!file.getChar(&c))
+                return false;
+
+            if (c == '#') {
+                while (c != '\n' && file.getChar(&c));
+            }
+        } while (std::isspace((uchar) c) || c == '#');
+
+        values[v] = 0;
+
+        while (std::isdigit((uchar) c)) {
+            values[v] = 10 * values[v] + (c - '0');
+
+            if (!file.getChar(&c))
+                return false;
+        }
+    }
+
+    // A single blank before the pixels
+    if (values[0] != m_width || values[1] != m_height || values[2] != 255 || !std::isspace((uchar) c))
+        return false;
+
+    QByteArray row(3 * m_width, 0);
+
+    for (int y = 0 ; y < m_height ; y += TILE_SIZE) {
+        ImagePlanes strip(m_width, qMin(TILE_SIZE, m_height - y));
+
+        for (int k = 0 ; k < strip.height() ; k++) {
+            if (file.read(row.data(), row.size()) != row.size())
+                return false;
+
+            const uchar *pixels = (const uchar*) row.constData();
+            float *r = strip.row(0, k);
+            float *g = strip.row(1, k);
+            float *b = strip.row(2, k);
+
+            for (int x = 0 ; x < m_width ; x++) {
+                r[x] = pixels[3 * x] / 255.0f;
+                g[x] = pixels[3 * x + 1] / 255.0f;
+                b[x] = pixels[3 * x + 2] / 255.0f;
+            }
+        }
+
+        if (!write(QPoint(0, y), strip))
+            return false;
+    }
+
+    return true;
+}
+
+/**
+ * @brief TiledImagePlanes::toImage
+ * @return
+ *
+ * This function converts the whole image into a QImage (only for the images fitting in memory).
+ */
+QImage TiledImagePlanes::toImage() {
+    QImage image(m_width, m_height, QImage::Format_RGB32);
+
+    for (int y = 0 ; y < m_height ; y += TILE_SIZE) {
+        const QImage strip = ComputationHandler::planesToImage(read(QRect(0, y, m_width, qMin(TILE_SIZE, m_height - y))));
+
+        for (int k = 0 ; k < strip.height() ; k++) {
+            std::memcpy(image.scanLine(y + k), strip.constScanLine(k), m_width * sizeof(QRgb));
+        }
+    }
+
+    return image;
+}
+
+/**
+ * @brief TiledImagePlanes::savePixmap
+ * @param filename
+ * @return
+ *
+ * This function writes the image into a binary PPM file, one row of tiles at once
+ * (the image formats of Qt can only be written from a whole QImage).
+ */
+bool TiledImagePlanes::savePixmap(const QString &filename) {
+    QFile file(filename);
+
+    if (!file.open(QIODevice::WriteOnly))
+        return false;
+
+    const QByteArray header = QString("P6\n%1 %2\n255\n").arg(m_width).arg(m_height).toLatin1();
+
+    if (file.write(header) != header.size())
+        return false;
+
+    QByteArray row(3 * m_width, 0);
+
+    for (int y = 0 ; y < m_height ; y += TILE_SIZE) {
+        const QImage strip = ComputationHandler::planesToImage(read(QRect(0, y, m_width, qMin(TILE_SIZE, m_height - y))));
+
+        for (int k = 0 ; k < strip.height() ; k++) {
+            const QRgb *pixels = (const QRgb*) strip.constScanLine(k);
+
+            for (int x = 0 ; x < m_width ; x++) {
+                row[3 * x] = (char) qRed(pixels[x]);
+                row[3 * x + 1] = (char) qGreen(pixels[x]);
+                row[3 * x + 2] = (char) qBlue(pixels[x]);
+            }
+
+            if (file.write(row) != row.size())
+                return false;
+        }
+    }
+
+    return true;
+}
@@ -0,0 +1,77 @@
+#ifndef TILEDIMAGEPLANES_H
+#define TILEDIMAGEPLANES_H
+
+#include <QFile>
+#include <QHash>
+#include <QImage>
+#include <QRect>
+#include <QTemporaryFile>
+#include <QVector>
+
+#include "imageplanes.h"
+#include "selectionmask.h"
+
+#include <vector>
+
+/*
+ * Planar float image (red, green and blue) kept on disk, for the images too large for
+ * the memory (see TiledBlendingComputationUnit).
+ *
+ * The image is split into square tiles, stored in a temporary file. Only a bounded number
+ * of tiles is held in memory: the least recently used one is written back (if modified)
+ * and released when a new tile is needed. The pixels are read and written by windows
+ * (ImagePlanes of any rectangle), the pixels out of the image or never written are null.
+ *
+ * Not thread-safe: a store is used by one computation job.
+ */
+class TiledImagePlanes
+{
+public:
+    TiledImagePlanes(int width, int height, qint64 cache_bytes);
+
+    bool isValid() const;
+
+    int width() const;
+    int height() const;
+    QRect rect() const;
+
+    ImagePlanes read(QRect rect);
+    bool write(QPoint position, const ImagePlanes &planes);
+    bool write(QPoint position, const ImagePlanes &planes, const SelectionMask &mask);
+
+    bool importImage(const QImage &image);
+    bool importImageFile(const QString &filename, qint64 strip_bytes);
+
+    QImage toImage();
+    bool savePixmap(const QString &filename);
+
+    static qint64 tileBytes();
+
+private:
+    struct Tile {
+        std::vector<float> data;    // 3 planes of TILE_SIZE x TILE_SIZE floats
+        bool dirty;                 // Modified since it was loaded
+        quint64 last_use;
+    };
+
+    float *tile(int tx, int ty, bool modify);
+    bool evictTile();
+    bool importPixmapFile(QFile &file);
+
+    int m_width;
+    int m_height;
+    int m_tiles_x;
+    int m_tiles_y;
+
+    QTemporaryFile m_file;
+    bool m_valid;
+
+    // Tiles written to the file at least once (the other ones are null)
+    QVector<bool> m_on_disk;
+
+    QHash<int, Tile> m_cache;
+    int m_max_cached_tiles;
+    quint64 m_use_counter;
+};
+
+#endif // TILEDIMAGEPLANES_H
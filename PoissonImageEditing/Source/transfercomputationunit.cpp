@@ -2,11 +2,12 @@
 #include "computationhandler.h"
 #include "pastedsourceitem.h"
 
-TransferComputationUnit::TransferComputationUnit(QImage source_image, QPainterPath selection_path)
+TransferComputationUnit::TransferComputationUnit(QImage source_image, QPainterPath selection_path, SolverType solver_type)
     : QObject(), QRunnable()
 {
     m_source_image = source_image;
     m_selection_path = selection_path;
+    m_solver_type = solver_type;
 
     setAutoDelete(false);
 }
@@ -23,46 +24,71 @@ void TransferComputationUnit::run() {
 }
 
 void TransferComputationUnit::computeTransferData() {
-    // Convert the image into RGB matrices
-    ImageMatricesRGB img_mat = ComputationHandler::imageToMatrices(m_source_image);
+    // Convert the image into RGB planes
+    ImagePlanes img_planes = ComputationHandler::imageToPlanes(m_source_image);
 
-    // Compute the selection masks
-    SelectMaskMatrices smm = ComputationHandler::selectionToMask(m_selection_path);
+    // Compute the selection mask
+    SelectionMask mask = ComputationHandler::selectionToMask(m_selection_path);
 
-    // Compute the masked original image
-    ImageMatricesRGB masked_src_img;
-    masked_src_img[0] = img_mat[0].cwiseProduct(smm.positive_mask);
-    masked_src_img[1] = img_mat[1].cwiseProduct(smm.positive_mask);
-    masked_src_img[2] = img_mat[2].cwiseProduct(smm.positive_mask);
+    // Convert the masked image planes to QImage
+    QImage masked_img = ComputationHandler::planesToImage(img_planes, mask);
 
-    // Convert the masked image matrices to QImage
-    QImage masked_img = ComputationHandler::matricesToImage(masked_src_img, smm.positive_mask);
 
+    // Assign a row of the linear system to each pixel inside the mask
+    UnknownIndexMap index_map = ComputationHandler::maskToIndexMap(mask);
 
-    // Compute the Laplacian matrix
-    // Remove 2px (1px margin top/bottom; right/left)
-    SparseMatrixXd laplacian_mat = ComputationHandler::laplacianMatrix(m_source_image.size() - QSize(2,2), smm);
+    // Disconnected parts of the selection (the blendings solve them concurrently)
+    UnknownComponentsPtr components(new QVector<UnknownComponent>(ComputationHandler::connectedComponents(index_map)));
+
+    // Guidance field of the plain blending (the same for every position of the item)
+    GuidanceFieldPtr guidance(new MatrixX3d(ComputationHandler::computeGuidanceField(img_planes, index_map)));
+
+    // Factorize the Laplacian once (reused by every blending of this item), only for the direct solver.
+    // The iterative solvers never use it, and full rectangles are always solved by the fast Poisson solver.
+    // Otherwise the blending and the boundary response factorize it if they need it.
+    LaplacianFactorizationPtr factorization;
+
+    if (m_solver_type == SolverCholesky && !ComputationHandler::isFullRectangle(index_map)) {
+        // Assemble the Laplacian matrix, only to factorize it (the iterative solvers are matrix-free)
+        SparseMatrixXd laplacian_mat = ComputationHandler::laplacianMatrix(index_map);
+        factorization = ComputationHandler::factorizeLaplacian(laplacian_mat);
+    }
 
     // Save computed results
-    m_original_matrices     = img_mat;
-    m_masks                 = smm;
+    m_original_planes       = img_planes;
+    m_mask                  = mask;
+    m_index_map             = index_map;
+    m_components            = components;
+    m_guidance              = guidance;
     m_original_image_masked = masked_img;
-    m_laplacian             = laplacian_mat;
+    m_factorization         = factorization;
 }
 
 
-ImageMatricesRGB TransferComputationUnit::getOriginalMatrices() {
-    return m_original_matrices;
+ImagePlanes TransferComputationUnit::getOriginalPlanes() {
+    return m_original_planes;
+}
+
+SelectionMask TransferComputationUnit::getMask() {
+    return m_mask;
+}
+
+UnknownIndexMap TransferComputationUnit::getIndexMap() {
+    return m_index_map;
+}
+
+UnknownComponentsPtr TransferComputationUnit::getComponents() {
+    return m_components;
 }
 
-SelectMaskMatrices TransferComputationUnit::getMasks() {
-    return m_masks;
+GuidanceFieldPtr TransferComputationUnit::getGuidanceField() {
+    return m_guidance;
 }
 
 QImage TransferComputationUnit::getOriginalImageMasked() {
     return m_original_image_masked;
 }
 
-SparseMatrixXd TransferComputationUnit::getLaplacian() {
-    return m_laplacian;
+LaplacianFactorizationPtr TransferComputationUnit::getFactorization() {
+    return m_factorization;
 }
@@ -14,14 +14,17 @@ class TransferComputationUnit : public QObject, public QRunnable
     Q_OBJECT
 
 public:
-    TransferComputationUnit(QImage source_image, QPainterPath selection_path);
+    TransferComputationUnit(QImage source_image, QPainterPath selection_path, SolverType solver_type);
 
     void run() override;
 
-    ImageMatricesRGB getOriginalMatrices();
-    SelectMaskMatrices getMasks();
+    ImagePlanes getOriginalPlanes();
+    SelectionMask getMask();
+    UnknownIndexMap getIndexMap();
+    UnknownComponentsPtr getComponents();
+    GuidanceFieldPtr getGuidanceField();
     QImage getOriginalImageMasked();
-    SparseMatrixXd getLaplacian();
+    LaplacianFactorizationPtr getFactorization();
 
 signals:
     void computationStarted();
@@ -33,12 +36,16 @@ private:
     // Input attributes
     QImage m_source_image;
     QPainterPath m_selection_path;
+    SolverType m_solver_type;
 
     // Output attributes
-    ImageMatricesRGB m_original_matrices;
-    SelectMaskMatrices m_masks;
+    ImagePlanes m_original_planes;
+    SelectionMask m_mask;
+    UnknownIndexMap m_index_map;
+    UnknownComponentsPtr m_components;
+    GuidanceFieldPtr m_guidance;
     QImage m_original_image_masked;
-    SparseMatrixXd m_laplacian;
+    LaplacianFactorizationPtr m_factorization;
 };
 
 #endif // TRANSFERCOMPUTATIONUNIT_H